@@ -0,0 +1,167 @@
+/* kexec-loader - Arena allocator and string pool
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* An arena hands out memory from large blocks which are only ever released all
+ * at once. Objects allocated from an arena must not be passed to free() or any
+ * of the list_del()/list_nuke() functions.
+ *
+ * A string pool stores each distinct string once in its arena, so targets which
+ * share a root device, kernel or command line also share the memory for it.
+ * Strings returned by a pool are valid until strpool_free() is called and must
+ * not be modified.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "misc.h"
+
+#define ARENA_ALIGN(x) (((x) + (2 * sizeof(void*) - 1)) & ~(2 * sizeof(void*) - 1))
+
+/* Allocate zeroed memory from an arena */
+void *arena_alloc(kl_arena *arena, size_t size) {
+	kl_arena_block *block = arena->blocks;
+	
+	size = ARENA_ALIGN(size);
+	
+	if(!block || block->size - block->used < size) {
+		size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		
+		block = kl_malloc(sizeof(kl_arena_block) + bsize);
+		block->size = bsize;
+		block->used = 0;
+		
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	
+	void *ptr = block->data + block->used;
+	block->used += size;
+	
+	return ptr;
+}
+
+/* Duplicate a string into an arena */
+char *arena_strdup(kl_arena *arena, char const *src) {
+	size_t len = strlen(src);
+	
+	char *dest = arena_alloc(arena, len+1);
+	memcpy(dest, src, len+1);
+	
+	return dest;
+}
+
+/* Release all memory held by an arena */
+void arena_free(kl_arena *arena) {
+	kl_arena_block *block = arena->blocks, *x;
+	
+	while(block) {
+		x = block;
+		block = block->next;
+		
+		free(x);
+	}
+	
+	arena->blocks = NULL;
+}
+
+/* FNV-1a hash of a string */
+unsigned int strpool_hash(char const *str, size_t len) {
+	unsigned int hash = 2166136261U;
+	size_t i;
+	
+	for(i = 0; i < len; i++) {
+		hash ^= (unsigned char)(str[i]);
+		hash *= 16777619U;
+	}
+	
+	return hash;
+}
+
+/* Double the size of the pool's hash table */
+static void strpool_grow(kl_strpool *pool) {
+	size_t nbuckets = pool->nbuckets ? pool->nbuckets * 2 : 256, i;
+	kl_strpool_ent **buckets = kl_malloc(nbuckets * sizeof(kl_strpool_ent*));
+	
+	for(i = 0; i < pool->nbuckets; i++) {
+		kl_strpool_ent *ent = pool->buckets[i], *next;
+		
+		while(ent) {
+			next = ent->next;
+			
+			ent->next = buckets[ent->hash % nbuckets];
+			buckets[ent->hash % nbuckets] = ent;
+			
+			ent = next;
+		}
+	}
+	
+	free(pool->buckets);
+	pool->buckets = buckets;
+	pool->nbuckets = nbuckets;
+}
+
+/* Return the pooled copy of the first len bytes of a string, adding it to the
+ * pool if it is not already present.
+*/
+char const *strpool_intern_n(kl_strpool *pool, char const *str, size_t len) {
+	if(len == 0) {
+		return "";
+	}
+	
+	if(pool->count >= pool->nbuckets) {
+		strpool_grow(pool);
+	}
+	
+	unsigned int hash = strpool_hash(str, len);
+	kl_strpool_ent *ent = pool->buckets[hash % pool->nbuckets];
+	
+	for(; ent; ent = ent->next) {
+		if(ent->hash == hash && strncmp(ent->str, str, len) == 0 && ent->str[len] == '\0') {
+			return ent->str;
+		}
+	}
+	
+	ent = arena_alloc(&(pool->arena), sizeof(kl_strpool_ent) + len + 1);
+	ent->hash = hash;
+	memcpy(ent->str, str, len);
+	ent->str[len] = '\0';
+	
+	ent->next = pool->buckets[hash % pool->nbuckets];
+	pool->buckets[hash % pool->nbuckets] = ent;
+	pool->count++;
+	
+	return ent->str;
+}
+
+/* Return the pooled copy of a string */
+char const *strpool_intern(kl_strpool *pool, char const *str) {
+	return strpool_intern_n(pool, str, strlen(str));
+}
+
+/* Release all strings and any other allocations from the pool's arena */
+void strpool_free(kl_strpool *pool) {
+	arena_free(&(pool->arena));
+	
+	free(pool->buckets);
+	pool->buckets = NULL;
+	pool->nbuckets = 0;
+	pool->count = 0;
+}
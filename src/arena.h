@@ -0,0 +1,72 @@
+/* kexec-loader - Arena allocator and string pool header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_ARENA_H
+#define KL_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE	(16 * 1024)
+
+typedef struct kl_arena_block {
+	struct kl_arena_block *next;
+	
+	size_t size;
+	size_t used;
+	
+	char data[];
+} kl_arena_block;
+
+#define INIT_ARENA(ptr) \
+	(ptr)->blocks = NULL;
+
+typedef struct kl_arena {
+	kl_arena_block *blocks;
+} kl_arena;
+
+typedef struct kl_strpool_ent {
+	struct kl_strpool_ent *next;
+	unsigned int hash;
+	
+	char str[];
+} kl_strpool_ent;
+
+#define INIT_STRPOOL(ptr) \
+	INIT_ARENA(&((ptr)->arena)); \
+	(ptr)->buckets = NULL; \
+	(ptr)->nbuckets = 0; \
+	(ptr)->count = 0;
+
+typedef struct kl_strpool {
+	kl_arena arena;
+	
+	kl_strpool_ent **buckets;
+	size_t nbuckets;
+	size_t count;
+} kl_strpool;
+
+void *arena_alloc(kl_arena *arena, size_t size);
+char *arena_strdup(kl_arena *arena, char const *src);
+void arena_free(kl_arena *arena);
+
+unsigned int strpool_hash(char const *str, size_t len);
+char const *strpool_intern(kl_strpool *pool, char const *str);
+char const *strpool_intern_n(kl_strpool *pool, char const *str, size_t len);
+void strpool_free(kl_strpool *pool);
+
+#endif /* !KL_ARENA_H */
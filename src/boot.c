@@ -24,54 +24,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <fcntl.h>
 
 #include "misc.h"
 #include "disk.h"
 #include "console.h"
 #include "vfs.h"
-
-#define MAX_ARGV 256
-
-#define ARGV_COPY(s) \
-	if(argc+1 == MAX_ARGV) { \
-		printD("Too many arguments for kexec"); \
-		goto CLEANUP; \
-	} \
-	argv[argc++] = kl_strdup(s); \
-	argv[argc] = NULL;
-
-#define ARGV_ADD(s) \
-	if(argc+1 == MAX_ARGV) { \
-		printD("Too many arguments for kexec"); \
-		goto CLEANUP; \
-	} \
-	argv[argc++] = s; \
-	argv[argc] = NULL;
-
-#define ARGV_PRINTF(...) \
-	if(argc+1 == MAX_ARGV) { \
-		printD("Too many arguments for kexec"); \
-		goto CLEANUP; \
-	} \
-	argv[argc++] = kl_sprintf(__VA_ARGS__); \
-	argv[argc] = NULL;
-
-#define MOUNT_VPATH(path) \
-	tmp = vfs_translate_path(path); \
-	if(!tmp) { \
-		printD("%s: %s", path, kl_strerror(errno)); \
-		goto CLEANUP; \
-	}
-
-int kexec_main(int argc, char **argv);
+#include "log.h"
+#include "kexec.h"
 
 /* Boot the target passed to it
  * Returns on error
 */
 void boot_target(kl_target *target) {
-	char *argv[MAX_ARGV], *tmp;
-	int argc = 0, status;
+	kl_kexec_result res;
+	kl_initrd *iptr;
 	
 	vfs_set_root(target->root);
 	
@@ -80,9 +47,9 @@ void boot_target(kl_target *target) {
 	printd("device: %s", target->root);
 	printd("kernel: %s", target->kernel);
 	
-	if(target->initrd[0])
+	for(iptr = target->initrds; iptr; iptr = iptr->next)
 	{
-		printd("initrd: %s", target->initrd);
+		printd("initrd: %s%s%s", iptr->path, (iptr->dest[0] ? " as " : ""), iptr->dest);
 	}
 	
 	if(target->cmdline[0] || target->append[0])
@@ -95,55 +62,28 @@ void boot_target(kl_target *target) {
 	
 	printm("");
 	
-	ARGV_COPY("kexec");
-	ARGV_COPY("-l");
+	printd("Loading kernel...");
 	
-	MOUNT_VPATH(target->kernel);
-	ARGV_ADD(tmp);
+	/* Modules loaded since startup (e.g. from the shell) */
+	reclaim_modules();
 	
-	if(target->initrd[0]) {
-		MOUNT_VPATH(target->initrd);
-		ARGV_PRINTF("--initrd=%s", tmp);
-		free(tmp);
-	}
-	if(target->cmdline[0]) {
-		ARGV_PRINTF("--command-line=%s", target->cmdline);
-	}
-	if(target->append[0]) {
-		ARGV_PRINTF("--append=%s", target->append);
-	}
-	if(target->flags & TARGET_RESET) {
-		ARGV_COPY("--reset-vga");
-	}
+	console_sync();
 	
-	kl_module *modptr = target->modules;
-	while(modptr) {
-		MOUNT_VPATH(modptr->name);
-		
-		if(modptr->args[0]) {
-			ARGV_PRINTF("--module=%s %s", tmp, modptr->args);
+	int loaded = kl_kexec_load(target, kl_kexec_mode(), &res);
+	console_lostpos();
+	
+	debug("%s using %s (build %lu ms, load %lu ms)",
+		(loaded ? "Loaded kernel" : "Failed to load kernel"),
+		(res.method ? res.method : "nothing"), res.build_ms, res.load_ms);
+	
+	if(!loaded) {
+		if(res.sys_errno) {
+			printD("%s: %s: %s", kl_kexec_strerror(res.error), res.detail, kl_strerror(res.sys_errno));
 		}else{
-			ARGV_PRINTF("--module=%s", tmp);
+			printD("%s: %s", kl_kexec_strerror(res.error), res.detail);
 		}
 		
-		free(tmp);
-		modptr = modptr->next;
-	}
-	
-	printd("Loading kernel...");
-	
-	pid_t pid = fork();
-	if(pid == -1) {
-		printD("Fork failed: %s", strerror(errno));
-		goto CLEANUP;
-	}else if(pid == 0) {
-		exit(kexec_main(argc, argv));
-	}
-	
-	wait(&status);
-	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-		alert = 1;
-		goto CLEANUP;
+		return;
 	}
 	
 	printd("Booting system...");
@@ -151,9 +91,4 @@ void boot_target(kl_target *target) {
 	call_reboot(LINUX_REBOOT_CMD_KEXEC);
 	
 	printD("Reboot failed: %s", strerror(errno));
-	
-	CLEANUP:
-	while(argc) {
-		free(argv[--argc]);
-	}
 }
@@ -0,0 +1,520 @@
+/* kexec-loader - Menu cache
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* The menu cache is a compiled copy of the boot targets, kmod options and
+ * timeout produced by parsing kexec-loader.conf and any GRUB configuration. It
+ * records the size and modification time of every file which was read (or
+ * looked for and not found) while building the menu, if they all still match
+ * at the next boot the cache is mapped and used in place of parsing them.
+ *
+ * Strings in targets loaded from the cache point directly into the mapping,
+ * which is never unmapped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "misc.h"
+#include "console.h"
+#include "disk.h"
+#include "vfs.h"
+#include "cache.h"
+
+struct source {
+	struct source *next;
+	
+	char *path;
+	int exists;
+	struct stat st;
+};
+
+struct strtab {
+	char *buf;
+	uint32_t size;
+	uint32_t alloc;
+};
+
+int menu_cached = 0;
+
+static struct source *sources = NULL;
+static int cache_disabled = 0;
+
+/* Record a file which the menu depends on
+ * Files which do not exist are recorded too, the cache is invalidated if they
+ * are created later.
+*/
+void cache_add_source(char const *path) {
+	char *apath = vfs_absolute_path(path);
+	if(!apath) {
+		debug("Cannot resolve %s: %s", path, kl_strerror(errno));
+		cache_disable("a source file can't be checked");
+		
+		return;
+	}
+	
+	struct source *src = kl_malloc(sizeof(struct source));
+	
+	src->path = apath;
+	src->exists = (vfs_stat(apath, &(src->st)) == 0);
+	
+	list_add(&sources, src);
+}
+
+/* Stop the menu from being cached, when it depends on something which can't be
+ * recorded as a source.
+*/
+void cache_disable(char const *reason) {
+	if(!cache_disabled) {
+		debug("Not caching menu, %s", reason);
+		cache_disabled = 1;
+	}
+}
+
+/* Check the recorded size and modification time of a source file */
+static int source_valid(char const *path, struct cache_source const *src) {
+	struct stat st;
+	
+	if(vfs_stat(path, &st) == -1) {
+		if(src->exists) {
+			debug("Menu cache: %s: %s", path, kl_strerror(errno));
+			return 0;
+		}
+		
+		return 1;
+	}
+	
+	if(!src->exists) {
+		debug("Menu cache: %s has been created", path);
+		return 0;
+	}
+	
+	if(st.st_size != src->size || st.st_mtim.tv_sec != src->mtime || st.st_mtim.tv_nsec != src->mtime_nsec) {
+		debug("Menu cache: %s has been modified", path);
+		return 0;
+	}
+	
+	return 1;
+}
+
+#define CACHE_STRING(off) (strings + (off))
+
+#define CACHE_CHECK(cond, msg) \
+	if(!(cond)) { \
+		debug("Menu cache: %s", msg); \
+		goto FAIL; \
+	}
+
+/* Load targets from the menu cache
+ * Returns 1 if the cache is valid and was loaded, zero otherwise
+*/
+int cache_load(char const *path) {
+	struct cache_header *header;
+	char *base = MAP_FAILED;
+	struct stat st;
+	uint32_t i, j;
+	
+	int fd = vfs_open(path, O_RDONLY);
+	if(fd == -1) {
+		if(errno != ENOENT) {
+			debug("Error opening %s: %s", path, kl_strerror(errno));
+		}
+		
+		return 0;
+	}
+	
+	CACHE_CHECK(fstat(fd, &st) == 0, strerror(errno));
+	CACHE_CHECK(st.st_size >= sizeof(struct cache_header), "File truncated");
+	
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	CACHE_CHECK(base != MAP_FAILED, strerror(errno));
+	
+	header = (struct cache_header*)(base);
+	
+	CACHE_CHECK(memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0, "Bad magic number");
+	CACHE_CHECK(header->version == CACHE_VERSION, "Unsupported version");
+	CACHE_CHECK(header->size == st.st_size, "File truncated");
+	
+	uint64_t tables = sizeof(struct cache_header)
+		+ (uint64_t)(header->nsources) * sizeof(struct cache_source)
+		+ (uint64_t)(header->ntargets) * sizeof(struct cache_target)
+		+ ((uint64_t)(header->nmodules) + header->nkmods) * sizeof(struct cache_module)
+		+ (uint64_t)(header->ninitrds) * sizeof(struct cache_initrd);
+	
+	CACHE_CHECK(header->strings > 0 && tables + header->strings == header->size, "Bad table sizes");
+	
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (Bytef*)(base + sizeof(struct cache_header)), header->size - sizeof(struct cache_header));
+	
+	CACHE_CHECK(crc == header->crc, "Checksum mismatch");
+	
+	struct cache_source *csrc = (struct cache_source*)(base + sizeof(struct cache_header));
+	struct cache_target *ctgt = (struct cache_target*)(csrc + header->nsources);
+	struct cache_module *cmod = (struct cache_module*)(ctgt + header->ntargets);
+	struct cache_module *ckmod = cmod + header->nmodules;
+	struct cache_initrd *cinitrd = (struct cache_initrd*)(ckmod + header->nkmods);
+	char const *strings = (char const*)(cinitrd + header->ninitrds);
+	
+	/* The string table must end with a terminator, so any offset within it
+	 * refers to a terminated string.
+	*/
+	
+	CACHE_CHECK(strings[header->strings - 1] == '\0', "Unterminated string table");
+	
+	#define CHECK_STR(off) CACHE_CHECK((off) < header->strings, "Bad string offset")
+	
+	for(i = 0; i < header->nsources; i++) {
+		CHECK_STR(csrc[i].path);
+		
+		if(!source_valid(CACHE_STRING(csrc[i].path), &(csrc[i]))) {
+			goto FAIL;
+		}
+	}
+	
+	uint32_t nmodules = 0, ninitrds = 0;
+	
+	for(i = 0; i < header->ntargets; i++) {
+		CHECK_STR(ctgt[i].title);
+		CHECK_STR(ctgt[i].root);
+		CHECK_STR(ctgt[i].kernel);
+		CHECK_STR(ctgt[i].cmdline);
+		CHECK_STR(ctgt[i].append);
+		
+		CACHE_CHECK(ctgt[i].nmodules <= header->nmodules - nmodules, "Bad module count");
+		nmodules += ctgt[i].nmodules;
+		
+		CACHE_CHECK(ctgt[i].ninitrds <= header->ninitrds - ninitrds, "Bad initrd count");
+		ninitrds += ctgt[i].ninitrds;
+	}
+	
+	for(i = 0; i < header->nmodules + header->nkmods; i++) {
+		CHECK_STR(cmod[i].name);
+		CHECK_STR(cmod[i].args);
+	}
+	
+	for(i = 0; i < header->ninitrds; i++) {
+		CHECK_STR(cinitrd[i].path);
+		CHECK_STR(cinitrd[i].dest);
+	}
+	
+	#undef CHECK_STR
+	
+	/* Everything checks out, build the lists */
+	
+	void *ttail = list_tail(&targets), *ktail = list_tail(&kmods), *mtail, *itail;
+	kl_module *mod;
+	kl_initrd *initrd;
+	
+	for(i = 0; i < header->ntargets; i++, ctgt++) {
+		kl_target *target = arena_alloc(&(conf_pool.arena), sizeof(kl_target));
+		INIT_TARGET(target);
+		
+		target->title = CACHE_STRING(ctgt->title);
+		target->flags = ctgt->flags;
+		target->root = CACHE_STRING(ctgt->root);
+		target->kernel = CACHE_STRING(ctgt->kernel);
+		target->cmdline = CACHE_STRING(ctgt->cmdline);
+		target->append = CACHE_STRING(ctgt->append);
+		
+		mtail = &(target->modules);
+		
+		for(j = 0; j < ctgt->nmodules; j++, cmod++) {
+			mod = arena_alloc(&(conf_pool.arena), sizeof(kl_module));
+			
+			mod->name = CACHE_STRING(cmod->name);
+			mod->args = CACHE_STRING(cmod->args);
+			
+			mtail = list_append(mtail, mod);
+		}
+		
+		itail = &(target->initrds);
+		
+		for(j = 0; j < ctgt->ninitrds; j++, cinitrd++) {
+			initrd = arena_alloc(&(conf_pool.arena), sizeof(kl_initrd));
+			
+			initrd->path = CACHE_STRING(cinitrd->path);
+			initrd->dest = CACHE_STRING(cinitrd->dest);
+			
+			itail = list_append(itail, initrd);
+		}
+		
+		ttail = list_append(ttail, target);
+	}
+	
+	for(i = 0; i < header->nkmods; i++, ckmod++) {
+		mod = arena_alloc(&(conf_pool.arena), sizeof(kl_module));
+		
+		mod->name = CACHE_STRING(ckmod->name);
+		mod->args = CACHE_STRING(ckmod->args);
+		
+		ktail = list_append(ktail, mod);
+	}
+	
+	if(timeout == -1) {
+		timeout = header->timeout;
+	}
+	
+	debug("Loaded %u targets from menu cache", header->ntargets);
+	
+	close(fd);
+	
+	menu_cached = 1;
+	return 1;
+	
+	FAIL:
+	debug("Not using menu cache %s", path);
+	
+	if(base != MAP_FAILED) {
+		munmap(base, st.st_size);
+	}
+	
+	close(fd);
+	
+	return 0;
+}
+
+/* Add a string to the string table, returns the offset */
+static uint32_t strtab_add(struct strtab *tab, char const *str) {
+	uint32_t len = strlen(str), off = tab->size;
+	
+	if(len == 0) {
+		return 0;
+	}
+	
+	while(tab->size + len + 1 > tab->alloc) {
+		tab->alloc = tab->alloc ? tab->alloc * 2 : 4096;
+		tab->buf = kl_realloc(tab->buf, tab->alloc);
+	}
+	
+	memcpy(tab->buf + tab->size, str, len + 1);
+	tab->size += len + 1;
+	
+	return off;
+}
+
+#define CACHE_APPEND(data, len) \
+	if((len) > 0) { \
+		memcpy(buf + pos, data, len); \
+		pos += (len); \
+	}
+
+/* Write the current menu to the cache
+ * The cache path should be qualified with vfs_absolute_path()
+ *
+ * Returns 1 on success, zero on failure
+*/
+int cache_save(char const *path) {
+	struct strtab strings = { NULL, 0, 0 };
+	struct cache_header header;
+	struct source *src;
+	kl_target *target;
+	kl_module *mod;
+	kl_initrd *initrd;
+	uint32_t i;
+	
+	if(cache_disabled) {
+		return 0;
+	}
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.timeout = timeout;
+	
+	/* Offset zero is the empty string */
+	strings.buf = kl_malloc(4096);
+	strings.size = 1;
+	strings.alloc = 4096;
+	
+	for(src = sources; src; src = src->next) {
+		header.nsources++;
+	}
+	for(target = targets; target; target = target->next) {
+		header.ntargets++;
+		
+		for(mod = target->modules; mod; mod = mod->next) {
+			header.nmodules++;
+		}
+		
+		for(initrd = target->initrds; initrd; initrd = initrd->next) {
+			header.ninitrds++;
+		}
+	}
+	for(mod = kmods; mod; mod = mod->next) {
+		header.nkmods++;
+	}
+	
+	struct cache_source *csrc = kl_malloc(header.nsources * sizeof(struct cache_source) + 1);
+	struct cache_target *ctgt = kl_malloc(header.ntargets * sizeof(struct cache_target) + 1);
+	struct cache_module *cmod = kl_malloc((header.nmodules + header.nkmods) * sizeof(struct cache_module) + 1);
+	struct cache_initrd *cinitrd = kl_malloc(header.ninitrds * sizeof(struct cache_initrd) + 1);
+	
+	for(i = 0, src = sources; src; src = src->next, i++) {
+		csrc[i].path = strtab_add(&strings, src->path);
+		csrc[i].exists = src->exists;
+		
+		if(src->exists) {
+			csrc[i].size = src->st.st_size;
+			csrc[i].mtime = src->st.st_mtim.tv_sec;
+			csrc[i].mtime_nsec = src->st.st_mtim.tv_nsec;
+		}
+	}
+	
+	uint32_t m = 0, n = 0;
+	
+	for(i = 0, target = targets; target; target = target->next, i++) {
+		ctgt[i].title = strtab_add(&strings, target->title);
+		ctgt[i].flags = target->flags;
+		ctgt[i].root = strtab_add(&strings, target->root);
+		ctgt[i].kernel = strtab_add(&strings, target->kernel);
+		ctgt[i].cmdline = strtab_add(&strings, target->cmdline);
+		ctgt[i].append = strtab_add(&strings, target->append);
+		
+		for(mod = target->modules; mod; mod = mod->next, m++) {
+			cmod[m].name = strtab_add(&strings, mod->name);
+			cmod[m].args = strtab_add(&strings, mod->args);
+			
+			ctgt[i].nmodules++;
+		}
+		
+		for(initrd = target->initrds; initrd; initrd = initrd->next, n++) {
+			cinitrd[n].path = strtab_add(&strings, initrd->path);
+			cinitrd[n].dest = strtab_add(&strings, initrd->dest);
+			
+			ctgt[i].ninitrds++;
+		}
+	}
+	
+	for(mod = kmods; mod; mod = mod->next, m++) {
+		cmod[m].name = strtab_add(&strings, mod->name);
+		cmod[m].args = strtab_add(&strings, mod->args);
+	}
+	
+	header.strings = strings.size;
+	header.size = sizeof(header)
+		+ header.nsources * sizeof(struct cache_source)
+		+ header.ntargets * sizeof(struct cache_target)
+		+ m * sizeof(struct cache_module)
+		+ n * sizeof(struct cache_initrd)
+		+ header.strings;
+	
+	char *buf = kl_malloc(header.size);
+	size_t pos = sizeof(header);
+	
+	CACHE_APPEND(csrc, header.nsources * sizeof(struct cache_source));
+	CACHE_APPEND(ctgt, header.ntargets * sizeof(struct cache_target));
+	CACHE_APPEND(cmod, m * sizeof(struct cache_module));
+	CACHE_APPEND(cinitrd, n * sizeof(struct cache_initrd));
+	CACHE_APPEND(strings.buf, strings.size);
+	
+	uLong crc = crc32(0L, Z_NULL, 0);
+	header.crc = crc32(crc, (Bytef*)(buf + sizeof(header)), header.size - sizeof(header));
+	
+	memcpy(buf, &header, sizeof(header));
+	
+	free(csrc);
+	free(ctgt);
+	free(cmod);
+	free(cinitrd);
+	free(strings.buf);
+	
+	/* The disk holding the cache is normally mounted read-only, remount it
+	 * read-write while the new cache is written and renamed into place.
+	*/
+	
+	int ret = 0, fd = -1;
+	char *disk_id = get_diskid("", path), *tmp_path = kl_sprintf("%s.tmp", path);
+	char *rpath = NULL, *rtmp_path = NULL;
+	
+	const kl_disk *disk = mount_by_id(disk_id + strlen("nojail,"), 0);
+	if(!disk) {
+		printD("Error mounting %s: %s", disk_id, kl_strerror(errno));
+		goto END;
+	}
+	
+	if(!(rpath = vfs_translate_path(path)) || !(rtmp_path = vfs_translate_path(tmp_path))) {
+		printD("%s: %s", path, kl_strerror(errno));
+		goto END;
+	}
+	
+	if(!remount_disk(disk, 1)) {
+		printD("Error remounting %s read-write: %s", disk->name, strerror(errno));
+		goto END;
+	}
+	
+	fd = open(rtmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1) {
+		printD("Error creating %s: %s", tmp_path, strerror(errno));
+		goto REMOUNT;
+	}
+	
+	for(pos = 0; pos < header.size;) {
+		ssize_t w = write(fd, buf + pos, header.size - pos);
+		
+		if(w == -1) {
+			printD("Error writing %s: %s", tmp_path, strerror(errno));
+			goto REMOUNT;
+		}
+		
+		pos += w;
+	}
+	
+	if(fsync(fd) == -1 || close(fd) == -1) {
+		fd = -1;
+		
+		printD("Error writing %s: %s", tmp_path, strerror(errno));
+		goto REMOUNT;
+	}
+	
+	fd = -1;
+	
+	if(rename(rtmp_path, rpath) == -1) {
+		printD("Error renaming %s: %s", tmp_path, strerror(errno));
+		goto REMOUNT;
+	}
+	
+	debug("Wrote %u targets to menu cache %s", header.ntargets, path);
+	ret = 1;
+	
+	REMOUNT:
+	if(fd != -1) {
+		close(fd);
+		unlink(rtmp_path);
+	}
+	
+	sync();
+	
+	if(!remount_disk(disk, 0)) {
+		printD("Error remounting %s read-only: %s", disk->name, strerror(errno));
+	}
+	
+	END:
+	free(rtmp_path);
+	free(rpath);
+	free(tmp_path);
+	free(disk_id);
+	free(buf);
+	
+	return ret;
+}
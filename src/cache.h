@@ -0,0 +1,86 @@
+/* kexec-loader - Menu cache header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_CACHE_H
+#define KL_CACHE_H
+
+#include <stdint.h>
+
+#define CACHE_MAGIC	"KLCACHE"
+#define CACHE_VERSION	2
+
+/* All offsets are relative to the start of the file, string offsets are
+ * relative to the start of the string table. Values are in host byte order,
+ * a cache is only ever read by the machine which wrote it.
+*/
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t crc;		/* CRC32 of everything after the header */
+	uint32_t size;		/* Size of the whole file */
+	
+	int32_t timeout;
+	
+	uint32_t nsources;
+	uint32_t ntargets;
+	uint32_t nmodules;	/* Modules of all targets */
+	uint32_t nkmods;
+	uint32_t ninitrds;	/* Initrds of all targets */
+	uint32_t strings;	/* Size of the string table */
+} __attribute__((__packed__));
+
+struct cache_source {
+	uint32_t path;
+	int32_t exists;
+	
+	int64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+} __attribute__((__packed__));
+
+struct cache_target {
+	uint32_t title;
+	int32_t flags;
+	
+	uint32_t root;
+	uint32_t kernel;
+	uint32_t cmdline;
+	uint32_t append;
+	uint32_t nmodules;	/* Number of entries used from the modules table */
+	uint32_t ninitrds;	/* Number of entries used from the initrds table */
+} __attribute__((__packed__));
+
+struct cache_module {
+	uint32_t name;
+	uint32_t args;
+} __attribute__((__packed__));
+
+struct cache_initrd {
+	uint32_t path;
+	uint32_t dest;
+} __attribute__((__packed__));
+
+extern int menu_cached;
+
+void cache_add_source(char const *path);
+void cache_disable(char const *reason);
+int cache_load(char const *path);
+int cache_save(char const *path);
+
+#endif /* !KL_CACHE_H */
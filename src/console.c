@@ -25,12 +25,28 @@
 #include <sys/ioctl.h>
 #include <poll.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "misc.h"
 #include "console.h"
+#include "log.h"
+#include "deadline.h"
 
 #define GETC_SIZE 256
 
+/* How long to wait for a reply to a cursor position query (ms) */
+#define QUERY_TIMEOUT 500
+
+#define MAX_CONSOLES 4
+
+/* Output queued for a console beyond this is dropped */
+#define CONSOLE_QUEUE_MAX (64 * 1024)
+
+/* How long console_sync() waits for slow consoles (ms) */
+#define CONSOLE_SYNC_TIMEOUT 2000
+
 #define GETC_PUSH(x) \
 	if(getc_count < GETC_SIZE) { \
 		getc_buf[getc_count++] = x; \
@@ -44,64 +60,645 @@ int console_rows = 24;
 static int getc_count = 0;
 static int getc_buf[GETC_SIZE];
 
+/* Consoles
+ *
+ * Output is mirrored to every console listed in the consoles kernel command
+ * line option (or just stdout), and input is accepted from any of them. Each
+ * console has its own output queue and non-blocking descriptor, so a slow serial
+ * line doesn't hold up the others.
+*/
+
+struct console {
+	char name[64];
+	int in_fd, out_fd;
+	
+	int cols, rows;		/* Zero if unknown */
+	int probed;
+	int query_failed;	/* Doesn't answer position queries */
+	int eof;
+	
+	char *queue;
+	size_t qlen, qsize;
+	int resync;		/* Output was dropped */
+};
+
+static struct console consoles[MAX_CONSOLES];
+static int nconsoles = 0;
+
+/* Output to a console was dropped, the screen must be redrawn */
+static int console_resync = 0;
+
+/* Console output is fully buffered and only written out by console_flush(),
+ * which is called before waiting for input, forking and rebooting. These count
+ * what actually reached the terminals.
+*/
+
+static size_t console_out_bytes = 0;
+static unsigned int console_out_writes = 0;
+
+/* Cursor tracking
+ *
+ * Everything written to stdout passes through cursor_track(), which follows the
+ * cursor as the terminal would, so the position is normally known without
+ * asking the terminal. Anything which writes to the terminal behind our back
+ * (such as a child process) must call console_lostpos() afterwards.
+*/
+
+#define CSI_MAXARGS 4
+
+static int cursor_col = 0, cursor_row = 0;
+static int cursor_known = 0;
+static int cursor_wrap = 0;	/* Last column written, next character wraps */
+static int cursor_onlcr = 1;	/* Terminal translates \n to \r\n */
+
+static int csi_state = 0;	/* 1 = after ESC, 2 = in a CSI sequence */
+static int csi_args[CSI_MAXARGS], csi_nargs;
+
+/* Screen model
+ *
+ * Full-screen displays such as the menu are drawn into the back buffer, then
+ * screen_update() compares it with the front buffer (what the terminal is
+ * showing) and sends only the cells which changed in a single write.
+*/
+
+struct screen_cell {
+	char ch;
+	unsigned char attrib;
+};
+
+static struct screen_cell *screen_back = NULL;
+static struct screen_cell *screen_front = NULL;
+static int screen_cols = 0, screen_rows = 0;
+
+static char *screen_out = NULL;
+static size_t screen_out_len = 0, screen_out_size = 0;
+
+#define CSI_ARG(n, def) \
+	((n) < csi_nargs && csi_args[n] > 0 ? csi_args[n] : (def))
+
+/* Apply the final byte of a CSI sequence to the tracked cursor */
+static void cursor_csi(char c) {
+	switch(c) {
+		case 'H':
+		case 'f':
+			cursor_row = CSI_ARG(0, 1) - 1;
+			cursor_col = CSI_ARG(1, 1) - 1;
+			cursor_known = 1;
+			break;
+			
+		case 'A': cursor_row -= CSI_ARG(0, 1); break;
+		case 'B': cursor_row += CSI_ARG(0, 1); break;
+		case 'C': cursor_col += CSI_ARG(0, 1); break;
+		case 'D': cursor_col -= CSI_ARG(0, 1); break;
+		case 'G': cursor_col = CSI_ARG(0, 1) - 1; break;
+		case 'd': cursor_row = CSI_ARG(0, 1) - 1; break;
+		
+		/* Erase, attributes, queries and modes don't move the cursor */
+		case 'J':
+		case 'K':
+		case 'm':
+		case 'n':
+		case 'h':
+		case 'l':
+			return;
+			
+		default:
+			cursor_known = 0;
+			return;
+	}
+	
+	cursor_wrap = 0;
+	
+	if(cursor_col < 0) { cursor_col = 0; }
+	if(cursor_col >= console_cols) { cursor_col = console_cols-1; }
+	if(cursor_row < 0) { cursor_row = 0; }
+	if(cursor_row >= console_rows) { cursor_row = console_rows-1; }
+}
+
+/* Follow the cursor through data written to the terminal */
+static void cursor_track(char const *buf, size_t size) {
+	size_t i;
+	
+	for(i = 0; i < size; i++) {
+		unsigned char c = buf[i];
+		
+		if(csi_state == 1) {
+			if(c == '[') {
+				csi_state = 2;
+				csi_args[0] = 0;
+				csi_nargs = 0;
+			}else{
+				/* ESC c, ESC 8, etc. Don't try to follow these. */
+				
+				csi_state = 0;
+				cursor_known = 0;
+			}
+			
+			continue;
+		}
+		
+		if(csi_state == 2) {
+			if(isdigit(c)) {
+				if(csi_nargs == 0) {
+					csi_nargs = 1;
+				}
+				
+				if(csi_nargs <= CSI_MAXARGS) {
+					csi_args[csi_nargs-1] = csi_args[csi_nargs-1] * 10 + (c - '0');
+				}
+			}else if(c == ';') {
+				if(csi_nargs == 0) {
+					csi_nargs = 1;
+				}
+				
+				if(++csi_nargs <= CSI_MAXARGS) {
+					csi_args[csi_nargs-1] = 0;
+				}
+			}else if(c >= 0x40 && c <= 0x7E) {
+				csi_state = 0;
+				cursor_csi(c);
+			}
+			
+			continue;
+		}
+		
+		switch(c) {
+			case 0x1B:
+				csi_state = 1;
+				break;
+				
+			case '\n':
+				if(cursor_onlcr) {
+					cursor_col = 0;
+				}
+				
+				if(cursor_row < console_rows-1) {
+					cursor_row++;
+				}
+				
+				cursor_wrap = 0;
+				break;
+				
+			case '\r':
+				cursor_col = 0;
+				cursor_wrap = 0;
+				break;
+				
+			case '\b':
+				if(cursor_col > 0 && !cursor_wrap) {
+					cursor_col--;
+				}
+				
+				cursor_wrap = 0;
+				break;
+				
+			case '\t':
+				cursor_col = (cursor_col / 8 + 1) * 8;
+				
+				if(cursor_col >= console_cols) {
+					cursor_col = console_cols-1;
+				}
+				
+				break;
+				
+			default:
+				/* Control characters and UTF-8 continuation bytes
+				 * don't occupy a cell.
+				*/
+				
+				if(c < ' ' || c == 0x7F || (c >= 0x80 && c < 0xC0)) {
+					break;
+				}
+				
+				if(cursor_wrap) {
+					cursor_col = 0;
+					
+					if(cursor_row < console_rows-1) {
+						cursor_row++;
+					}
+					
+					cursor_wrap = 0;
+				}
+				
+				if(cursor_col < console_cols-1) {
+					cursor_col++;
+				}else{
+					cursor_wrap = 1;
+				}
+				
+				break;
+		}
+	}
+}
+
+/* Add data to a console's output queue
+ * If a console can't keep up its queue is thrown away and the screen is redrawn
+ * once it catches up, rather than letting it hold up the other consoles.
+*/
+static void console_queue(struct console *cons, char const *buf, size_t size) {
+	if(cons->qlen + size > CONSOLE_QUEUE_MAX) {
+		if(!cons->resync) {
+			debug("Console %s is too slow, dropping %zu bytes of output", cons->name, cons->qlen + size);
+		}
+		
+		/* CAN aborts any escape sequence left half-written */
+		
+		cons->qlen = 0;
+		cons->resync = 1;
+		console_resync = 1;
+		
+		buf = "\030\033[0m";
+		size = 5;
+	}
+	
+	if(cons->qlen + size > cons->qsize) {
+		while(cons->qlen + size > cons->qsize) {
+			cons->qsize = cons->qsize ? cons->qsize * 2 : 4096;
+		}
+		
+		cons->queue = kl_realloc(cons->queue, cons->qsize);
+	}
+	
+	memcpy(cons->queue + cons->qlen, buf, size);
+	cons->qlen += size;
+}
+
+/* Write as much of a console's queue as it will take without blocking */
+static void console_drain(struct console *cons) {
+	size_t done = 0;
+	
+	while(done < cons->qlen) {
+		ssize_t w = write(cons->out_fd, cons->queue + done, cons->qlen - done);
+		console_out_writes++;
+		
+		if(w == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			if(errno != EAGAIN) {
+				debug("Error writing to console %s: %s", cons->name, strerror(errno));
+				done = cons->qlen;
+			}
+			
+			break;
+		}
+		
+		done += w;
+		console_out_bytes += w;
+	}
+	
+	memmove(cons->queue, cons->queue + done, cons->qlen - done);
+	cons->qlen -= done;
+	
+	if(!cons->qlen) {
+		cons->resync = 0;
+	}
+}
+
+static ssize_t console_write(void *cookie, char const *buf, size_t size) {
+	int i;
+	
+	cursor_track(buf, size);
+	
+	for(i = 0; i < nconsoles; i++) {
+		console_queue(&(consoles[i]), buf, size);
+		console_drain(&(consoles[i]));
+	}
+	
+	return size;
+}
+
+/* Put a console into non-canonical mode without echo
+ * Returns 1 if the console translates \n to \r\n.
+*/
+static int console_setup(struct console *cons) {
+	struct termios attribs;
+	
+	if(tcgetattr(cons->in_fd, &attribs) == -1) {
+		debug("Error fetching %s attributes: %s", cons->name, strerror(errno));
+		return 1;
+	}
+	
+	attribs.c_lflag &= ~ICANON;
+	attribs.c_lflag &= ~ECHO;
+	
+	if(tcsetattr(cons->in_fd, TCSANOW, &attribs) == -1) {
+		debug("Error setting %s attributes: %s", cons->name, strerror(errno));
+	}
+	
+	return (attribs.c_oflag & OPOST) && (attribs.c_oflag & ONLCR);
+}
+
+/* Open the consoles listed in the consoles kernel command line option
+ * Returns the number opened.
+*/
+static int console_open_list(char const *list) {
+	char buf[256], *name, *save = NULL;
+	
+	strlcpy(buf, list, sizeof(buf));
+	
+	for(name = strtok_r(buf, ",", &save); name && nconsoles < MAX_CONSOLES; name = strtok_r(NULL, ",", &save)) {
+		struct console *cons = &(consoles[nconsoles]);
+		char path[64];
+		
+		snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/dev/", name);
+		
+		int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if(fd == -1) {
+			debug("Error opening console %s: %s", path, strerror(errno));
+			continue;
+		}
+		
+		memset(cons, 0, sizeof(*cons));
+		strlcpy(cons->name, path, sizeof(cons->name));
+		cons->in_fd = fd;
+		cons->out_fd = fd;
+		
+		nconsoles++;
+	}
+	
+	return nconsoles;
+}
+
 /* Initialize console(s) */
 void console_init(void) {
+	char const *list = get_cmdline("consoles");
+	int i;
+	
 	setvbuf(stdin, NULL, _IONBF, 0);
-	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
 	
-	struct termios attribs;
-	if(tcgetattr(fileno(stdin), &attribs) == -1) {
-		debug("Error fetching stdin attributes: %s", strerror(errno));
-		return;
+	if(!list || !console_open_list(list)) {
+		/* The standard descriptors are shared with child processes, so
+		 * they are left blocking.
+		*/
+		
+		memset(&(consoles[0]), 0, sizeof(consoles[0]));
+		strlcpy(consoles[0].name, "stdout", sizeof(consoles[0].name));
+		consoles[0].in_fd = STDIN_FILENO;
+		consoles[0].out_fd = STDOUT_FILENO;
+		
+		nconsoles = 1;
 	}
 	
-	attribs.c_lflag &= ~ICANON;
-	attribs.c_lflag &= ~ECHO;
+	for(i = 0; i < nconsoles; i++) {
+		int onlcr = console_setup(&(consoles[i]));
+		
+		if(i == 0) {
+			cursor_onlcr = onlcr;
+		}
+		
+		debug("Using console %s", consoles[i].name);
+	}
+	
+	cookie_io_functions_t funcs = { NULL, &console_write, NULL, NULL };
+	FILE *out = fopencookie(NULL, "w", funcs);
 	
-	if(tcsetattr(fileno(stdin), TCSANOW, &attribs) == -1) {
-		debug("Error setting stdin attributes: %s", strerror(errno));
+	if(out) {
+		fflush(stdout);
+		stdout = out;
+		
+		setvbuf(stdout, NULL, _IOFBF, CONSOLE_BUFSIZE);
+	}else{
+		debug("Error opening console output stream: %s", strerror(errno));
+		setvbuf(stdout, NULL, _IONBF, 0);
 	}
 	
 	console_getsize(&console_cols, &console_rows);
 	debug("Detected console size: %dx%d", console_cols, console_rows);
 }
 
+/* Write out any buffered console output
+ * Consoles which can't take it all right now keep the rest queued.
+*/
+void console_flush(void) {
+	fflush(stdout);
+}
+
 /* Set cursor position */
 void console_setpos(int col, int row) {
 	printf("%c[%d;%dH", 0x1B, row+1, col+1);
 }
 
-/* Fetch the cursor position */
-void console_getpos(int *cptr, int *rptr) {
+/* Wait up to timeout milliseconds for the output queue of one or all (NULL)
+ * consoles to empty.
+*/
+static void console_sync_queues(struct console *only, int timeout) {
+	struct timespec now, end;
+	int i;
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000;
+	
+	while(1) {
+		struct pollfd pollfds[MAX_CONSOLES];
+		struct console *pcons[MAX_CONSOLES];
+		int n = 0;
+		
+		for(i = 0; i < nconsoles; i++) {
+			if((!only || only == &(consoles[i])) && consoles[i].qlen) {
+				pollfds[n].fd = consoles[i].out_fd;
+				pollfds[n].events = POLLOUT;
+				pcons[n++] = &(consoles[i]);
+			}
+		}
+		
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+		
+		if(!n || left <= 0) {
+			break;
+		}
+		
+		if(poll(pollfds, n, left) == -1 && errno != EINTR) {
+			debug("Error polling consoles: %s", strerror(errno));
+			break;
+		}
+		
+		for(i = 0; i < n; i++) {
+			if(pollfds[i].revents) {
+				console_drain(pcons[i]);
+			}
+		}
+	}
+}
+
+/* Write out all console output, waiting for slow consoles to catch up
+ * Used before handing the terminals to something else, such as a child process
+ * or the next kernel.
+*/
+void console_sync(void) {
+	console_flush();
+	console_sync_queues(NULL, CONSOLE_SYNC_TIMEOUT);
+}
+
+/* Wait up to timeout milliseconds (-1 for no limit) for input from any console,
+ * writing out queued console output and debug messages meanwhile.
+ * Returns 1 if input is available, zero otherwise.
+*/
+int console_poll(int timeout) {
+	struct timespec now, end;
+	int i;
+	
+	console_flush();
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000;
+	
+	while(!getc_count) {
+		struct pollfd pollfds[MAX_CONSOLES * 2 + 1];
+		struct console *pcons[MAX_CONSOLES * 2 + 1];
+		int n = 0, inputs = 0;
+		
+		if((pollfds[n].fd = debug_pending()) != -1) {
+			pollfds[n].events = POLLOUT;
+			pcons[n++] = NULL;
+		}
+		
+		for(i = 0; i < nconsoles; i++) {
+			if(!consoles[i].eof) {
+				pollfds[n].fd = consoles[i].in_fd;
+				pollfds[n].events = POLLIN;
+				pcons[n++] = &(consoles[i]);
+				
+				inputs++;
+			}
+			
+			if(consoles[i].qlen) {
+				pollfds[n].fd = consoles[i].out_fd;
+				pollfds[n].events = POLLOUT;
+				pcons[n++] = &(consoles[i]);
+			}
+		}
+		
+		int left = -1;
+		
+		if(timeout >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+			
+			if(left < 0) {
+				left = 0;
+			}
+		}
+		
+		if(!inputs) {
+			return 0;
+		}
+		
+		/* Wake up in time for the boot deadline and watchdog */
+		
+		int wait = deadline_timeout(left);
+		
+		int r = poll(pollfds, n, wait);
+		if(r == -1 && errno != EINTR) {
+			debug("Error polling consoles: %s", strerror(errno));
+			return 0;
+		}
+		
+		deadline_check();
+		
+		for(i = 0; i < n && r > 0; i++) {
+			if(!pollfds[i].revents) {
+				continue;
+			}
+			
+			if(!pcons[i]) {
+				debug_flush();
+				continue;
+			}
+			
+			if(pollfds[i].events == POLLOUT) {
+				console_drain(pcons[i]);
+				continue;
+			}
+			
+			unsigned char buf[64];
+			int max = GETC_SIZE - getc_count, j;
+			
+			ssize_t len = read(pollfds[i].fd, buf, max < 64 ? max : 64);
+			
+			if(len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+				debug("End of input from console %s", pcons[i]->name);
+				pcons[i]->eof = 1;
+			}
+			
+			for(j = 0; j < len; j++) {
+				GETC_PUSH(buf[j]);
+			}
+		}
+		
+		if(r == 0 && wait == left) {
+			break;
+		}
+	}
+	
+	return getc_count > 0;
+}
+
+/* Read a character from one console, waiting at most ms milliseconds
+ * Returns EOF on timeout.
+*/
+static int getchar_timeout(struct console *cons, int ms) {
+	struct pollfd pollfds;
+	unsigned char c;
+	
+	pollfds.fd = cons->in_fd;
+	pollfds.events = POLLIN;
+	
+	while(poll(&pollfds, 1, ms) > 0) {
+		ssize_t r = read(cons->in_fd, &c, 1);
+		
+		if(r == 1) {
+			return c;
+		}else if(r == 0 || errno != EAGAIN) {
+			break;
+		}
+	}
+	
+	return EOF;
+}
+
+/* Send a string to one console, bypassing cursor tracking */
+static void console_send(struct console *cons, char const *str) {
+	console_queue(cons, str, strlen(str));
+	console_drain(cons);
+	console_sync_queues(cons, QUERY_TIMEOUT);
+}
+
+/* Ask a console where the cursor is
+ * Anything else read while waiting for the reply is kept for console_getchar().
+ * Returns 1 on success, zero if the terminal didn't answer in time.
+*/
+static int query_pos(struct console *cons, int *cptr, int *rptr) {
 	char tbuf[32];
 	int row, col, ts, i, c;
 	
-	printf("%c[6n", 0x1B);
+	console_send(cons, "\033[6n");
 	
 	while(1) {
-		c = getchar();
+		if((c = getchar_timeout(cons, QUERY_TIMEOUT)) == EOF) {
+			return 0;
+		}
 		
 		if(c == 0x1B) {
-			if((c = getchar()) == '[') {
+			if((c = getchar_timeout(cons, QUERY_TIMEOUT)) == '[') {
 				for(ts = 0; c != 'R' && ts < 31; ts++) {
-					c = getchar();
-					
-					if(c == 0x1B) {
-						ungetc(0x1B, stdin);
-						goto NEXT;
+					if((c = getchar_timeout(cons, QUERY_TIMEOUT)) == EOF) {
+						break;
 					}
 					
 					tbuf[ts] = c;
 					tbuf[ts+1] = '\0';
 				}
 				
-				if(sscanf(tbuf, "%d;%dR", &row, &col) == 2) {
+				if(c == 'R' && sscanf(tbuf, "%d;%dR", &row, &col) == 2) {
 					break;
 				}
 				
-				NEXT:
-				
 				GETC_PUSH(0x1B);
 				GETC_PUSH('[');
 				
@@ -110,7 +707,10 @@ void console_getpos(int *cptr, int *rptr) {
 				}
 			}else{
 				GETC_PUSH(0x1B);
-				GETC_PUSH(c);
+				
+				if(c != EOF) {
+					GETC_PUSH(c);
+				}
 			}
 		}else{
 			GETC_PUSH(c);
@@ -119,6 +719,42 @@ void console_getpos(int *cptr, int *rptr) {
 	
 	if(rptr) { *rptr = row-1; }
 	if(cptr) { *cptr = col-1; }
+	
+	return 1;
+}
+
+/* Fetch the cursor position
+ * The first console is only asked if the position was lost, if it doesn't
+ * answer the cursor is assumed to be at the start of the bottom row.
+*/
+void console_getpos(int *cptr, int *rptr) {
+	/* Buffered output hasn't been tracked yet */
+	console_flush();
+	
+	if(!cursor_known) {
+		if(!consoles[0].query_failed && query_pos(&(consoles[0]), &cursor_col, &cursor_row)) {
+			debug("Queried cursor position: %d,%d", cursor_col, cursor_row);
+		}else{
+			if(!consoles[0].query_failed) {
+				debug("No reply to cursor position query, assuming bottom row");
+				consoles[0].query_failed = 1;
+			}
+			
+			cursor_col = 0;
+			cursor_row = console_rows-1;
+		}
+		
+		cursor_wrap = 0;
+		cursor_known = 1;
+	}
+	
+	if(rptr) { *rptr = cursor_row; }
+	if(cptr) { *cptr = cursor_col; }
+}
+
+/* Something other than us has written to the terminal */
+void console_lostpos(void) {
+	cursor_known = 0;
 }
 
 /* Clear the console */
@@ -147,53 +783,74 @@ void console_attrib(int attrib) {
 	printf("%c[%dm", 0x1B, attrib);
 }
 
-/* Get size of console */
+/* Get size of console
+ * The smallest of the console sizes is used so that everything fits on all of
+ * them. TIOCGWINSZ is used where the terminal knows its size, serial consoles
+ * usually don't so the first call probes them by moving the cursor to the bottom
+ * right corner and asking where it ended up.
+*/
 void console_getsize(int* cols_p, int* rows_p) {
-	int old = -1, rows, cols;
-	int row, col;
+	int cols = 0, rows = 0, i;
 	
-	console_getpos(&col, &row);
-	rows = row;
-	cols = col;
+	console_flush();
 	
-	while(rows+cols != old) {
-		printf("%c[99C", 0x1B);
-		printf("%c[99B", 0x1B);
+	for(i = 0; i < nconsoles; i++) {
+		struct console *cons = &(consoles[i]);
+		struct winsize ws;
+		
+		if(ioctl(cons->out_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row) {
+			cons->cols = ws.ws_col;
+			cons->rows = ws.ws_row;
+		}else if(!cons->probed && !cons->query_failed) {
+			int c, r;
+			
+			console_send(cons, "\0337\033[999;999H");
+			
+			if(query_pos(cons, &c, &r)) {
+				cons->cols = c+1;
+				cons->rows = r+1;
+			}else{
+				debug("No reply to cursor position query on %s", cons->name);
+				cons->query_failed = 1;
+			}
+			
+			console_send(cons, "\0338");
+		}
+		
+		cons->probed = 1;
 		
-		old = rows+cols;
-		console_getpos(&cols, &rows);
+		if(cons->cols && (!cols || cons->cols < cols)) { cols = cons->cols; }
+		if(cons->rows && (!rows || cons->rows < rows)) { rows = cons->rows; }
 	}
 	
-	console_setpos(col, row);
+	if(cols && rows) {
+		console_cols = cols;
+		console_rows = rows;
+	}
 	
-	if(cols_p) { *cols_p = cols+1; }
-	if(rows_p) { *rows_p = rows+1; }
+	if(cols_p) { *cols_p = console_cols; }
+	if(rows_p) { *rows_p = console_rows; }
 }
 
-/* Erase part of the terminal  display */
+/* Erase part of the terminal display, the cursor doesn't move */
 void console_erase(char const *mode) {
-	int col, row;
-	console_getpos(&col, &row);
-	
 	printf("%c[%s", 0x1B, mode);
-	
-	console_setpos(col, row);
 }
 
 static int getchar_cbuf(void) {
-	if(getc_count) {
-		int ret = getc_buf[0], i;
-		
-		for(i = 1; i < getc_count; i++) {
-			getc_buf[i-1] = getc_buf[i];
-		}
-		
-		getc_count--;
-		
-		return ret;
+	if(!getc_count && !console_poll(-1)) {
+		return EOF;
 	}
 	
-	return getchar();
+	int ret = getc_buf[0], i;
+	
+	for(i = 1; i < getc_count; i++) {
+		getc_buf[i-1] = getc_buf[i];
+	}
+	
+	getc_count--;
+	
+	return ret;
 }
 
 /* Get a character */
@@ -201,6 +858,10 @@ int console_getchar(void) {
 	while(1) {
 		int c = getchar_cbuf();
 		
+		if(c != EOF) {
+			deadline_cancel();
+		}
+		
 		if(c == 0x7F) {
 			return KEY_BACKSPACE;
 		}
@@ -214,9 +875,9 @@ int console_getchar(void) {
 					case 0x42: return KEY_DOWN;
 					case 0x43: return KEY_RIGHT;
 					case 0x44: return KEY_LEFT;
-					case 0x31: getchar(); return KEY_HOME;
-					case 0x34: getchar(); return KEY_END;
-					case 0x33: getchar(); return KEY_DEL;
+					case 0x31: getchar_cbuf(); return KEY_HOME;
+					case 0x34: getchar_cbuf(); return KEY_END;
+					case 0x33: getchar_cbuf(); return KEY_DEL;
 				}
 				
 				/* Unknown escape, hope it's only 3 bytes */
@@ -249,4 +910,175 @@ void print2(int flags, char const *fmt, ...) {
 	}
 	
 	puts(msg);
+	console_flush();
+}
+
+/* Allocate the screen buffers, or resize them if the console size changed */
+static void screen_alloc(void) {
+	if(screen_cols == console_cols && screen_rows == console_rows) {
+		return;
+	}
+	
+	screen_cols = console_cols;
+	screen_rows = console_rows;
+	
+	free(screen_back);
+	free(screen_front);
+	
+	screen_back = kl_malloc(screen_cols * screen_rows * sizeof(struct screen_cell));
+	screen_front = kl_malloc(screen_cols * screen_rows * sizeof(struct screen_cell));
+	
+	screen_fill(0, 0, screen_cols * screen_rows, ' ', CONS_RESET);
+	screen_invalidate();
+}
+
+/* The terminal has just been cleared */
+void screen_reset(void) {
+	int i;
+	
+	screen_alloc();
+	
+	for(i = 0; i < screen_cols * screen_rows; i++) {
+		screen_front[i].ch = ' ';
+		screen_front[i].attrib = CONS_RESET;
+	}
+}
+
+/* The terminal contents are unknown, redraw every cell on the next update */
+void screen_invalidate(void) {
+	screen_alloc();
+	memset(screen_front, 0, screen_cols * screen_rows * sizeof(struct screen_cell));
+}
+
+/* Fill len cells starting at the given position, wrapping onto later rows */
+void screen_fill(int col, int row, int len, char c, int attrib) {
+	screen_alloc();
+	
+	int i = row * screen_cols + col;
+	
+	for(; len > 0 && i < screen_cols * screen_rows; len--, i++) {
+		screen_back[i].ch = c;
+		screen_back[i].attrib = attrib;
+	}
+}
+
+/* Write a string to the back buffer, truncated at the end of the row */
+void screen_puts(int col, int row, int attrib, char const *str) {
+	screen_alloc();
+	
+	struct screen_cell *cell = screen_back + row * screen_cols + col;
+	
+	for(; *str && col < screen_cols; str++, col++, cell++) {
+		cell->ch = (*str >= 0 && *str < ' ') ? '?' : *str;
+		cell->attrib = attrib;
+	}
+}
+
+/* Write a string to the back buffer and blank the rest of the row */
+void screen_line(int col, int row, int attrib, char const *str) {
+	screen_fill(0, row, screen_cols, ' ', CONS_RESET);
+	screen_puts(col, row, attrib, str);
+}
+
+static void screen_emit(char const *data, size_t len) {
+	if(screen_out_len + len > screen_out_size) {
+		while(screen_out_len + len > screen_out_size) {
+			screen_out_size = screen_out_size ? screen_out_size * 2 : 4096;
+		}
+		
+		screen_out = kl_realloc(screen_out, screen_out_size);
+	}
+	
+	memcpy(screen_out + screen_out_len, data, len);
+	screen_out_len += len;
+}
+
+static void screen_emitf(char const *fmt, ...) {
+	char buf[32];
+	va_list argv;
+	
+	va_start(argv, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, argv);
+	va_end(argv);
+	
+	screen_emit(buf, len);
+}
+
+/* Send changed cells to the terminal
+ * Moving the cursor to the next changed cell reprints a short run of unchanged
+ * cells where that is cheaper than an escape sequence.
+*/
+void screen_update(void) {
+	int crow = -1, ccol = -1, cattrib = -1, row, col, i;
+	
+	screen_alloc();
+	screen_out_len = 0;
+	
+	if(console_resync) {
+		screen_invalidate();
+		console_resync = 0;
+	}
+	
+	for(row = 0; row < screen_rows; row++) {
+		for(col = 0; col < screen_cols; col++) {
+			struct screen_cell *back = &(screen_back[row * screen_cols + col]);
+			struct screen_cell *front = &(screen_front[row * screen_cols + col]);
+			
+			if(back->ch == front->ch && back->attrib == front->attrib) {
+				continue;
+			}
+			
+			if(row != crow || col != ccol) {
+				int gap = col - ccol;
+				
+				for(i = ccol; row == crow && gap <= 4 && i < col && screen_back[row * screen_cols + i].attrib == cattrib; i++) {}
+				
+				if(row == crow && gap <= 4 && i == col) {
+					for(i = ccol; i < col; i++) {
+						screen_emit(&(screen_back[row * screen_cols + i].ch), 1);
+					}
+				}else if(row == crow) {
+					screen_emitf("\033[%dC", gap);
+				}else{
+					screen_emitf("\033[%d;%dH", row + 1, col + 1);
+				}
+			}
+			
+			if(back->attrib != cattrib) {
+				screen_emitf("\033[%dm", back->attrib);
+				cattrib = back->attrib;
+			}
+			
+			screen_emit(&(back->ch), 1);
+			*front = *back;
+			
+			crow = row;
+			ccol = col + 1;
+			
+			if(ccol == screen_cols) {
+				/* Cursor position after writing the last column depends
+				 * on the terminal.
+				*/
+				
+				crow = -1;
+			}
+		}
+	}
+	
+	if(cattrib > 0) {
+		screen_emitf("\033[%dm", CONS_RESET);
+	}
+	
+	if(!screen_out_len) {
+		return;
+	}
+	
+	size_t bytes = console_out_bytes;
+	unsigned int writes = console_out_writes;
+	
+	fwrite(screen_out, 1, screen_out_len, stdout);
+	console_flush();
+	
+	debug("Screen update: %zu bytes in %u writes",
+		console_out_bytes - bytes, console_out_writes - writes);
 }
@@ -19,6 +19,9 @@
 #ifndef KL_CONSOLE_H
 #define KL_CONSOLE_H
 
+/* Size of the console output buffer, large enough for a full redraw */
+#define CONSOLE_BUFSIZE	16384
+
 /* Console colours */
 #define CONS_BLACK	30
 #define CONS_RED	31
@@ -70,14 +73,25 @@ extern int console_cols;
 extern int console_rows;
 
 void console_init(void);
+void console_flush(void);
+void console_sync(void);
+int console_poll(int timeout);
 void console_setpos(int col, int row);
 void console_getpos(int *cptr, int *rptr);
+void console_lostpos(void);
 void console_clear(void);
 void console_fgcolour(int colour);
 void console_bgcolour(int colour);
 void console_attrib(int attrib);
 void console_getsize(int* cols_p, int* rows_p);
 void console_erase(char const *mode);
+
+void screen_reset(void);
+void screen_invalidate(void);
+void screen_fill(int col, int row, int len, char c, int attrib);
+void screen_puts(int col, int row, int attrib, char const *str);
+void screen_line(int col, int row, int attrib, char const *str);
+void screen_update(void);
 int console_getchar(void);
 
 void print2(int flags, char const *fmt, ...);
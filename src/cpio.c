@@ -0,0 +1,169 @@
+/* kexec-loader - cpio archive writer
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Writes "newc" cpio archives, which the kernel unpacks into the initramfs
+ * when they are part of the initrd. Any number of archives may be
+ * concatenated, each must start on a 4 byte boundary.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "misc.h"
+#include "cpio.h"
+
+/* Write all of a buffer, retrying short writes
+ * Returns 1 on success, zero and sets errno on error.
+*/
+int cpio_write(int fd, void const *data, size_t len) {
+	while(len) {
+		ssize_t w = write(fd, data, len);
+		
+		if(w == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			return 0;
+		}
+		
+		data = (char const*)(data) + w;
+		len -= w;
+	}
+	
+	return 1;
+}
+
+/* Copy size bytes from the current position of in to out, using sendfile()
+ * so the data isn't copied through userspace if the kernel allows it.
+ * Returns 1 on success, zero and sets errno on error.
+*/
+int cpio_copy(int out, int in, uint64_t size) {
+	char buf[65536];
+	
+	while(size) {
+		size_t chunk = size > 0x40000000 ? 0x40000000 : size;
+		ssize_t r = sendfile(out, in, NULL, chunk);
+		
+		if(r == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			/* Not supported by one of the files */
+			
+			r = read(in, buf, chunk > sizeof(buf) ? sizeof(buf) : chunk);
+			
+			if(r > 0 && !cpio_write(out, buf, r)) {
+				return 0;
+			}
+		}
+		
+		if(r == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			return 0;
+		}
+		
+		if(r == 0) {
+			/* The file was truncated */
+			
+			errno = EIO;
+			return 0;
+		}
+		
+		size -= r;
+	}
+	
+	return 1;
+}
+
+/* Pad data of the given size to a multiple of 4 bytes
+ * Returns 1 on success, zero and sets errno on error.
+*/
+int cpio_pad(int fd, uint64_t size) {
+	static char const pad[4] = {0, 0, 0, 0};
+	
+	return cpio_write(fd, pad, (4 - size % 4) % 4);
+}
+
+/* Write a newc cpio header and name, padded to a multiple of 4 bytes */
+int cpio_header(int fd, char const *name, unsigned int mode, size_t size) {
+	char hdr[512];
+	
+	if(strlen(name) > sizeof(hdr) - 128) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	
+	int len = snprintf(hdr, sizeof(hdr),
+		"070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%s",
+		0, mode, 0, 0, 1, 0, (unsigned int)(size), 0, 0, 0, 0,
+		(unsigned int)(strlen(name) + 1), 0, name);
+	
+	len++;	/* Include the NUL */
+	
+	while(len % 4) {
+		hdr[len++] = '\0';
+	}
+	
+	return cpio_write(fd, hdr, len);
+}
+
+/* Add a file to an archive as name, along with the directories leading to it
+ * since the kernel doesn't create them. The file keeps its permissions.
+ * Returns 1 on success, zero and sets errno on error.
+*/
+int cpio_file(int fd, char const *name, int in) {
+	char dir[256];
+	char const *slash;
+	struct stat st;
+	
+	name += strspn(name, "/");
+	
+	if(fstat(in, &st) == -1) {
+		return 0;
+	}
+	
+	if(!S_ISREG(st.st_mode) || st.st_size > 0xFFFFFFFF) {
+		/* newc can't hold files of 4GiB or more */
+		
+		errno = S_ISREG(st.st_mode) ? EFBIG : EINVAL;
+		return 0;
+	}
+	
+	for(slash = strchr(name, '/'); slash; slash = strchr(slash+1, '/')) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - name), name);
+		
+		if(!cpio_header(fd, dir, 040755, 0)) {
+			return 0;
+		}
+	}
+	
+	return cpio_header(fd, name, S_IFREG | (st.st_mode & 07777), st.st_size)
+		&& cpio_copy(fd, in, st.st_size)
+		&& cpio_pad(fd, st.st_size);
+}
+
+/* End an archive */
+int cpio_trailer(int fd) {
+	return cpio_header(fd, "TRAILER!!!", 0, 0);
+}
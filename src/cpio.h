@@ -0,0 +1,33 @@
+/* kexec-loader - cpio archive writer header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_CPIO_H
+#define KL_CPIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+int cpio_write(int fd, void const *data, size_t len);
+int cpio_copy(int out, int in, uint64_t size);
+int cpio_pad(int fd, uint64_t size);
+int cpio_header(int fd, char const *name, unsigned int mode, size_t size);
+int cpio_file(int fd, char const *name, int in);
+int cpio_trailer(int fd);
+
+#endif /* !KL_CPIO_H */
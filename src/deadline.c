@@ -0,0 +1,205 @@
+/* kexec-loader - Boot deadline and watchdog
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* If boot_deadline=<seconds> is passed on the kernel command line and nobody
+ * has pressed a key by the time it expires, the fallback target (or default, or
+ * first target) is booted with kexec_loader.deadline=<phase> appended to its
+ * command line, naming the phase that was running. If there is no target or it
+ * fails to boot the system is rebooted.
+ *
+ * watchdog=<seconds> opens WATCHDOG_DEV with that timeout and keeps it fed
+ * whenever we're waiting for input, so the hardware resets the system if we get
+ * stuck anywhere else. It is disarmed before booting another kernel.
+ *
+ * Both are checked from console_poll(), which wakes up in time for them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/reboot.h>
+#include <linux/watchdog.h>
+
+#include "misc.h"
+#include "console.h"
+#include "deadline.h"
+
+static long long deadline = 0;		/* Monotonic ms, zero if none */
+static char const *deadline_at = "startup";
+
+static int watchdog_fd = -1;
+static int watchdog_interval = 0;	/* ms between keepalives */
+static long long watchdog_next = 0;
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (long long)(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Read the deadline and watchdog options and open the watchdog */
+void deadline_init(void) {
+	char const *arg;
+	
+	if((arg = get_cmdline("boot_deadline")) && atoi(arg) > 0) {
+		deadline = now_ms() + atoi(arg) * 1000LL;
+		debug("Boot deadline is %d seconds", atoi(arg));
+	}
+	
+	if((arg = get_cmdline("watchdog")) && atoi(arg) > 0) {
+		int timeout = atoi(arg);
+		
+		watchdog_fd = open(WATCHDOG_DEV, O_WRONLY | O_CLOEXEC);
+		if(watchdog_fd == -1) {
+			printD("Error opening " WATCHDOG_DEV ": %s", strerror(errno));
+			return;
+		}
+		
+		if(ioctl(watchdog_fd, WDIOC_SETTIMEOUT, &timeout) == -1) {
+			debug("Error setting watchdog timeout: %s", strerror(errno));
+			ioctl(watchdog_fd, WDIOC_GETTIMEOUT, &timeout);
+		}
+		
+		debug("Watchdog timeout is %d seconds", timeout);
+		
+		watchdog_interval = timeout * 500;
+		watchdog_next = now_ms() + watchdog_interval;
+	}
+}
+
+/* Record what we're doing, for reporting if the deadline expires */
+void deadline_phase(char const *phase) {
+	debug("Entering phase '%s'", phase);
+	deadline_at = phase;
+}
+
+/* Somebody is at the console, stop the deadline */
+void deadline_cancel(void) {
+	if(deadline) {
+		debug("Key pressed, boot deadline cancelled");
+		deadline = 0;
+	}
+}
+
+/* Limit a poll() timeout (milliseconds, -1 for none) to wake up in time for
+ * the next deadline or watchdog keepalive.
+*/
+int deadline_timeout(int timeout) {
+	long long now = now_ms(), next = -1;
+	
+	if(deadline) {
+		next = deadline - now;
+	}
+	
+	if(watchdog_fd != -1 && (next < 0 || watchdog_next - now < next)) {
+		next = watchdog_next - now;
+	}
+	
+	if(next < 0 && !deadline && watchdog_fd == -1) {
+		return timeout;
+	}
+	
+	if(next < 0) {
+		next = 0;
+	}
+	
+	return (timeout < 0 || next < timeout) ? (int)(next) : timeout;
+}
+
+static kl_target *fallback_target(void) {
+	kl_target *target;
+	
+	for(target = targets; target; target = target->next) {
+		if(target->flags & TARGET_FALLBACK) {
+			return target;
+		}
+	}
+	
+	for(target = targets; target; target = target->next) {
+		if(target->flags & TARGET_DEFAULT) {
+			return target;
+		}
+	}
+	
+	return targets;
+}
+
+static void deadline_expired(void) {
+	kl_target *target = fallback_target();
+	
+	deadline = 0;
+	
+	printm("");
+	printD("Boot deadline expired during %s", deadline_at);
+	
+	if(target) {
+		kl_target copy = *target;
+		
+		copy.append = kl_sprintf("%s%skexec_loader.deadline=%s",
+			target->append, (target->append[0] ? " " : ""), deadline_at);
+		
+		printd("Booting fallback target '%s'", target->title);
+		boot_target(&copy);
+		
+		free((char*)(copy.append));
+	}
+	
+	printd("Rebooting...");
+	call_reboot(LINUX_REBOOT_CMD_RESTART);
+	
+	die("Reboot failed: %s", strerror(errno));
+}
+
+/* Feed the watchdog and check the deadline, called whenever we wake up while
+ * waiting for input.
+*/
+void deadline_check(void) {
+	long long now = now_ms();
+	
+	if(watchdog_fd != -1 && now >= watchdog_next) {
+		if(ioctl(watchdog_fd, WDIOC_KEEPALIVE, 0) == -1) {
+			debug("Error feeding watchdog: %s", strerror(errno));
+		}
+		
+		watchdog_next = now + watchdog_interval;
+	}
+	
+	if(deadline && now >= deadline) {
+		deadline_expired();
+	}
+}
+
+/* Disarm the watchdog before handing over to another kernel
+ * Drivers built with nowayout ignore this and keep running.
+*/
+void deadline_stop(void) {
+	if(watchdog_fd != -1) {
+		if(write(watchdog_fd, "V", 1) != 1) {
+			debug("Error disarming watchdog: %s", strerror(errno));
+		}
+		
+		close(watchdog_fd);
+		watchdog_fd = -1;
+	}
+}
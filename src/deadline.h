@@ -0,0 +1,31 @@
+/* kexec-loader - Boot deadline and watchdog header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_DEADLINE_H
+#define KL_DEADLINE_H
+
+#define WATCHDOG_DEV	"/dev/watchdog"
+
+void deadline_init(void);
+void deadline_phase(char const *phase);
+void deadline_cancel(void);
+int deadline_timeout(int timeout);
+void deadline_check(void);
+void deadline_stop(void);
+
+#endif /* !KL_DEADLINE_H */
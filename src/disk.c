@@ -29,15 +29,58 @@
 #include <linux/kdev_t.h>
 #include <blkid.h>
 #include <sys/mount.h>
-#include <poll.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/loop.h>
 
 #include "disk.h"
 #include "misc.h"
 #include "console.h"
 #include "grub.h"
+#include "log.h"
+#include "arena.h"
+#include "md.h"
+#include "lvm.h"
+#include "vfs.h"
 
 static kl_disk *mounts = NULL;
+static kl_image_mount *image_mounts = NULL;
+static kl_image_disk *image_disks = NULL;
+static kl_mount_opts *mount_opts = NULL;
+static int mount_discovery = 0;
+
+/* Filesystems are mounted read-only with these options unless mount-options
+ * was given for the disk, so a dirty journal doesn't have to be replayed first.
+ * Until the disk is mounted normally the filesystem may look as it did before
+ * the last commits to its journal.
+*/
+static struct {
+	char const *fstype;
+	char const *options;
+} fast_mount_options[] = {
+	{ "ext3",  "noload" },
+	{ "ext4",  "noload" },
+	{ "xfs",   "norecovery" },
+	{ "btrfs", "nologreplay" },
+	{ NULL, NULL }
+};
+
+/* Options which mount(8) would turn into flags rather than pass on */
+static struct {
+	char const *name;
+	unsigned long flag;
+} mount_flags[] = {
+	{ "defaults",   0 },
+	{ "ro",         0 },
+	{ "noatime",    MS_NOATIME },
+	{ "nodiratime", MS_NODIRATIME },
+	{ "relatime",   MS_RELATIME },
+	{ "nodev",      MS_NODEV },
+	{ "noexec",     MS_NOEXEC },
+	{ "nosuid",     MS_NOSUID },
+	{ NULL, 0 }
+};
 
 /* Get the size of a block device and format it as text
  * Copies "???" to dest on error
@@ -113,6 +156,9 @@ void mdadm(const char *arg, ...)
 	
 	debug("Executing %s...", cmdline);
 	
+	console_sync();
+	debug_sync(1000);
+	
 	pid_t pid = fork();
 	if(pid == -1)
 	{
@@ -120,7 +166,7 @@ void mdadm(const char *arg, ...)
 	}
 	else if(pid == 0)
 	{
-		FILE *debug_fh = get_debug_fh();
+		int debug_fd = debug_open_child();
 		
 		int new_stdin = open("/dev/null", O_RDONLY);
 		if(new_stdin < 0)
@@ -133,13 +179,15 @@ void mdadm(const char *arg, ...)
 		dup2(new_stdin, STDIN_FILENO);
 		close(new_stdin);
 		
-		if(debug_fh != NULL)
+		if(debug_fd != -1)
 		{
 			close(STDOUT_FILENO);
-			dup2(fileno(debug_fh), STDOUT_FILENO);
+			dup2(debug_fd, STDOUT_FILENO);
 			
 			close(STDERR_FILENO);
-			dup2(fileno(debug_fh), STDERR_FILENO);
+			dup2(debug_fd, STDERR_FILENO);
+			
+			close(debug_fd);
 		}
 		else{
 			int new_out = open("/dev/null", O_WRONLY);
@@ -172,13 +220,215 @@ void mdadm(const char *arg, ...)
 }
 #endif
 
+/* RAID arrays are assembled by scanning every block device for md superblocks
+ * the first time get_disks() is called. After that only block devices which
+ * the kernel announces (through uevents) are checked, so listing disks doesn't
+ * normally need to read any superblocks at all.
+ *
+ * RAID1 arrays with 1.x metadata are assembled by md.c, anything else is passed
+ * to mdadm if it was built in: "mdadm --assemble --scan" after a full scan and
+ * "mdadm --incremental" for new devices.
+ *
+ * If the uevent socket can't be opened, a full scan is done whenever the
+ * contents of /proc/partitions change.
+*/
+
+static int md_uevent_fd = -1;
+static int md_scanned = 0;
+static unsigned int md_partitions_hash = 0;
+
+static void md_open_uevents(void) {
+	struct sockaddr_nl addr;
+	
+	md_uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if(md_uevent_fd == -1) {
+		debug("Error opening uevent socket: %s", strerror(errno));
+		return;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	addr.nl_groups = 1;
+	
+	if(bind(md_uevent_fd, (struct sockaddr*)(&addr), sizeof(addr)) == -1) {
+		debug("Error binding uevent socket: %s", strerror(errno));
+		
+		close(md_uevent_fd);
+		md_uevent_fd = -1;
+	}
+}
+
+/* Returns a hash of /proc/partitions, or zero on error */
+static unsigned int md_hash_partitions(void) {
+	char buf[4096];
+	unsigned int hash = 0;
+	ssize_t len;
+	
+	int fd = open("/proc/partitions", O_RDONLY);
+	if(fd == -1) {
+		debug("Error opening /proc/partitions: %s", strerror(errno));
+		return 0;
+	}
+	
+	while((len = read(fd, buf, sizeof(buf))) > 0) {
+		hash = hash * 31 + strpool_hash(buf, len);
+	}
+	
+	close(fd);
+	
+	return hash;
+}
+
+/* Handle a uevent, passing newly added block devices to mdadm */
+static void md_uevent(char *msg, size_t len) {
+	char const *action = NULL, *subsystem = NULL, *devname = NULL;
+	int major = -1, minor = -1;
+	size_t off;
+	
+	for(off = 0; off < len; off += strlen(msg + off) + 1) {
+		char *field = msg + off;
+		
+		if(kl_strneq(field, "ACTION=", 7)) {
+			action = field + 7;
+		}else if(kl_strneq(field, "SUBSYSTEM=", 10)) {
+			subsystem = field + 10;
+		}else if(kl_strneq(field, "DEVNAME=", 8)) {
+			devname = field + 8;
+		}else if(kl_strneq(field, "MAJOR=", 6)) {
+			major = atoi(field + 6);
+		}else if(kl_strneq(field, "MINOR=", 6)) {
+			minor = atoi(field + 6);
+		}
+	}
+	
+	if(!action || !subsystem || !devname || !kl_streq(action, "add") || !kl_streq(subsystem, "block")) {
+		return;
+	}
+	
+	if(kl_strneq(devname, "md", 2) || kl_strneq(devname, "ram", 3) || kl_strneq(devname, "loop", 4)) {
+		return;
+	}
+	
+	char path[256];
+	snprintf(path, sizeof(path), "/dev/%s", devname);
+	
+	if(access(path, F_OK) && (major < 0 || mknod(path, 0600 | S_IFBLK, MKDEV(major, minor)))) {
+		debug("Failed to create %s device node: %s", path, strerror(errno));
+		return;
+	}
+	
+	int r = md_add_device(devname, major, minor);
+	
+	if(r == MD_NATIVE) {
+		md_assemble(0);
+	}else if(r == MD_FOREIGN) {
+		#ifdef ENABLE_MDADM
+		mdadm("--incremental", path, NULL);
+		#else
+		debug("Can't assemble the array containing %s without mdadm", path);
+		#endif
+	}
+}
+
+/* Check every block device for an md superblock and start any arrays which
+ * have enough members to run, even if degraded.
+*/
+static void md_scan(void) {
+	FILE *fh = fopen("/proc/partitions", "r");
+	if(!fh) {
+		debug("Error opening /proc/partitions: %s", strerror(errno));
+		return;
+	}
+	
+	char line[256], name[32], path[256];
+	int major, minor, foreign = 0;
+	
+	while(fgets(line, sizeof(line), fh)) {
+		if(sscanf(line, "%d %d %*u %31s", &major, &minor, name) != 3) {
+			continue;
+		}
+		
+		if(kl_strneq(name, "md", 2) || kl_strneq(name, "ram", 3) || kl_strneq(name, "loop", 4)) {
+			continue;
+		}
+		
+		snprintf(path, sizeof(path), "/dev/%s", name);
+		
+		if(access(path, F_OK) && mknod(path, 0600 | S_IFBLK, MKDEV(major, minor))) {
+			debug("Failed to create %s device node: %s", path, strerror(errno));
+			continue;
+		}
+		
+		if(md_add_device(name, major, minor) == MD_FOREIGN) {
+			foreign = 1;
+		}
+	}
+	
+	fclose(fh);
+	
+	md_assemble(1);
+	
+	if(foreign) {
+		#ifdef ENABLE_MDADM
+		mdadm("--assemble", "--scan", NULL);
+		#else
+		debug("Found md superblocks which can't be assembled without mdadm");
+		#endif
+	}
+}
+
+/* Assemble any RAID arrays which can be */
+static void md_update(void) {
+	if(!md_scanned) {
+		/* Open the socket first so no devices are missed between the
+		 * scan and the first read.
+		*/
+		
+		md_open_uevents();
+		
+		if(md_uevent_fd == -1) {
+			md_partitions_hash = md_hash_partitions();
+		}
+		
+		md_scan();
+		md_scanned = 1;
+		
+		return;
+	}
+	
+	if(md_uevent_fd == -1) {
+		unsigned int hash = md_hash_partitions();
+		
+		if(hash != md_partitions_hash) {
+			md_partitions_hash = hash;
+			md_scan();
+		}
+		
+		return;
+	}
+	
+	char msg[8192];
+	ssize_t len;
+	
+	while((len = recv(md_uevent_fd, msg, sizeof(msg) - 1, 0)) > 0) {
+		msg[len] = '\0';
+		md_uevent(msg, len);
+	}
+	
+	if(len == -1 && errno == ENOBUFS) {
+		/* The socket overflowed, we don't know what we missed */
+		
+		debug("uevent socket overflowed, rescanning for RAID arrays");
+		md_scan();
+	}
+}
+
 /* Return a list containing disks in /proc/diskstats
  * Only returns first disk matching filter if not NULL
 */
 kl_disk *get_disks(const char *filter) {
-	#ifdef ENABLE_MDADM
-	mdadm("--assemble", "--scan", NULL);
-	#endif
+	md_update();
 	
 	FILE *fh = fopen("/proc/diskstats", "r");
 	if(!fh) {
@@ -196,6 +446,12 @@ kl_disk *get_disks(const char *filter) {
 		filter = strchr(filter, ':')+1;
 	}
 	
+	if(filter && kl_strnceq(filter, "LV=", 3)) {
+		/* Logical volumes only appear once activated */
+		
+		lvm_activate(filter+3);
+	}
+	
 	while(fgets(line, 256, fh)) {
 		INIT_DISK(&disk);
 		
@@ -262,12 +518,117 @@ kl_disk *get_disks(const char *filter) {
 	return list;
 }
 
+/* Set the mount options for a disk, overriding fast_mount_options */
+void add_mount_options(char const *disk_id, char const *options) {
+	kl_mount_opts mopts;
+	
+	strlcpy(mopts.disk_id, disk_id, sizeof(mopts.disk_id));
+	strlcpy(mopts.options, options, sizeof(mopts.options));
+	
+	list_add_copy(&mount_opts, &mopts, sizeof(mopts));
+}
+
+/* While discovery is set (e.g. when searching for GRUB) disks are always
+ * mounted with the fast options. A disk mounted for discovery is mounted again
+ * by mount_by_id() afterwards if it has different options configured.
+*/
+void set_mount_discovery(int discovery) {
+	mount_discovery = discovery;
+}
+
+/* Return the options a disk should be mounted with */
+static char const *mount_options(kl_disk *disk) {
+	int i;
+	
+	if(!mount_discovery) {
+		kl_mount_opts *mopts = mount_opts;
+		
+		for(; mopts; mopts = mopts->next) {
+			if(compare_disk_id(disk, mopts->disk_id)) {
+				return mopts->options;
+			}
+		}
+	}
+	
+	for(i = 0; fast_mount_options[i].fstype; i++) {
+		if(kl_streq(disk->fstype, fast_mount_options[i].fstype)) {
+			return fast_mount_options[i].options;
+		}
+	}
+	
+	return "";
+}
+
+/* Call mount() with a comma seperated list of options, splitting out the
+ * ones which are really flags.
+*/
+static int mount_with_options(char const *dev, char const *mpoint, char const *fstype, unsigned long flags, char const *options) {
+	char data[256] = "";
+	
+	while(*options) {
+		int len = strcspn(options, ","), i;
+		
+		for(i = 0; mount_flags[i].name; i++) {
+			if(strlen(mount_flags[i].name) == len && kl_strneq(options, mount_flags[i].name, len)) {
+				flags |= mount_flags[i].flag;
+				break;
+			}
+		}
+		
+		if(!mount_flags[i].name && len) {
+			snprintf(data + strlen(data), sizeof(data) - strlen(data), "%s%.*s", data[0] ? "," : "", len, options);
+		}
+		
+		options += len;
+		options += strspn(options, ",");
+	}
+	
+	return mount(dev, mpoint, fstype, flags, data[0] ? data : NULL);
+}
+
+/* Mount a disk read-only with the given options, falling back to none if the
+ * kernel doesn't understand them.
+ * Returns 1 on success
+ * Returns 0 and sets errno on failure
+*/
+static int mount_ro(kl_disk *disk, char const *options) {
+	char dev[256], mpoint[256];
+	
+	snprintf(dev, 256, "/dev/%s", disk->name);
+	snprintf(mpoint, 256, "/mnt/%s", disk->name);
+	
+	mkdir(mpoint, 0700);
+	
+	if(mount_with_options(dev, mpoint, disk->fstype, MS_RDONLY, options) && errno != EBUSY) {
+		if(errno != EINVAL || !options[0]) {
+			return 0;
+		}
+		
+		debug("Mounting %s with \"%s\" failed, trying without", dev, options);
+		options = "";
+		
+		if(mount(dev, mpoint, disk->fstype, MS_RDONLY, NULL) && errno != EBUSY) {
+			return 0;
+		}
+	}
+	
+	if(options[0]) {
+		debug("Mounted %s at %s (%s)", dev, mpoint, options);
+	}else{
+		debug("Mounted %s at %s", dev, mpoint);
+	}
+	
+	strlcpy(disk->mopts, options, sizeof(disk->mopts));
+	disk->discovery = mount_discovery;
+	
+	return 1;
+}
+
 /* Attempt to mount a disk
  * Returns 1 on success
  * Returns 0 and sets errno on failure
 */
 int mount_disk(kl_disk *disk) {
-	char dev[256], mpoint[256];
 	kl_disk *ptr = mounts;
 	
 	if(!disk->fstype) {
@@ -275,9 +636,6 @@ int mount_disk(kl_disk *disk) {
 		return 0;
 	}
 	
-	snprintf(dev, 256, "/dev/%s", disk->name);
-	snprintf(mpoint, 256, "/mnt/%s", disk->name);
-	
 	while(ptr) {
 		if(kl_streq(disk->name, ptr->name)) {
 			debug("%s is already mounted", disk->name);
@@ -287,18 +645,104 @@ int mount_disk(kl_disk *disk) {
 		ptr = ptr->next;
 	}
 	
-	mkdir(mpoint, 0700);
-	
-	if(mount(dev, mpoint, disk->fstype, MS_RDONLY, NULL) && errno != EBUSY) {
+	if(!mount_ro(disk, mount_options(disk))) {
 		return 0;
 	}
 	
-	debug("Mounted %s at %s", dev, mpoint);
 	list_add_copy(&mounts, disk, sizeof(*disk));
 	
 	return 1;
 }
 
+/* Mount a disk which was mounted for discovery again with its configured
+ * options, if they are different.
+ * Returns 1 on success
+ * Returns 0 and sets errno on failure
+*/
+static int mount_settle(kl_disk *disk) {
+	char mpoint[256];
+	char const *options = mount_options(disk);
+	
+	disk->discovery = 0;
+	
+	if(kl_streq(disk->mopts, options)) {
+		return 1;
+	}
+	
+	snprintf(mpoint, 256, "/mnt/%s", disk->name);
+	
+	if(umount(mpoint)) {
+		debug("Error unmounting %s: %s", mpoint, strerror(errno));
+		return 1;
+	}
+	
+	if(!mount_ro(disk, options)) {
+		int err = errno;
+		
+		debug("Error mounting %s with \"%s\": %s", disk->name, options, strerror(err));
+		
+		/* Put back the mount which worked before */
+		
+		if(!mount_ro(disk, disk->mopts)) {
+			list_del(&mounts, disk);
+		}
+		
+		errno = err;
+		return 0;
+	}
+	
+	return 1;
+}
+
+/* Remount a mounted disk read-write or read-only
+ * Returns 1 on success
+ * Returns 0 and sets errno on failure
+*/
+int remount_disk(const kl_disk *disk, int rw) {
+	char dev[256], mpoint[256];
+	kl_disk *ptr = mounts;
+	
+	snprintf(dev, 256, "/dev/%s", disk->name);
+	snprintf(mpoint, 256, "/mnt/%s", disk->name);
+	
+	while(ptr && !kl_streq(ptr->name, disk->name)) {
+		ptr = ptr->next;
+	}
+	
+	if(rw && ptr && ptr->mopts[0]) {
+		/* The options may have skipped journal recovery, which must be
+		 * done before anything is written, so mount it from scratch.
+		*/
+		
+		if(umount(mpoint)) {
+			return 0;
+		}
+		
+		if(mount(dev, mpoint, disk->fstype, 0, NULL)) {
+			int err = errno;
+			
+			mount_ro(ptr, ptr->mopts);
+			
+			errno = err;
+			return 0;
+		}
+		
+		ptr->mopts[0] = '\0';
+		
+		debug("Mounted %s read-write", mpoint);
+		return 1;
+	}
+	
+	if(mount(dev, mpoint, disk->fstype, MS_REMOUNT | (rw ? 0 : MS_RDONLY), NULL)) {
+		return 0;
+	}
+	
+	debug("Remounted %s %s", mpoint, rw ? "read-write" : "read-only");
+	return 1;
+}
+
+static const kl_disk *mount_image_disk(char const *disk_id, int timeout);
+
 /* Mount a disk identified by a disk ID
  * Returns a pointer to the disk in the mounts list on success
  * Returns NULL and sets errno on failure
@@ -312,24 +756,28 @@ const kl_disk *mount_by_id(const char *disk_id, int timeout) {
 	
 	while(disk) {
 		if(compare_disk_id(disk, disk_id)) {
+			if(disk->discovery && !mount_discovery && !mount_settle(disk)) {
+				return NULL;
+			}
+			
 			return disk;
 		}
 		
 		disk = disk->next;
 	}
 	
+	if(kl_strnceq(disk_id, "IMAGE=", 6)) {
+		return mount_image_disk(disk_id, timeout);
+	}
+	
 	disk = get_disks(disk_id);
 	
 	if(!disk && timeout) {
-		struct pollfd pollfds;
-		pollfds.fd = fileno(stdin);
-		pollfds.events = POLLIN;
-		
 		console_erase(ERASE_LINE);
 		printf("\rWaiting for disk.... (Press any key to abort)");
 		
 		while(!disk && timeout--) {
-			if(poll(&pollfds, 1, 1000)) {
+			if(console_poll(1000)) {
 				console_getchar();
 				break;
 			}
@@ -363,25 +811,325 @@ const kl_disk *mount_by_id(const char *disk_id, int timeout) {
 	return disk;
 }
 
+/* Set up a loop device on fd, read-only and with direct I/O if the backing
+ * filesystem supports it so file data isn't cached twice.
+ * Returns 0 on success, -1 and sets errno on failure
+*/
+static int loop_configure(int loop, int fd, char const *file) {
+	struct loop_info64 info;
+	memset(&info, 0, sizeof(info));
+	
+	strlcpy((char*)(info.lo_file_name), file, sizeof(info.lo_file_name));
+	info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+	
+	#ifdef LOOP_CONFIGURE
+	struct loop_config config;
+	memset(&config, 0, sizeof(config));
+	
+	config.fd = fd;
+	config.info = info;
+	config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+	
+	if(ioctl(loop, LOOP_CONFIGURE, &config) == 0) {
+		return 0;
+	}
+	
+	/* Some kernels refuse direct I/O rather than falling back */
+	
+	config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	
+	if(errno == EINVAL && ioctl(loop, LOOP_CONFIGURE, &config) == 0) {
+		return 0;
+	}
+	
+	if(errno != EINVAL && errno != ENOTTY) {
+		return -1;
+	}
+	#endif
+	
+	/* Kernels before 5.8 have to be set up in steps */
+	
+	if(ioctl(loop, LOOP_SET_FD, fd) == -1) {
+		return -1;
+	}
+	
+	if(ioctl(loop, LOOP_SET_STATUS64, &info) == -1) {
+		int err = errno;
+		ioctl(loop, LOOP_CLR_FD, 0);
+		
+		errno = err;
+		return -1;
+	}
+	
+	ioctl(loop, LOOP_SET_DIRECT_IO, 1);
+	
+	return 0;
+}
+
+/* Attach a file to a free loop device, read-only
+ * The loop device is detached automatically once the returned descriptor and
+ * anything mounted from it are closed.
+ *
+ * Returns the open loop device and copies its path to dev on success
+ * Returns -1 and sets errno on failure
+*/
+static int loop_attach(char const *file, char *dev, size_t size) {
+	int ctl = -1, fd = -1, loop = -1, tries, err = 0;
+	
+	if(access(LOOP_CONTROL, F_OK) && mknod(LOOP_CONTROL, 0600 | S_IFCHR, MKDEV(10, LOOP_CONTROL_MINOR))) {
+		return -1;
+	}
+	
+	if((ctl = open(LOOP_CONTROL, O_RDWR)) == -1 || (fd = open(file, O_RDONLY)) == -1) {
+		goto FAIL;
+	}
+	
+	/* Another process may take the device between LOOP_CTL_GET_FREE and
+	 * configuring it, so try a few times.
+	*/
+	
+	for(tries = 0; tries < 4; tries++) {
+		int num = ioctl(ctl, LOOP_CTL_GET_FREE);
+		if(num == -1) {
+			goto FAIL;
+		}
+		
+		snprintf(dev, size, "/dev/loop%d", num);
+		
+		if(access(dev, F_OK) && mknod(dev, 0600 | S_IFBLK, MKDEV(7, num))) {
+			goto FAIL;
+		}
+		
+		if((loop = open(dev, O_RDONLY)) == -1) {
+			goto FAIL;
+		}
+		
+		if(loop_configure(loop, fd, file) == 0) {
+			break;
+		}
+		
+		err = errno;
+		
+		close(loop);
+		loop = -1;
+		
+		if(err != EBUSY) {
+			errno = err;
+			goto FAIL;
+		}
+	}
+	
+	if(loop == -1) {
+		goto FAIL;
+	}
+	
+	close(fd);
+	close(ctl);
+	
+	return loop;
+	
+	FAIL:
+	err = errno;
+	
+	if(loop != -1) {
+		close(loop);
+	}
+	
+	if(fd != -1) {
+		close(fd);
+	}
+	
+	if(ctl != -1) {
+		close(ctl);
+	}
+	
+	errno = err;
+	return -1;
+}
+
+/* Mount a filesystem image read-only through a loop device
+ * Images are unmounted by unmount_all() before any disks.
+ *
+ * Returns 1 on success
+ * Returns 0 and sets errno on failure
+*/
+int mount_image(char const *file, char const *mpoint, char const *fstype) {
+	char dev[64];
+	
+	int loop = loop_attach(file, dev, sizeof(dev));
+	if(loop == -1) {
+		return 0;
+	}
+	
+	mkdir(mpoint, 0700);
+	
+	int r = mount(dev, mpoint, fstype, MS_RDONLY, NULL), err = errno;
+	
+	/* Detaches the loop device if the mount failed */
+	close(loop);
+	
+	if(r) {
+		errno = err;
+		return 0;
+	}
+	
+	debug("Mounted %s at %s using %s", file, mpoint, dev);
+	
+	/* Added to the front so images mounted from within other images are
+	 * unmounted first.
+	*/
+	
+	kl_image_mount *image = kl_malloc(sizeof(kl_image_mount));
+	
+	strlcpy(image->mpoint, mpoint, sizeof(image->mpoint));
+	image->next = image_mounts;
+	image_mounts = image;
+	
+	return 1;
+}
+
+/* Mount the disk image named by an IMAGE= disk ID using a loop device
+ * The image is a VFS path, e.g. IMAGE=(nojail,LABEL=data)/iso/rescue.iso
+ *
+ * Returns a pointer to the disk in the mounts list on success
+ * Returns NULL and sets errno on failure
+*/
+static const kl_disk *mount_image_disk(char const *disk_id, int timeout) {
+	char const *file = disk_id+6;
+	char dev[64], *path;
+	int loop, err;
+	
+	if(timeout && *file == '(') {
+		/* Wait for the disk holding the image */
+		
+		char *container = get_diskid("", file);
+		char const *id = kl_strneq(container, "nojail,", 7) ? container+7 : container;
+		
+		if(!kl_streq(id, "rootfs") && !kl_streq(id, "debug") && !mount_by_id(id, timeout)) {
+			free(container);
+			return NULL;
+		}
+		
+		free(container);
+	}
+	
+	if(!(path = vfs_translate_path(file))) {
+		return NULL;
+	}
+	
+	loop = loop_attach(path, dev, sizeof(dev));
+	err = errno;
+	
+	if(loop == -1) {
+		debug("Error attaching %s to a loop device: %s", path, strerror(err));
+		free(path);
+		
+		errno = err;
+		return NULL;
+	}
+	
+	debug("Attached %s to %s", path, dev);
+	free(path);
+	
+	kl_disk disk;
+	INIT_DISK(&disk);
+	
+	struct stat st;
+	fstat(loop, &st);
+	
+	strlcpy(disk.name, dev+5, sizeof(disk.name));
+	disk.major = MAJOR(st.st_rdev);
+	disk.minor = MINOR(st.st_rdev);
+	
+	path = dev;
+	
+	BLKID_TAG(disk.label, "LABEL");
+	BLKID_TAG(disk.uuid, "UUID");
+	BLKID_TAG(disk.fstype, "TYPE");
+	
+	get_dev_size(disk.size, sizeof(disk.size), dev);
+	
+	/* Registered first so mount-options can match the IMAGE= ID */
+	
+	kl_image_disk *image = kl_malloc(sizeof(kl_image_disk));
+	
+	strlcpy(image->disk_id, disk_id, sizeof(image->disk_id));
+	strlcpy(image->name, disk.name, sizeof(image->name));
+	
+	list_add(&image_disks, image);
+	
+	int ms = mount_ro(&disk, mount_options(&disk));
+	err = errno;
+	
+	/* Detaches the loop device if the mount failed */
+	close(loop);
+	
+	if(!ms) {
+		list_del(&image_disks, image);
+		
+		errno = err;
+		return NULL;
+	}
+	
+	list_add_copy(&mounts, &disk, sizeof(disk));
+	
+	kl_disk *ptr = mounts;
+	
+	while(!kl_streq(ptr->name, disk.name)) {
+		ptr = ptr->next;
+	}
+	
+	return ptr;
+}
+
 /* Unmount all filesystems */
 void unmount_all(void) {
 	kl_disk *ptr = mounts, *dptr;
+	kl_image_disk *image_disk;
+	
+	while(image_mounts) {
+		kl_image_mount *image = image_mounts;
+		
+		if(umount(image->mpoint)) {
+			debug("Error unmounting %s: %s", image->mpoint, strerror(errno));
+		}else{
+			debug("Unmounted %s", image->mpoint);
+		}
+		
+		image_mounts = image->next;
+		free(image);
+	}
+	
+	/* Disks are unmounted in the reverse order to which they were mounted
+	 * so image disks go before the disks holding them.
+	*/
+	
+	while(ptr && ptr->next) {
+		ptr = ptr->next;
+	}
 	
 	while(ptr) {
 		char mpoint[256];
 		snprintf(mpoint, 256, "/mnt/%s", ptr->name);
 		
+		dptr = ptr;
+		ptr = list_prev(mounts, ptr);
+		
 		if(umount(mpoint)) {
 			debug("Error unmounting %s: %s", mpoint, strerror(errno));
-			ptr = ptr->next;
-		}else{
-			debug("Unmounted %s", mpoint);
-			
-			dptr = ptr;
-			ptr = ptr->next;
-			
-			list_del(&mounts, dptr);
+			continue;
 		}
+		
+		debug("Unmounted %s", mpoint);
+		
+		for(image_disk = image_disks; image_disk; image_disk = image_disk->next) {
+			if(kl_streq(image_disk->name, dptr->name)) {
+				list_del(&image_disks, image_disk);
+				break;
+			}
+		}
+		
+		list_del(&mounts, dptr);
 	}
 }
 
@@ -413,6 +1161,26 @@ int compare_disk_id(kl_disk *disk, const char *id) {
 		}
 	}
 	
+	if(kl_strnceq(id, "LV=", 3)) {
+		char const *name = lvm_devname(id+3);
+		
+		if(name && kl_streq(disk->name, name)) {
+			return 1;
+		}
+	}
+	
+	if(kl_strnceq(id, "IMAGE=", 6)) {
+		kl_image_disk *image = image_disks;
+		
+		for(; image; image = image->next) {
+			if(kl_streq(image->disk_id, id) && kl_streq(image->name, disk->name)) {
+				return 1;
+			}
+		}
+		
+		return 0;
+	}
+	
 	if(kl_strneq(id, "/dev/", 5)) {
 		id += 5;
 	}
@@ -27,7 +27,9 @@
 	(ptr)->label[0] = '\0'; \
 	(ptr)->uuid[0] = '\0'; \
 	(ptr)->fstype[0] = '\0'; \
-	(ptr)->size[0] = '\0';
+	(ptr)->size[0] = '\0'; \
+	(ptr)->mopts[0] = '\0'; \
+	(ptr)->discovery = 0;
 
 typedef struct kl_disk {
 	struct kl_disk *next;
@@ -40,11 +42,42 @@ typedef struct kl_disk {
 	char uuid[256];
 	char fstype[32];
 	char size[32];
+	
+	char mopts[256];	/* Options the disk was mounted with */
+	int discovery;		/* Mounted while mount_discovery was set */
 } kl_disk;
 
+#define LOOP_CONTROL		"/dev/loop-control"
+#define LOOP_CONTROL_MINOR	237
+
+typedef struct kl_image_mount {
+	struct kl_image_mount *next;
+	
+	char mpoint[256];
+} kl_image_mount;
+
+/* A loop device attached to the image named by an IMAGE= disk ID */
+typedef struct kl_image_disk {
+	struct kl_image_disk *next;
+	
+	char disk_id[512];
+	char name[32];
+} kl_image_disk;
+
+typedef struct kl_mount_opts {
+	struct kl_mount_opts *next;
+	
+	char disk_id[256];
+	char options[256];
+} kl_mount_opts;
+
 kl_disk *get_disks(const char *filter);
+void add_mount_options(char const *disk_id, char const *options);
+void set_mount_discovery(int discovery);
 int mount_disk(kl_disk *disk);
+int remount_disk(const kl_disk *disk, int rw);
 const kl_disk *mount_by_id(const char *disk_id, int timeout);
+int mount_image(char const *file, char const *mpoint, char const *fstype);
 void unmount_all(void);
 char *get_diskid(char const *root, char const *vpath);
 int compare_disk_id(kl_disk *disk, const char *id);
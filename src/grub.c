@@ -16,20 +16,51 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
-#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <linux/kdev_t.h>
 
 #include "misc.h"
 #include "grub.h"
 #include "console.h"
 #include "disk.h"
 #include "vfs.h"
+#include "cache.h"
 
-kl_gdev *grub_devmap = NULL;
+/* The device map is a hash table keyed by strings such as "mhd0,1,a". Each
+ * mapping is added under its full name and every shorter prefix of it, so a
+ * lookup of "hd0,1" finds a mapping for "hd0,1,a" as well. Whole disk mappings
+ * are also added under a "d" key, which is used to translate partitions with
+ * no mapping of their own.
+ *
+ * The first mapping added for a key wins, so grub-map directives take priority
+ * over device.map.
+*/
+
+#define GDEV_MATCH	'm'
+#define GDEV_DISK	'd'
+
+struct gdev_ent {
+	struct gdev_ent *next;
+	unsigned int hash;
+	
+	char *key;
+	char *device;
+	
+	int synth;	/* Added by synth_devmap() */
+};
+
+static struct gdev_ent **gdev_buckets = NULL;
+static size_t gdev_nbuckets = 0, gdev_count = 0;
 
 #define PARSE_TOKEN(first, x) \
 	if(!first && islower(*src)) { \
@@ -87,32 +118,113 @@ int parse_gdev(kl_gdev *dest, char const *src) {
 	return 0;
 }
 
-/* Search the GRUB device list for a device
+/* Build the hash key for the first parts of a GRUB device */
+static void gdev_key(char *buf, size_t size, char kind, kl_gdev const *gdev, int parts) {
+	snprintf(buf, size, "%c%s,%s,%s,%s", kind, gdev->type, gdev->p1, parts > 1 ? gdev->p2 : "", parts > 2 ? gdev->p3 : "");
+}
+
+static struct gdev_ent *gdev_find(char const *key) {
+	if(!gdev_nbuckets) {
+		return NULL;
+	}
+	
+	unsigned int hash = strpool_hash(key, strlen(key));
+	struct gdev_ent *ent = gdev_buckets[hash % gdev_nbuckets];
+	
+	for(; ent; ent = ent->next) {
+		if(ent->hash == hash && kl_streq(ent->key, key)) {
+			return ent;
+		}
+	}
+	
+	return NULL;
+}
+
+static void gdev_insert(char const *key, char const *device, int synth) {
+	size_t i;
+	
+	if(gdev_find(key)) {
+		return;
+	}
+	
+	if(gdev_count >= gdev_nbuckets) {
+		size_t nbuckets = gdev_nbuckets ? gdev_nbuckets * 2 : 64;
+		struct gdev_ent **buckets = kl_malloc(nbuckets * sizeof(struct gdev_ent*)), *ent, *next;
+		
+		for(i = 0; i < gdev_nbuckets; i++) {
+			for(ent = gdev_buckets[i]; ent; ent = next) {
+				next = ent->next;
+				
+				ent->next = buckets[ent->hash % nbuckets];
+				buckets[ent->hash % nbuckets] = ent;
+			}
+		}
+		
+		free(gdev_buckets);
+		gdev_buckets = buckets;
+		gdev_nbuckets = nbuckets;
+	}
+	
+	struct gdev_ent *ent = kl_malloc(sizeof(struct gdev_ent));
+	
+	ent->hash = strpool_hash(key, strlen(key));
+	ent->key = kl_strdup(key);
+	ent->device = kl_strdup(device);
+	ent->synth = synth;
+	
+	ent->next = gdev_buckets[ent->hash % gdev_nbuckets];
+	gdev_buckets[ent->hash % gdev_nbuckets] = ent;
+	gdev_count++;
+}
+
+static void gdev_add(kl_gdev const *gdev, int synth) {
+	char key[80];
+	int parts = gdev->p3[0] ? 3 : (gdev->p2[0] ? 2 : 1);
+	
+	for(; parts > 0; parts--) {
+		gdev_key(key, sizeof(key), GDEV_MATCH, gdev, parts);
+		gdev_insert(key, gdev->device, synth);
+	}
+	
+	if(!gdev->p2[0]) {
+		gdev_key(key, sizeof(key), GDEV_DISK, gdev, 1);
+		gdev_insert(key, gdev->device, synth);
+	}
+}
+
+/* Add a mapping to the GRUB device map */
+void add_gdev(kl_gdev const *gdev) {
+	gdev_add(gdev, 0);
+}
+
+/* A menu using a synthesised mapping can't be cached, as nothing records the
+ * disk order or EDD information it was built from.
+*/
+static char *gdev_result(struct gdev_ent *ent, char *device) {
+	if(ent->synth) {
+		cache_disable("GRUB device map was synthesised");
+	}
+	
+	return device;
+}
+
+/* Search the GRUB device map for a device
  * Return a copy of the device
 */
 char *lookup_gdev(char const *dev) {
-	kl_gdev gdev, *devptr;
+	struct gdev_ent *ent;
+	kl_gdev gdev;
+	char key[80];
 	
 	if(!parse_gdev(&gdev, dev)) {
 		return NULL;
 	}
 	
 	/* Search for absolute device mappings */
-	for(devptr = grub_devmap; devptr; devptr = devptr->next) {
-		if(!kl_streq(gdev.type, devptr->type)) {
-			continue;
-		}
-		if(!kl_streq(gdev.p1, devptr->p1)) {
-			continue;
-		}
-		if(gdev.p2[0] && !kl_streq(gdev.p2, devptr->p2)) {
-			continue;
-		}
-		if(gdev.p3[0] && !kl_streq(gdev.p3, devptr->p3)) {
-			continue;
-		}
-		
-		return kl_strdup(devptr->device);
+	gdev_key(key, sizeof(key), GDEV_MATCH, &gdev, 3);
+	
+	if((ent = gdev_find(key))) {
+		return gdev_result(ent, kl_strdup(ent->device));
 	}
 	
 	if(!isdigit(gdev.p2[0]) || gdev.p3[0]) {
@@ -120,14 +232,17 @@ char *lookup_gdev(char const *dev) {
 	}
 	
 	/* Search for whole disk device mappings */
-	for(devptr = grub_devmap; devptr; devptr = devptr->next) {
-		if(devptr->p2[0]) {
-			continue;
-		}
+	gdev_key(key, sizeof(key), GDEV_DISK, &gdev, 1);
+	
+	if((ent = gdev_find(key))) {
+		/* Partitions of disks named with a trailing digit, like nvme0n1
+		 * and mmcblk0, have a 'p' before their number.
+		*/
 		
-		if(kl_streq(gdev.type, devptr->type) && kl_streq(gdev.p1, devptr->p1)) {
-			return kl_sprintf("%s%d", devptr->device, atoi(gdev.p2)+1);
-		}
+		size_t len = strlen(ent->device);
+		char const *sep = (len && isdigit(ent->device[len-1])) ? "p" : "";
+		
+		return gdev_result(ent, kl_sprintf("%s%s%d", ent->device, sep, atoi(gdev.p2)+1));
 	}
 	
 	FLOPPY:
@@ -146,6 +261,8 @@ static void load_devmap(char const *path) {
 		return;
 	}
 	
+	cache_add_source(path);
+	
 	int line = 0, i;
 	char buf[1024], *name, *val;
 	kl_gdev gdev;
@@ -177,7 +294,7 @@ static void load_devmap(char const *path) {
 		}
 		
 		strlcpy(gdev.device, val, sizeof(gdev.device));
-		list_add_copy(&grub_devmap, &gdev, sizeof(gdev));
+		add_gdev(&gdev);
 	}
 	if(ferror(fh)) {
 		printD("Error reading device.map: %s", strerror(errno));
@@ -186,18 +303,236 @@ static void load_devmap(char const *path) {
 	fclose(fh);
 }
 
+struct edd_disk {
+	char name[32];
+	
+	uint32_t signature;
+	unsigned long long sectors;
+	int removable;
+};
+
+/* Read the first line of a sysfs attribute, returns 1 on success */
+static int read_sysfs(char *buf, size_t size, char const *fmt, ...) {
+	char path[512];
+	va_list argv;
+	
+	va_start(argv, fmt);
+	vsnprintf(path, sizeof(path), fmt, argv);
+	va_end(argv);
+	
+	FILE *fh = fopen(path, "r");
+	if(!fh) {
+		return 0;
+	}
+	
+	int ret = (fgets(buf, size, fh) != NULL);
+	fclose(fh);
+	
+	return ret;
+}
+
+static int edd_disk_cmp(void const *a, void const *b) {
+	char const *na = ((struct edd_disk const*)(a))->name;
+	char const *nb = ((struct edd_disk const*)(b))->name;
+	
+	/* Sort sdz before sdaa */
+	
+	size_t la = strlen(na), lb = strlen(nb);
+	return la != lb ? (la < lb ? -1 : 1) : strcmp(na, nb);
+}
+
+/* Returns 1 if a sysfs block device is a disk the BIOS could boot from
+ *
+ * Virtual devices (md, device-mapper, loop, ram, zram, nbd) have no device
+ * link. md and dm devices would otherwise sort ahead of the disks and carry the
+ * same signature and size as the disks beneath them. Optical drives are left
+ * out too, the BIOS numbers them separately.
+*/
+static int edd_is_disk(char const *sysfs, char const *name) {
+	char buf[16], path[512];
+	
+	snprintf(path, sizeof(path), "%s/block/%s/device", sysfs, name);
+	
+	if(access(path, F_OK)) {
+		return 0;
+	}
+	
+	/* SCSI peripheral type 5 is a CD/DVD drive */
+	
+	if(read_sysfs(buf, sizeof(buf), "%s/block/%s/device/type", sysfs, name) && atoi(buf) == 5) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+/* Read the size and MBR signature of every whole disk listed in sysfs
+ * Returns an array sorted by name, the number of disks is stored in count.
+*/
+static struct edd_disk *edd_read_disks(char const *sysfs, char const *devdir, size_t *count) {
+	struct edd_disk *disks = NULL;
+	size_t ndisks = 0;
+	char buf[64], path[512];
+	
+	snprintf(path, sizeof(path), "%s/block", sysfs);
+	
+	DIR *dh = opendir(path);
+	if(!dh) {
+		debug("Error opening %s: %s", path, strerror(errno));
+		
+		*count = 0;
+		return NULL;
+	}
+	
+	struct dirent *node;
+	
+	while((node = readdir(dh))) {
+		char const *name = node->d_name;
+		unsigned char sig[4];
+		
+		if(name[0] == '.' || strlen(name) >= sizeof(disks->name) || !edd_is_disk(sysfs, name)) {
+			continue;
+		}
+		
+		if(ndisks % 16 == 0) {
+			disks = kl_realloc(disks, (ndisks + 16) * sizeof(struct edd_disk));
+		}
+		
+		struct edd_disk *disk = &(disks[ndisks++]);
+		
+		strlcpy(disk->name, name, sizeof(disk->name));
+		disk->signature = 0;
+		disk->sectors = read_sysfs(buf, sizeof(buf), "%s/block/%s/size", sysfs, name) ? strtoull(buf, NULL, 10) : 0;
+		disk->removable = read_sysfs(buf, sizeof(buf), "%s/block/%s/removable", sysfs, name) ? atoi(buf) : 0;
+		
+		snprintf(path, sizeof(path), "%s/%s", devdir, name);
+		
+		/* Create the device node if the disk hasn't been listed yet */
+		
+		if(access(path, F_OK) && read_sysfs(buf, sizeof(buf), "%s/block/%s/dev", sysfs, name)) {
+			if(mknod(path, 0600 | S_IFBLK, MKDEV(atoi(buf), atoi(buf + strcspn(buf, ":") + 1)))) {
+				debug("Failed to create %s device node: %s", path, strerror(errno));
+			}
+		}
+		
+		int fd = open(path, O_RDONLY);
+		
+		if(fd == -1) {
+			debug("Error opening %s: %s", path, strerror(errno));
+			continue;
+		}
+		
+		if(pread(fd, sig, 4, 440) == 4) {
+			disk->signature = sig[0] | (sig[1] << 8) | (sig[2] << 16) | ((uint32_t)(sig[3]) << 24);
+		}
+		
+		close(fd);
+	}
+	
+	closedir(dh);
+	
+	qsort(disks, ndisks, sizeof(struct edd_disk), &edd_disk_cmp);
+	
+	*count = ndisks;
+	return disks;
+}
+
+/* Build a GRUB device map for systems without a device.map
+ *
+ * The kernel exports the MBR signature of each BIOS disk in /sys/firmware/edd,
+ * which is matched against the signatures read from the disks. The disk size
+ * is used to pick between disks sharing a signature. Disks which can't be
+ * matched are left unmapped. If there is no EDD information at all the fixed
+ * disks are mapped in name order.
+ *
+ * Mappings already present (grub-map) take priority. sysfs and devdir are
+ * normally "/sys" and "/dev".
+*/
+void synth_devmap(char const *sysfs, char const *devdir) {
+	size_t ndisks, i;
+	struct edd_disk *disks = edd_read_disks(sysfs, devdir, &ndisks);
+	char buf[64], path[512];
+	kl_gdev gdev;
+	
+	snprintf(path, sizeof(path), "%s/firmware/edd", sysfs);
+	
+	DIR *dh = opendir(path);
+	
+	if(!dh) {
+		debug("No EDD information (%s), mapping disks in name order", strerror(errno));
+		
+		int hd = 0;
+		
+		for(i = 0; i < ndisks; i++) {
+			if(disks[i].removable) {
+				continue;
+			}
+			
+			INIT_GDEV(&gdev);
+			
+			strcpy(gdev.type, "hd");
+			snprintf(gdev.p1, sizeof(gdev.p1), "%d", hd++);
+			strlcpy(gdev.device, disks[i].name, sizeof(gdev.device));
+			
+			debug("Mapping (%s%s) to %s", gdev.type, gdev.p1, gdev.device);
+			gdev_add(&gdev, 1);
+		}
+		
+		free(disks);
+		return;
+	}
+	
+	struct dirent *node;
+	
+	while((node = readdir(dh))) {
+		if(!kl_strneq(node->d_name, "int13_dev", 9)) {
+			continue;
+		}
+		
+		int bios = strtol(node->d_name + 9, NULL, 16);
+		
+		if(bios < 0x80 || !read_sysfs(buf, sizeof(buf), "%s/%s/mbr_signature", path, node->d_name)) {
+			continue;
+		}
+		
+		uint32_t signature = strtoul(buf, NULL, 0);
+		unsigned long long sectors = read_sysfs(buf, sizeof(buf), "%s/%s/sectors", path, node->d_name) ? strtoull(buf, NULL, 10) : 0;
+		
+		struct edd_disk *match = NULL;
+		int nmatch = 0;
+		
+		for(i = 0; i < ndisks && signature; i++) {
+			if(disks[i].signature != signature || (sectors && disks[i].sectors && disks[i].sectors != sectors)) {
+				continue;
+			}
+			
+			match = &(disks[i]);
+			nmatch++;
+		}
+		
+		if(nmatch != 1) {
+			debug("Cannot map BIOS disk 0x%02X: %d disks have signature 0x%08X", bios, nmatch, signature);
+			continue;
+		}
+		
+		INIT_GDEV(&gdev);
+		
+		strcpy(gdev.type, "hd");
+		snprintf(gdev.p1, sizeof(gdev.p1), "%d", bios - 0x80);
+		strlcpy(gdev.device, match->name, sizeof(gdev.device));
+		
+		debug("Mapping (%s%s) to %s", gdev.type, gdev.p1, gdev.device);
+		gdev_add(&gdev, 1);
+	}
+	
+	closedir(dh);
+	free(disks);
+}
+
 #define GRUB_CONV_PATH(dest, src) \
-	if(src[0] == '(') { \
-		char *dev = lookup_gdev(src); \
-		if(!dev) { \
-			printD("menu.lst:%d: Invalid GRUB device", lnum); \
-			continue; \
-		} \
-		\
-		snprintf(dest, sizeof(dest), "(%s)%s", dev, strchr(src, ')')+1); \
-		free(dev); \
-	}else{ \
-		strlcpy(dest, src, sizeof(dest)); \
+	if(!(dest = grub_conv_path(src))) { \
+		printD("menu.lst:%d: Invalid GRUB device", lnum); \
+		continue; \
 	}
 
 #define GRUB_CHECK_TOPEN() \
@@ -214,19 +549,39 @@ static void load_devmap(char const *path) {
 
 #define GRUB_ADD_TARGET() \
 	if(topen && !tskip) { \
-		if(!target.root[0]) { \
+		if(!target->root[0]) { \
 			printD("menu.lst:%d: No root device specified", topen); \
 		} \
-		if(!target.kernel[0]) { \
+		if(!target->kernel[0]) { \
 			printD("menu.lst:%d: No kernel specified", topen); \
 		} \
-		if(!target.root[0] || !target.kernel[0]) { \
-			list_nuke(target.modules); \
-		}else{ \
-			list_add_copy(&targets, &target, sizeof(target)); \
+		if(target->root[0] && target->kernel[0]) { \
+			ttail = list_append(ttail, target); \
 		} \
 	}
 
+/* Translate the GRUB device at the start of a path, if any
+ * Returns the path in conf_pool, NULL if the device is invalid
+*/
+static char const *grub_conv_path(char const *src) {
+	if(src[0] != '(') {
+		return strpool_intern(&conf_pool, src);
+	}
+	
+	char *dev = lookup_gdev(src);
+	if(!dev) {
+		return NULL;
+	}
+	
+	char *path = kl_sprintf("(%s)%s", dev, strchr(src, ')')+1);
+	char const *ret = strpool_intern(&conf_pool, path);
+	
+	free(path);
+	free(dev);
+	
+	return ret;
+}
+
 /* Load GRUB menu.lst */
 static void load_menu(char const *path) {
 	FILE *fh = vfs_fopen(path, "r");
@@ -235,12 +590,16 @@ static void load_menu(char const *path) {
 		return;
 	}
 	
+	cache_add_source(path);
+	
 	int lnum = 0, topen = 0, defnum = -1, tnum = 0, tskip;
-	char buf[1024], *name, *val;
-	kl_target target;
-	kl_module mod;
+	char *buf = NULL, *name, *val;
+	size_t bsize = 0;
+	kl_target *target = NULL;
+	kl_module *mod;
+	void *ttail = list_tail(&targets), *mtail = NULL;
 	
-	while(fgets(buf, 1024, fh)) {
+	while(getline(&buf, &bsize, fh) != -1) {
 		buf[strcspn(buf, "\r\n")] = '\0';
 		lnum++;
 		
@@ -266,14 +625,17 @@ static void load_menu(char const *path) {
 			
 			GRUB_ADD_TARGET();
 			
-			INIT_TARGET(&target);
-			strlcpy(target.title, val, sizeof(target.title));
-			target.flags |= TARGET_RESET;
+			target = arena_alloc(&(conf_pool.arena), sizeof(kl_target));
+			mtail = &(target->modules);
+			
+			INIT_TARGET(target);
+			target->title = strpool_intern(&conf_pool, val);
+			target->flags |= TARGET_RESET;
 			topen = lnum;
 			tskip = 0;
 			
 			if(tnum++ == defnum) {
-				target.flags |= TARGET_DEFAULT;
+				target->flags |= TARGET_DEFAULT;
 			}
 		}
 		
@@ -287,7 +649,7 @@ static void load_menu(char const *path) {
 					continue;
 				}
 				
-				strlcpy(target.root, dev, sizeof(target.root));
+				target->root = strpool_intern(&conf_pool, dev);
 				free(dev);
 			}else{
 				debug("Empty root device at %d, ignoring target", lnum);
@@ -299,27 +661,33 @@ static void load_menu(char const *path) {
 			GRUB_CHECK_TOPEN();
 			GRUB_CHECK_ARG();
 			
-			strlcpy(target.cmdline, next_value(val), sizeof(target.cmdline));
-			GRUB_CONV_PATH(target.kernel, val);
+			target->cmdline = strpool_intern(&conf_pool, next_value(val));
+			GRUB_CONV_PATH(target->kernel, val);
 		}
 		
 		if(kl_streq(name, "initrd")) {
 			GRUB_CHECK_TOPEN();
 			GRUB_CHECK_ARG();
 			
-			GRUB_CONV_PATH(target.initrd, val);
+			char const *initrd;
+			GRUB_CONV_PATH(initrd, val);
+			
+			/* A later initrd line replaces the earlier one */
+			target->initrds = NULL;
+			add_initrd(target, &conf_pool, initrd, "");
 		}
 		
 		if(kl_streq(name, "module")) {
 			GRUB_CHECK_TOPEN();
 			GRUB_CHECK_ARG();
 			
-			INIT_MODULE(&mod);
+			mod = arena_alloc(&(conf_pool.arena), sizeof(kl_module));
+			INIT_MODULE(mod);
 			
-			strlcpy(mod.args, next_value(val), sizeof(mod.args));
-			GRUB_CONV_PATH(mod.name, val);
+			mod->args = strpool_intern(&conf_pool, next_value(val));
+			GRUB_CONV_PATH(mod->name, val);
 			
-			list_add_copy(&target.modules, &mod, sizeof(mod));
+			mtail = list_append(mtail, mod);
 		}
 		
 		if(kl_streq(name, "chainloader")) {
@@ -332,240 +700,451 @@ static void load_menu(char const *path) {
 	
 	GRUB_ADD_TARGET();
 	
+	free(buf);
 	fclose(fh);
 }
 
-static int grub2_val(char **cur, char **next, int lnum) {
-	if(**cur == '\'' || **cur == '\"') {
-		if(!(*next = strchr((*cur) + 1, **cur))) {
-			printD("grub.cfg:%d missing terminating '%c'", lnum, **cur);
-			return 0;
+#define BLS_BATCH 64
+
+struct bls_entry {
+	char const *name;	/* File name without .conf */
+	
+	char const *title;
+	char const *version;
+	char const *machine_id;
+	char const *sort_key;
+	char const *id;
+	
+	char const *kernel;
+	char const *initrd;
+	char const *options;
+};
+
+/* Compare two version strings as RPM and the BLS specification do
+ * Returns >0 if a is newer than b, <0 if it is older, zero if equal.
+*/
+static int bls_vercmp(char const *a, char const *b) {
+	while(*a || *b) {
+		while(*a && !isalnum(*a) && *a != '~') {
+			a++;
+		}
+		while(*b && !isalnum(*b) && *b != '~') {
+			b++;
+		}
+		
+		/* A tilde sorts before anything, even the end of the string */
+		
+		if(*a == '~' || *b == '~') {
+			if(*a != '~') {
+				return 1;
+			}
+			if(*b != '~') {
+				return -1;
+			}
+			
+			a++;
+			b++;
+			
+			continue;
 		}
 		
-		(*cur)++;
+		if(!*a || !*b) {
+			break;
+		}
 		
+		char const *sa = a, *sb = b;
+		size_t la, lb;
+		int ret;
 		
-	}else{
-		*next = *cur + strcspn(*cur, "\t =");
+		if(isdigit(*a)) {
+			/* Numeric segments are newer than alphabetic ones */
+			
+			if(!isdigit(*b)) {
+				return 1;
+			}
+			
+			while(*sa == '0') {
+				sa++;
+			}
+			while(*sb == '0') {
+				sb++;
+			}
+			
+			for(a = sa; isdigit(*a); a++) {}
+			for(b = sb; isdigit(*b); b++) {}
+			
+			la = a - sa;
+			lb = b - sb;
+			
+			if(la != lb) {
+				return la > lb ? 1 : -1;
+			}
+			
+			if((ret = strncmp(sa, sb, la))) {
+				return ret;
+			}
+		}else{
+			if(isdigit(*b)) {
+				return -1;
+			}
+			
+			for(; isalpha(*a); a++) {}
+			for(; isalpha(*b); b++) {}
+			
+			la = a - sa;
+			lb = b - sb;
+			
+			if((ret = strncmp(sa, sb, la < lb ? la : lb))) {
+				return ret;
+			}
+			
+			if(la != lb) {
+				return la > lb ? 1 : -1;
+			}
+		}
 	}
 	
-	if(**next) {
-		**next = '\0';
+	if(!*a && !*b) {
+		return 0;
+	}
+	
+	return *a ? 1 : -1;
+}
+
+/* Sort entries with a sort-key first (ordered by sort-key, machine-id, then
+ * newest version first), followed by the rest in descending file name order.
+*/
+static int bls_compare(void const *ap, void const *bp) {
+	struct bls_entry const *a = *(struct bls_entry const**)(ap);
+	struct bls_entry const *b = *(struct bls_entry const**)(bp);
+	int ret;
+	
+	if(a->sort_key[0] && b->sort_key[0]) {
+		if((ret = strcmp(a->sort_key, b->sort_key)) || (ret = strcmp(a->machine_id, b->machine_id))) {
+			return ret;
+		}
 		
-		(*next)++;
-		*next += strspn(*next, "\t =");
+		if((ret = bls_vercmp(b->version, a->version))) {
+			return ret;
+		}
+	}else if(a->sort_key[0] || b->sort_key[0]) {
+		return a->sort_key[0] ? -1 : 1;
 	}
 	
-	return 1;
+	return bls_vercmp(b->name, a->name);
 }
 
-static void load_grub2_cfg(const char *filename) {
-	FILE *fh = vfs_fopen(filename, "r");
-	if(!fh) {
-		printD("Error opening grub.cfg: %s", kl_strerror(errno));
-		return;
+/* Expand $var and ${var} references in an entry value */
+static char const *bls_expand(kl_arena *arena, char const *src, bls_getenv_fn getvar, void *ctx) {
+	if(!strchr(src, '$')) {
+		return src;
+	}
+	
+	char *buf = NULL;
+	size_t len = 0, n;
+	
+	#define BLS_APPEND(str, slen) \
+		buf = kl_realloc(buf, len + (slen) + 1); \
+		memcpy(buf + len, str, slen); \
+		len += (slen); \
+		buf[len] = '\0';
+	
+	while(*src) {
+		if((n = strcspn(src, "$"))) {
+			BLS_APPEND(src, n);
+			src += n;
+			
+			continue;
+		}
+		
+		char name[128];
+		int braces = (src[1] == '{');
+		
+		src += braces + 1;
+		n = braces ? strcspn(src, "}") : strspn(src, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+		
+		strlcpy(name, src, n + 1 < sizeof(name) ? n + 1 : sizeof(name));
+		src += n;
+		
+		if(braces && *src == '}') {
+			src++;
+		}
+		
+		char const *val = getvar ? getvar(ctx, name) : NULL;
+		
+		if(!n) {
+			BLS_APPEND("$", 1);
+		}else if(val) {
+			BLS_APPEND(val, strlen(val));
+		}
 	}
 	
-	char buf[1024], *l_start;
-	int lnum = 0, entry_start = 0, skip_entry = 0;
+	#undef BLS_APPEND
+	
+	char const *ret = arena_strdup(arena, buf ? buf : "");
+	free(buf);
+	
+	return ret;
+}
+
+/* Parse a BLS entry file, returns NULL on error */
+static struct bls_entry *bls_parse(kl_arena *arena, char const *name, int fd) {
+	struct stat st;
 	
-	char default_title_buf[256], *default_title = NULL;
-	int default_index = -1, cur_index = 0;
+	if(fstat(fd, &st) == -1) {
+		printD("Error reading %s.conf: %s", name, kl_strerror(errno));
+		return NULL;
+	}
 	
-	kl_target target;
+	char *buf = kl_malloc(st.st_size + 1), *line, *val, *next;
+	ssize_t len = 0, r = 0;
 	
-	INIT_TARGET(&target);
+	while(len < st.st_size && (r = read(fd, buf + len, st.st_size - len)) > 0) {
+		len += r;
+	}
 	
-	while(fgets(buf, sizeof(buf), fh)) {
-		lnum++;
-		
-		l_start = buf + strspn(buf, "\r\n\t ");
-		l_start[strcspn(l_start, "\r\n")] = '\0';
+	if(r == -1) {
+		printD("Error reading %s.conf: %s", name, kl_strerror(errno));
 		
-		if(l_start[0] == '#' || l_start[0] == '\0') {
-			continue;
+		free(buf);
+		return NULL;
+	}
+	
+	buf[len] = '\0';
+	
+	struct bls_entry *entry = arena_alloc(arena, sizeof(struct bls_entry));
+	
+	entry->name = arena_strdup(arena, name);
+	entry->title = entry->version = entry->machine_id = entry->sort_key = entry->id = "";
+	entry->kernel = entry->initrd = entry->options = "";
+	
+	for(line = buf; line; line = next) {
+		if((next = strchr(line, '\n'))) {
+			*(next++) = '\0';
 		}
 		
-		char *cmd = l_start;
-		char *args = cmd + strcspn(cmd, "\t ");
+		line += strspn(line, "\t ");
+		line[strcspn(line, "\r")] = '\0';
 		
-		if(args[0]) {
-			*(args++) = '\0';
-			args += strspn(args, "\t ");
+		if(line[0] == '#' || line[0] == '\0') {
+			continue;
 		}
 		
-		if(kl_streq(cmd, "menuentry")) {
-			char *title = args, *s;
-			
-			if(!grub2_val(&title, &s, lnum)) {
-				goto END;
-			}
-			
-			strlcpy(target.title, title, sizeof(target.title));
+		val = next_value(line);
+		
+		if(kl_streq(line, "title")) {
+			entry->title = arena_strdup(arena, val);
+		}else if(kl_streq(line, "version")) {
+			entry->version = arena_strdup(arena, val);
+		}else if(kl_streq(line, "machine-id")) {
+			entry->machine_id = arena_strdup(arena, val);
+		}else if(kl_streq(line, "sort-key")) {
+			entry->sort_key = arena_strdup(arena, val);
+		}else if(kl_streq(line, "id")) {
+			entry->id = arena_strdup(arena, val);
+		}else if(kl_streq(line, "linux")) {
+			entry->kernel = arena_strdup(arena, val);
+		}else if(kl_streq(line, "initrd") || kl_streq(line, "options")) {
+			/* Multiple initrd/options lines are concatenated */
 			
-			if(cur_index++ == default_index || (default_title && kl_streq(default_title, title))) {
-				target.flags = TARGET_DEFAULT;
-			}
+			char const **dest = (line[0] == 'i' ? &(entry->initrd) : &(entry->options));
 			
-			entry_start = lnum;
-			skip_entry = 0;
-		}else if(kl_streq(cmd, "}") && entry_start) {
-			if(!skip_entry) {
-				if(!target.root[0]) {
-					printD("grub.cfg:%d: No root device specified", entry_start);
-				}
-				
-				if(!target.kernel[0]) {
-					printD("grub.cfg:%d: No kernel specified", entry_start);
-				}
+			if((*dest)[0]) {
+				char *cat = arena_alloc(arena, strlen(*dest) + strlen(val) + 2);
+				sprintf(cat, "%s %s", *dest, val);
 				
-				if(!target.root[0] || !target.kernel[0]) {
-					list_nuke(target.modules);
-				}else{
-					list_add_copy(&targets, &target, sizeof(target));
-				}
+				*dest = cat;
+			}else{
+				*dest = arena_strdup(arena, val);
 			}
+		}else if(kl_streq(line, "efi")) {
+			printd("%s.conf: EFI program entry, ignoring", name);
 			
-			INIT_TARGET(&target);
-			
-			entry_start = 0;
-		}else if(kl_streq(cmd, "chainloader")) {
-			printd("chainloader at grub.cfg:%d, ignoring entry", lnum);
-			skip_entry = 1;
-		}else if(kl_streq(cmd, "set")) {
-			char *env_name = args, *env_val, *s;
+			free(buf);
+			return NULL;
+		}
+	}
+	
+	free(buf);
+	return entry;
+}
+
+/* Find the BLS entries directory on a device, returns NULL if there is none */
+char *find_bls_dir(char const *device) {
+	char *dir = kl_sprintf("(%s)/loader/entries", device);
+	
+	if(vfs_exists(dir)) {
+		return dir;
+	}
+	
+	cache_add_source(dir);
+	free(dir);
+	
+	dir = kl_sprintf("(%s)/boot/loader/entries", device);
+	
+	if(vfs_exists(dir)) {
+		return dir;
+	}
+	
+	cache_add_source(dir);
+	free(dir);
+	
+	return NULL;
+}
+
+/* Load Boot Loader Specification entries from a loader/entries directory
+ *
+ * Variables in entries are expanded using getvar, which may be NULL. If added
+ * is not NULL it is called to add each target rather than appending them to
+ * the target list directly.
+ *
+ * Every entry file is opened and given to the kernel as a readahead hint before
+ * any are read, so directories with hundreds of entries do not wait for each
+ * file in turn.
+*/
+void load_bls(char const *dir, bls_getenv_fn getvar, bls_added_fn added, void *ctx) {
+	DIR *dh = vfs_opendir(dir);
+	if(!dh) {
+		printD("Error opening %s: %s", dir, kl_strerror(errno));
+		return;
+	}
+	
+	cache_add_source(dir);
+	
+	struct dirent *node;
+	char **names = NULL;
+	size_t nnames = 0, nentries = 0, i, j;
+	
+	while((node = readdir(dh))) {
+		if(node->d_name[0] == '.' || !kl_streq_end(node->d_name, ".conf")) {
+			continue;
+		}
+		
+		if(nnames % BLS_BATCH == 0) {
+			names = kl_realloc(names, (nnames + BLS_BATCH) * sizeof(char*));
+		}
+		
+		names[nnames++] = kl_strdup(node->d_name);
+	}
+	
+	closedir(dh);
+	
+	kl_arena arena;
+	INIT_ARENA(&arena);
+	
+	struct bls_entry **entries = kl_malloc((nnames + 1) * sizeof(struct bls_entry*));
+	int fds[BLS_BATCH];
+	
+	for(i = 0; i < nnames; i += BLS_BATCH) {
+		size_t batch = nnames - i < BLS_BATCH ? nnames - i : BLS_BATCH;
+		
+		for(j = 0; j < batch; j++) {
+			char *path = kl_sprintf("%s/%s", dir, names[i+j]);
 			
-			if(!grub2_val(&env_name, &env_val, lnum) || !grub2_val(&env_val, &s, lnum)) {
-				goto END;
-			}
+			cache_add_source(path);
 			
-			if(kl_streq(env_name, "root")) {
-				strlcpy(target.root, env_val, sizeof(target.root));
-			}else if(kl_streq(env_name, "default")) {
-				if(env_val[strspn(env_val, "1234567890")] == '\0') {
-					/* Value is an integer */
-					
-					default_index = atoi(env_val);
-					default_title = NULL;
-				}else{
-					default_index = -1;
-					default_title = NULL;
-					
-					if(strchr(env_val, '>')) {
-						printD("grub.cfg:%d 'default' using title of submenu item not supported", lnum);
-						continue;
-					}
-					
-					strlcpy(default_title_buf, env_val, sizeof(default_title_buf));
-					default_title = default_title_buf;
-				}
-			}else if(kl_streq(env_name, "timeout") && timeout == -1) {
-				timeout = atoi(env_val);
+			if((fds[j] = vfs_open(path, O_RDONLY)) == -1) {
+				printD("Error opening %s: %s", path, kl_strerror(errno));
+			}else{
+				posix_fadvise(fds[j], 0, 0, POSIX_FADV_WILLNEED);
 			}
-		}else if(kl_streq(cmd, "linux") || kl_streq(cmd, "linux16")) {
-			char *kernel = args, *k_args;
 			
-			if(!grub2_val(&kernel, &k_args, lnum)) {
-				goto END;
+			free(path);
+		}
+		
+		for(j = 0; j < batch; j++) {
+			if(fds[j] == -1) {
+				continue;
 			}
 			
-			strlcpy(target.kernel, kernel, sizeof(target.kernel));
-			strlcpy(target.append, k_args, sizeof(target.append));
-		}else if(kl_streq(cmd, "initrd") || kl_streq(cmd, "initrd16")) {
-			char *initrd = args, *s;
+			names[i+j][strlen(names[i+j]) - 5] = '\0';
 			
-			if(!grub2_val(&initrd, &s, lnum)) {
-				goto END;
+			if((entries[nentries] = bls_parse(&arena, names[i+j], fds[j]))) {
+				nentries++;
 			}
 			
-			strlcpy(target.initrd, initrd, sizeof(target.initrd));
-		}else if(kl_streq(cmd, "search") || kl_streq(cmd, "search.file") || kl_streq(cmd, "search.fs_label") || kl_streq(cmd, "search.fs_uuid")) {
-			enum {
-				s_unknown = 0,
-				s_file,
-				s_fs_label,
-				s_fs_uuid
-			} search_by = s_unknown;
-			
-			if(kl_streq(cmd, "search.file")) {
-				search_by = s_file;
-			}else if(kl_streq(cmd, "search.fs_label")) {
-				search_by = s_fs_label;
-			}else if(kl_streq(cmd, "search.fs_uuid")) {
-				search_by = s_fs_uuid;
+			close(fds[j]);
+		}
+	}
+	
+	qsort(entries, nentries, sizeof(struct bls_entry*), &bls_compare);
+	
+	char *device = get_diskid("", dir), *prefix;
+	
+	/* Paths in entries are relative to the directory containing loader/ */
+	
+	prefix = kl_strdup(strchr(dir, ')') + 1);
+	prefix[strlen(prefix) - strlen("/loader/entries")] = '\0';
+	
+	void *ttail = list_tail(&targets);
+	
+	for(i = 0; i < nentries; i++) {
+		struct bls_entry *entry = entries[i];
+		
+		if(!entry->kernel[0]) {
+			printD("%s.conf: No kernel specified", entry->name);
+			continue;
+		}
+		
+		char const *kernel = bls_expand(&arena, entry->kernel, getvar, ctx);
+		char *initrd = arena_strdup(&arena, bls_expand(&arena, entry->initrd, getvar, ctx));
+		
+		kl_target *target = arena_alloc(&(conf_pool.arena), sizeof(kl_target));
+		INIT_TARGET(target);
+		
+		if(entry->title[0]) {
+			target->title = strpool_intern(&conf_pool, entry->title);
+		}else if(entry->version[0]) {
+			target->title = strpool_intern(&conf_pool, entry->version);
+		}else{
+			target->title = strpool_intern(&conf_pool, entry->name);
+		}
+		
+		#define BLS_PATH(dest, src) \
+			if(src[0] == '/') { \
+				char *path = kl_sprintf("%s%s", prefix, src); \
+				dest = strpool_intern(&conf_pool, path); \
+				free(path); \
+			}else{ \
+				dest = strpool_intern(&conf_pool, src); \
 			}
+		
+		target->root = strpool_intern(&conf_pool, device);
+		BLS_PATH(target->kernel, kernel);
+		
+		/* Each initrd line may list several initrds, they are all loaded */
+		
+		while(*(initrd += strspn(initrd, "\t "))) {
+			char *next = next_value(initrd);
+			char const *ipath;
 			
-			int set_root = 0, l_set = 0;
-			
-			while(*args) {
-				int len = strcspn(args, "\t ");
-				
-				/* TODO: Handle ' and " (?) */
-				
-				char *next = args + len;
-				
-				if(strncmp(args, "--set=", strlen("--set=")) == 0)
-				{
-					len = strlen("--set");
-					next = args + len + 1;
-				}
-				else{
-					next += strspn(next, "\t ");
-				}
-				
-				int is_last = (next[0] == '\0');
-				
-				if(strncmp(args, "-f", len) == 0 || strncmp(args, "--file", len) == 0) {
-					search_by = s_file;
-				}else if(strncmp(args, "-l", len) == 0 || strncmp(args, "--label", len) == 0) {
-					search_by = s_fs_label;
-				}else if(strncmp(args, "-u", len) == 0 || strncmp(args, "--fs-uuid", len) == 0) {
-					search_by = s_fs_uuid;
-				}else if(strncmp(args, "--set", len) == 0) {
-					l_set = 1;
-				}else if(l_set && (is_last || strncmp(args, "root", len) == 0)) {
-					set_root = 1;
-					l_set = 0;
-				}
-				
-				if(is_last) {
-					break;
-				}
-				
-				args = next;
-			}
+			BLS_PATH(ipath, initrd);
+			add_initrd(target, &conf_pool, ipath, "");
 			
-			if(set_root) {
-				switch(search_by) {
-					case s_unknown:
-						printD("grub.cfg:%d: Unknown search type", lnum);
-						break;
-						
-					case s_file:
-						printD("grub.cfg:%d: search with --file unsupported", lnum);
-						break;
-						
-					case s_fs_label:
-						snprintf(target.root, sizeof(target.root), "LABEL=%s", args);
-						break;
-						
-					case s_fs_uuid:
-						snprintf(target.root, sizeof(target.root), "UUID=%s", args);
-						break;
-						
-					default:
-						break;
-				}
-			}
+			initrd = next;
+		}
+		
+		target->append = strpool_intern(&conf_pool, bls_expand(&arena, entry->options, getvar, ctx));
+		
+		#undef BLS_PATH
+		
+		if(added) {
+			added(ctx, target, entry->id[0] ? entry->id : entry->name);
+		}else{
+			ttail = list_append(ttail, target);
 		}
 	}
 	
-	if(ferror(fh)) {
-		printD("Error reading grub.cfg: %s", kl_strerror(errno));
+	for(i = 0; i < nnames; i++) {
+		free(names[i]);
 	}
 	
-	END:
-	fclose(fh);
+	free(names);
+	free(entries);
+	free(device);
+	free(prefix);
+	
+	arena_free(&arena);
 }
 
 /* Load GRUB device.map and menu.lst */
@@ -580,6 +1159,9 @@ void grub_load(const char *grub_root) {
 		
 		if(vfs_exists(path)) {
 			load_devmap(path);
+		}else{
+			cache_add_source(path);
+			synth_devmap("/sys", "/dev");
 		}
 		
 		snprintf(path, sizeof(path), "%s/grub.cfg", grub_root);
@@ -587,12 +1169,23 @@ void grub_load(const char *grub_root) {
 		if(vfs_exists(path)) {
 			load_grub2_cfg(path);
 		}else{
+			cache_add_source(path);
+			
 			snprintf(path, sizeof(path), "%s/menu.lst", grub_root);
 			
 			if(vfs_exists(path)) {
 				load_menu(path);
 			}else{
-				printD("Neither grub.cfg or menu.lst found in GRUB directory");
+				cache_add_source(path);
+				
+				char *bls = find_bls_dir(device);
+				
+				if(bls) {
+					load_bls(bls, NULL, NULL, NULL);
+					free(bls);
+				}else{
+					printD("Neither grub.cfg or menu.lst found in GRUB directory");
+				}
 			}
 		}
 	}
@@ -601,20 +1194,26 @@ void grub_load(const char *grub_root) {
 	return;
 }
 
-void grub_detect(void) {
+/* Search all disks for a GRUB installation and load it
+ * Returns 1 if one was found, zero if aborted by a keypress
+*/
+int grub_detect(void) {
 	printd("Searching for GRUB installation... (Press any key to abort)");
 	int run = 1;
 	
+	/* Only the GRUB configuration is read from these disks, so mount
+	 * them as quickly as possible.
+	*/
+	
+	set_mount_discovery(1);
+	
 	while(run) {
-		struct pollfd pollfds;
-		pollfds.fd = fileno(stdin);
-		pollfds.events = POLLIN;
-		
-		if(poll(&pollfds, 1, 1000)) {
+		if(console_poll(1000)) {
 			console_getchar();
 			printd("GRUB autodetection aborted by keypress");
 			
-			return;
+			set_mount_discovery(0);
+			return 0;
 		}
 		
 		kl_disk *disks = get_disks(NULL), *disk;
@@ -641,4 +1240,7 @@ void grub_detect(void) {
 			disk = disk->next;
 		}
 	}
+	
+	set_mount_discovery(0);
+	return 1;
 }
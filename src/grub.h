@@ -20,7 +20,6 @@
 #define KL_GRUB_H
 
 #define INIT_GDEV(ptr) \
-	(ptr)->next = NULL; \
 	(ptr)->type[0] = '\0'; \
 	(ptr)->p1[0] = '\0'; \
 	(ptr)->p2[0] = '\0'; \
@@ -28,8 +27,6 @@
 	(ptr)->device[0] = '\0';
 
 typedef struct kl_gdev {
-	struct kl_gdev *next;
-	
 	char type[16];
 	char p1[16];
 	char p2[16];
@@ -38,11 +35,17 @@ typedef struct kl_gdev {
 	char device[16];
 } kl_gdev;
 
-extern kl_gdev *grub_devmap;
+typedef char const *(*bls_getenv_fn)(void *ctx, char const *name);
+typedef void (*bls_added_fn)(void *ctx, kl_target *target, char const *id);
 
 int parse_gdev(kl_gdev *dest, char const *src);
+void add_gdev(kl_gdev const *gdev);
+void synth_devmap(char const *sysfs, char const *devdir);
 char *lookup_gdev(char const *dev);
+void load_grub2_cfg(char const *filename);
+char *find_bls_dir(char const *device);
+void load_bls(char const *dir, bls_getenv_fn getvar, bls_added_fn added, void *ctx);
 void grub_load(const char *grub_root);
-void grub_detect(void);
+int grub_detect(void);
 
 #endif /* !KL_GRUB_H */
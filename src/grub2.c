@@ -0,0 +1,1493 @@
+/* kexec-loader - GRUB 2 configuration parser
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* grub.cfg is read in a single pass. The lexer returns one command at a time
+ * with quoting removed and variables expanded, the evaluator keeps a stack of
+ * open if/menuentry/submenu/function blocks and runs the commands which affect
+ * the menu. Anything else GRUB can do is ignored.
+ *
+ * Entries inside submenus are added with the submenu titles prepended, the
+ * default entry is resolved once the whole file has been read so that paths
+ * like "1>2" or "Advanced options>Linux 6.1" can be matched.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "grub.h"
+#include "console.h"
+#include "disk.h"
+#include "vfs.h"
+#include "cache.h"
+
+#define GRUB2_MAX_DEPTH		16	/* Maximum nesting of submenus */
+#define GRUB2_MAX_SOURCE	8	/* Maximum nesting of source commands */
+#define GRUB2_ENV_BUCKETS	64
+
+enum {
+	T_EOF = 0,
+	T_SEP,
+	T_LBRACE,
+	T_RBRACE
+};
+
+enum {
+	F_IF = 0,
+	F_ENTRY,
+	F_SUBMENU,
+	F_FUNCTION,
+	F_LOOP
+};
+
+struct grub2_var {
+	struct grub2_var *next;
+	
+	char *name;
+	char *value;	/* NULL if unset */
+};
+
+struct grub2_undo {
+	char *name;
+	char *value;
+};
+
+struct grub2_pathent {
+	int index;
+	char const *title;
+	char const *id;
+};
+
+struct grub2_item {
+	struct grub2_item *next;
+	
+	kl_target *target;
+	
+	int depth;
+	struct grub2_pathent path[];
+};
+
+struct grub2_frame {
+	int type;
+	int lnum;
+	
+	int parent_active;
+	int active;
+	
+	int cond;	/* if: Evaluating a condition */
+	int taken;	/* if: A branch has been taken */
+	
+	size_t undo_mark;
+	
+	int item;	/* menuentry/submenu: Index within the parent menu, -1 if not added */
+	char const *title;
+	char const *id;
+};
+
+struct grub2_cmd {
+	char *buf;
+	size_t len, alloc;
+	
+	size_t *offs;
+	char **argv;
+	int argc, argmax;
+	
+	int word;	/* A word is in progress */
+	int lnum;
+};
+
+struct grub2_lexer {
+	FILE *fh;
+	char const *fname;
+	int lnum;
+	
+	struct grub2_cmd cmd;
+};
+
+struct grub2_state {
+	struct grub2_var *env[GRUB2_ENV_BUCKETS];
+	
+	struct grub2_undo *undo;
+	size_t nundo, undo_alloc;
+	int scopes;
+	
+	struct grub2_frame *frames;
+	int nframes, frames_alloc;
+	
+	struct grub2_pathent path[GRUB2_MAX_DEPTH];
+	int nitems[GRUB2_MAX_DEPTH + 1];
+	int depth;
+	
+	int status;
+	int sources;
+	
+	kl_target *target;
+	int tskip;
+	
+	kl_arena arena;
+	struct grub2_item *items;
+	void *itail, *ttail;
+};
+
+static void grub2_run(struct grub2_state *st, char const *path);
+
+static struct grub2_var *grub2_findvar(struct grub2_state *st, char const *name) {
+	struct grub2_var *var = st->env[strpool_hash(name, strlen(name)) % GRUB2_ENV_BUCKETS];
+	
+	for(; var; var = var->next) {
+		if(kl_streq(var->name, name)) {
+			return var;
+		}
+	}
+	
+	return NULL;
+}
+
+static char const *grub2_getenv(struct grub2_state *st, char const *name) {
+	struct grub2_var *var = grub2_findvar(st, name);
+	return var ? var->value : NULL;
+}
+
+/* Set or unset (value is NULL) a variable without recording the old value */
+static void grub2_setenv_raw(struct grub2_state *st, char const *name, char const *value) {
+	struct grub2_var *var = grub2_findvar(st, name);
+	
+	if(!var) {
+		if(!value) {
+			return;
+		}
+		
+		var = kl_malloc(sizeof(struct grub2_var));
+		var->name = kl_strdup(name);
+		
+		list_add(&(st->env[strpool_hash(name, strlen(name)) % GRUB2_ENV_BUCKETS]), var);
+	}
+	
+	free(var->value);
+	var->value = value ? kl_strdup(value) : NULL;
+}
+
+/* Set or unset a variable
+ * Inside a menuentry or submenu the old value is recorded so it can be restored
+ * when the block is closed.
+*/
+static void grub2_setenv(struct grub2_state *st, char const *name, char const *value) {
+	if(st->scopes) {
+		if(st->nundo == st->undo_alloc) {
+			st->undo_alloc = st->undo_alloc ? st->undo_alloc * 2 : 32;
+			st->undo = kl_realloc(st->undo, st->undo_alloc * sizeof(struct grub2_undo));
+		}
+		
+		char const *old = grub2_getenv(st, name);
+		
+		st->undo[st->nundo].name = kl_strdup(name);
+		st->undo[st->nundo].value = old ? kl_strdup(old) : NULL;
+		st->nundo++;
+	}
+	
+	grub2_setenv_raw(st, name, value);
+}
+
+/* Restore variables changed since an undo mark */
+static void grub2_restore(struct grub2_state *st, size_t mark) {
+	while(st->nundo > mark) {
+		struct grub2_undo *undo = &(st->undo[--(st->nundo)]);
+		
+		grub2_setenv_raw(st, undo->name, undo->value);
+		
+		free(undo->name);
+		free(undo->value);
+	}
+}
+
+static void cmd_grow(struct grub2_cmd *cmd, size_t len) {
+	if(cmd->len + len > cmd->alloc) {
+		while(cmd->len + len > cmd->alloc) {
+			cmd->alloc = cmd->alloc ? cmd->alloc * 2 : 256;
+		}
+		
+		cmd->buf = kl_realloc(cmd->buf, cmd->alloc);
+	}
+}
+
+static void cmd_start_word(struct grub2_cmd *cmd) {
+	if(cmd->word) {
+		return;
+	}
+	
+	if(cmd->argc + 1 >= cmd->argmax) {
+		cmd->argmax = cmd->argmax ? cmd->argmax * 2 : 16;
+		
+		cmd->offs = kl_realloc(cmd->offs, cmd->argmax * sizeof(size_t));
+		cmd->argv = kl_realloc(cmd->argv, cmd->argmax * sizeof(char*));
+	}
+	
+	cmd->offs[cmd->argc] = cmd->len;
+	cmd->word = 1;
+}
+
+static void cmd_putc(struct grub2_cmd *cmd, char c) {
+	cmd_start_word(cmd);
+	cmd_grow(cmd, 1);
+	
+	cmd->buf[cmd->len++] = c;
+}
+
+static void cmd_end_word(struct grub2_cmd *cmd) {
+	if(cmd->word) {
+		cmd_grow(cmd, 1);
+		cmd->buf[cmd->len++] = '\0';
+		
+		cmd->argc++;
+		cmd->word = 0;
+	}
+}
+
+static int lex_getc(struct grub2_lexer *lex) {
+	int c = getc_unlocked(lex->fh);
+	
+	if(c == '\n') {
+		lex->lnum++;
+	}
+	
+	return c;
+}
+
+static void lex_ungetc(struct grub2_lexer *lex, int c) {
+	if(c == EOF) {
+		return;
+	}
+	
+	if(c == '\n') {
+		lex->lnum--;
+	}
+	
+	ungetc(c, lex->fh);
+}
+
+/* Expand a variable reference following a '$'
+ * Unquoted values are split into words at whitespace.
+*/
+static void lex_expand(struct grub2_state *st, struct grub2_lexer *lex, int quoted) {
+	struct grub2_cmd *cmd = &(lex->cmd);
+	char name[128], status[16];
+	size_t len = 0;
+	
+	int c = lex_getc(lex);
+	
+	if(c == '{') {
+		while((c = lex_getc(lex)) != EOF && c != '}' && c != '\n') {
+			if(len + 1 < sizeof(name)) {
+				name[len++] = c;
+			}
+		}
+		
+		if(c != '}') {
+			printD("%s:%d: Missing terminating '}'", lex->fname, lex->lnum);
+		}
+	}else if(isalnum(c) || c == '_') {
+		do {
+			if(len + 1 < sizeof(name)) {
+				name[len++] = c;
+			}
+		} while((c = lex_getc(lex)) != EOF && (isalnum(c) || c == '_'));
+		
+		lex_ungetc(lex, c);
+	}else if(c == '?' || c == '@' || c == '*' || c == '#') {
+		name[len++] = c;
+	}else{
+		/* Not a variable reference */
+		
+		cmd_putc(cmd, '$');
+		lex_ungetc(lex, c);
+		
+		return;
+	}
+	
+	name[len] = '\0';
+	
+	char const *value = grub2_getenv(st, name);
+	
+	if(kl_streq(name, "?")) {
+		snprintf(status, sizeof(status), "%d", st->status);
+		value = status;
+	}
+	
+	for(; value && *value; value++) {
+		if(!quoted && isspace(*value)) {
+			cmd_end_word(cmd);
+		}else{
+			cmd_putc(cmd, *value);
+		}
+	}
+}
+
+/* Read the next command
+ * Returns the token which terminated the command, T_EOF at end of file.
+*/
+static int lex_command(struct grub2_state *st, struct grub2_lexer *lex) {
+	struct grub2_cmd *cmd = &(lex->cmd);
+	int c, next, i;
+	
+	cmd->len = 0;
+	cmd->argc = 0;
+	cmd->word = 0;
+	
+	while((c = lex_getc(lex)) != EOF) {
+		if(c == '\n' || c == ';') {
+			cmd_end_word(cmd);
+			
+			if(cmd->argc) {
+				goto END;
+			}
+			
+			continue;
+		}
+		
+		if(c == ' ' || c == '\t' || c == '\r') {
+			cmd_end_word(cmd);
+			continue;
+		}
+		
+		if(!cmd->argc && !cmd->word) {
+			cmd->lnum = lex->lnum;
+		}
+		
+		if(!cmd->word && c == '#') {
+			while((c = lex_getc(lex)) != EOF && c != '\n') {}
+			
+			lex_ungetc(lex, c);
+			continue;
+		}
+		
+		if(!cmd->word && (c == '{' || (c == '}' && !cmd->argc))) {
+			next = lex_getc(lex);
+			lex_ungetc(lex, next);
+			
+			if(next == EOF || isspace(next) || next == ';') {
+				goto END;
+			}
+		}
+		
+		if(c == '\\') {
+			if((c = lex_getc(lex)) == EOF) {
+				break;
+			}
+			
+			if(c != '\n') {
+				cmd_putc(cmd, c);
+			}
+		}else if(c == '\'') {
+			cmd_start_word(cmd);
+			
+			while((c = lex_getc(lex)) != EOF && c != '\'') {
+				cmd_putc(cmd, c);
+			}
+			
+			if(c == EOF) {
+				printD("%s:%d: Missing terminating '", lex->fname, cmd->lnum);
+			}
+		}else if(c == '"') {
+			cmd_start_word(cmd);
+			
+			while((c = lex_getc(lex)) != EOF && c != '"') {
+				if(c == '$') {
+					lex_expand(st, lex, 1);
+					continue;
+				}
+				
+				if(c == '\\') {
+					next = lex_getc(lex);
+					
+					if(next == '\n') {
+						continue;
+					}else if(next == '"' || next == '\\' || next == '$') {
+						c = next;
+					}else{
+						lex_ungetc(lex, next);
+					}
+				}
+				
+				cmd_putc(cmd, c);
+			}
+			
+			if(c == EOF) {
+				printD("%s:%d: Missing terminating \"", lex->fname, cmd->lnum);
+			}
+		}else if(c == '$') {
+			lex_expand(st, lex, 0);
+		}else{
+			cmd_putc(cmd, c);
+		}
+	}
+	
+	END:
+	cmd_end_word(cmd);
+	
+	for(i = 0; i < cmd->argc; i++) {
+		cmd->argv[i] = cmd->buf + cmd->offs[i];
+	}
+	
+	if(cmd->argv) {
+		cmd->argv[cmd->argc] = NULL;
+	}
+	
+	if(c == '{') {
+		return T_LBRACE;
+	}else if(c == '}') {
+		return T_RBRACE;
+	}else if(c == EOF && !cmd->argc) {
+		return T_EOF;
+	}
+	
+	return T_SEP;
+}
+
+/* Translate a GRUB 2 device name such as "hd0,msdos1" or "hd1,gpt2,bsd1" to a
+ * device using the device map. Returns NULL if the name isn't a GRUB device or
+ * has no mapping.
+*/
+static char *grub2_conv_device(char const *dev, size_t len) {
+	char buf[64], *disk = buf, *part, *sub = NULL;
+	
+	/* The disk name plus ",<partition>,<letter>" */
+	char legacy[sizeof(buf) + 16];
+	int pnum = 0, snum = 0;
+	
+	if(len >= sizeof(buf)) {
+		return NULL;
+	}
+	
+	memcpy(buf, dev, len);
+	buf[len] = '\0';
+	
+	if((part = strchr(disk, ','))) {
+		*(part++) = '\0';
+		
+		if((sub = strchr(part, ','))) {
+			*(sub++) = '\0';
+		}
+	}
+	
+	/* GRUB 2 numbers partitions from 1 and names the partition table type,
+	 * the device map uses the GRUB Legacy form.
+	*/
+	
+	#define PART_NUM(num, src) \
+		src += strspn(src, "abcdefghijklmnopqrstuvwxyz"); \
+		if(!isdigit(*src) || src[strspn(src, "0123456789")] || (num = atoi(src)) < 1) { \
+			return NULL; \
+		}
+	
+	if(part) {
+		PART_NUM(pnum, part);
+	}
+	if(sub) {
+		PART_NUM(snum, sub);
+		
+		if(snum > 26) {
+			return NULL;
+		}
+	}
+	
+	#undef PART_NUM
+	
+	if(sub) {
+		snprintf(legacy, sizeof(legacy), "%s,%d,%c", disk, pnum - 1, 'a' + snum - 1);
+	}else if(part) {
+		snprintf(legacy, sizeof(legacy), "%s,%d", disk, pnum - 1);
+	}else{
+		snprintf(legacy, sizeof(legacy), "%s", disk);
+	}
+	
+	return lookup_gdev(legacy);
+}
+
+/* Translate the GRUB device at the start of a path, if any */
+static char *grub2_conv_path(char const *path) {
+	if(path[0] == '(') {
+		size_t len = strcspn(path, ")");
+		
+		if(path[len] == ')') {
+			char *dev = grub2_conv_device(path + 1, len - 1);
+			
+			if(dev) {
+				char *ret = kl_sprintf("(%s)%s", dev, path + len + 1);
+				free(dev);
+				
+				return ret;
+			}
+		}
+	}
+	
+	return kl_strdup(path);
+}
+
+/* Translate the value of $root */
+static char *grub2_conv_root(char const *root) {
+	size_t len = strlen(root);
+	
+	if(root[0] == '(' && root[len-1] == ')') {
+		root++;
+		len -= 2;
+	}
+	
+	char *dev = grub2_conv_device(root, len);
+	return dev ? dev : kl_strndup(root, len);
+}
+
+/* Translate a path to a file which is accessed while parsing, paths without a
+ * device are relative to $root.
+*/
+static char *grub2_file_path(struct grub2_state *st, char const *path) {
+	char const *root = grub2_getenv(st, "root");
+	
+	if(path[0] != '/' || !root || !root[0]) {
+		return grub2_conv_path(path);
+	}
+	
+	char *dev = grub2_conv_root(root);
+	char *ret = kl_sprintf("(%s)%s", dev, path);
+	
+	free(dev);
+	return ret;
+}
+
+struct grub2_test {
+	struct grub2_state *st;
+	
+	int argc, pos;
+	char **argv;
+};
+
+static int grub2_test_or(struct grub2_test *t);
+
+static int grub2_test_file(struct grub2_test *t, char op, char const *path) {
+	char *vpath = grub2_file_path(t->st, path);
+	struct stat st;
+	int ret = 0;
+	
+	cache_add_source(vpath);
+	
+	if(vfs_stat(vpath, &st) == 0) {
+		switch(op) {
+			case 'e':
+				ret = 1;
+				break;
+			
+			case 'f':
+				ret = S_ISREG(st.st_mode);
+				break;
+			
+			case 'd':
+				ret = S_ISDIR(st.st_mode);
+				break;
+			
+			case 's':
+				ret = (st.st_size > 0);
+				break;
+		}
+	}
+	
+	free(vpath);
+	return ret;
+}
+
+static int grub2_test_primary(struct grub2_test *t) {
+	if(t->pos >= t->argc) {
+		return 0;
+	}
+	
+	char const *arg = t->argv[t->pos];
+	
+	if(t->pos + 2 < t->argc) {
+		char const *op = t->argv[t->pos + 1], *rhs = t->argv[t->pos + 2];
+		int ret = -1;
+		
+		if(kl_streq(op, "=") || kl_streq(op, "==")) {
+			ret = kl_streq(arg, rhs);
+		}else if(kl_streq(op, "!=")) {
+			ret = !kl_streq(arg, rhs);
+		}else if(kl_streq(op, "<")) {
+			ret = (strcmp(arg, rhs) < 0);
+		}else if(kl_streq(op, ">")) {
+			ret = (strcmp(arg, rhs) > 0);
+		}else if(kl_streq(op, "-eq")) {
+			ret = (atol(arg) == atol(rhs));
+		}else if(kl_streq(op, "-ne")) {
+			ret = (atol(arg) != atol(rhs));
+		}else if(kl_streq(op, "-lt")) {
+			ret = (atol(arg) < atol(rhs));
+		}else if(kl_streq(op, "-le")) {
+			ret = (atol(arg) <= atol(rhs));
+		}else if(kl_streq(op, "-gt")) {
+			ret = (atol(arg) > atol(rhs));
+		}else if(kl_streq(op, "-ge")) {
+			ret = (atol(arg) >= atol(rhs));
+		}
+		
+		if(ret != -1) {
+			t->pos += 3;
+			return ret;
+		}
+	}
+	
+	if(t->pos + 1 < t->argc) {
+		char const *val = t->argv[t->pos + 1];
+		
+		if(kl_streq(arg, "-n")) {
+			t->pos += 2;
+			return val[0] != '\0';
+		}else if(kl_streq(arg, "-z")) {
+			t->pos += 2;
+			return val[0] == '\0';
+		}else if(kl_streq(arg, "-e") || kl_streq(arg, "-f") || kl_streq(arg, "-d") || kl_streq(arg, "-s")) {
+			t->pos += 2;
+			return grub2_test_file(t, arg[1], val);
+		}
+	}
+	
+	t->pos++;
+	
+	if(kl_streq(arg, "!")) {
+		return !grub2_test_primary(t);
+	}
+	
+	if(kl_streq(arg, "(")) {
+		int ret = grub2_test_or(t);
+		
+		if(t->pos < t->argc && kl_streq(t->argv[t->pos], ")")) {
+			t->pos++;
+		}
+		
+		return ret;
+	}
+	
+	return arg[0] != '\0';
+}
+
+static int grub2_test_and(struct grub2_test *t) {
+	int ret = grub2_test_primary(t);
+	
+	while(t->pos < t->argc && kl_streq(t->argv[t->pos], "-a")) {
+		t->pos++;
+		ret = grub2_test_primary(t) && ret;
+	}
+	
+	return ret;
+}
+
+static int grub2_test_or(struct grub2_test *t) {
+	int ret = grub2_test_and(t);
+	
+	while(t->pos < t->argc && kl_streq(t->argv[t->pos], "-o")) {
+		t->pos++;
+		ret = grub2_test_and(t) || ret;
+	}
+	
+	return ret;
+}
+
+/* Evaluate a test/[ expression, returns the exit status */
+static int grub2_test(struct grub2_state *st, int argc, char **argv) {
+	struct grub2_test t = { st, argc, 0, argv };
+	return grub2_test_or(&t) ? 0 : 1;
+}
+
+/* Load variables from a grubenv file */
+static int grub2_load_env(struct grub2_state *st, struct grub2_lexer *lex, int argc, char **argv) {
+	char const *file = NULL;
+	char *buf = NULL, *path;
+	size_t bsize = 0;
+	int i, nvars = 0;
+	
+	for(i = 1; i < argc; i++) {
+		if((kl_streq(argv[i], "-f") || kl_streq(argv[i], "--file")) && i + 1 < argc) {
+			file = argv[++i];
+		}else if(strncmp(argv[i], "--file=", 7) == 0) {
+			file = argv[i] + 7;
+		}else if(argv[i][0] == '-') {
+			continue;
+		}else{
+			/* Only load the named variables */
+			argv[nvars++] = argv[i];
+		}
+	}
+	
+	if(file) {
+		path = grub2_file_path(st, file);
+	}else{
+		path = kl_sprintf("%s/grubenv", grub2_getenv(st, "prefix"));
+	}
+	
+	cache_add_source(path);
+	
+	FILE *fh = vfs_fopen(path, "r");
+	if(!fh) {
+		debug("%s:%d: Error opening %s: %s", lex->fname, lex->cmd.lnum, path, kl_strerror(errno));
+		
+		free(path);
+		return 1;
+	}
+	
+	while(getline(&buf, &bsize, fh) != -1) {
+		char *name = buf, *val = strchr(buf, '='), *s, *d;
+		
+		buf[strcspn(buf, "\r\n")] = '\0';
+		
+		if(name[0] == '#' || !val) {
+			continue;
+		}
+		
+		*(val++) = '\0';
+		
+		for(i = 0; i < nvars && !kl_streq(argv[i], name); i++) {}
+		
+		if(nvars && i == nvars) {
+			continue;
+		}
+		
+		/* Values are escaped with backslashes */
+		
+		for(s = d = val; *s; s++) {
+			if(*s == '\\' && s[1]) {
+				s++;
+				*(d++) = (*s == 'n' ? '\n' : *s);
+			}else{
+				*(d++) = *s;
+			}
+		}
+		
+		*d = '\0';
+		
+		grub2_setenv(st, name, val);
+	}
+	
+	free(buf);
+	free(path);
+	fclose(fh);
+	
+	return 0;
+}
+
+/* Run a search command, only --set is supported */
+static int grub2_search(struct grub2_state *st, struct grub2_lexer *lex, int argc, char **argv) {
+	enum {
+		s_unknown = 0,
+		s_file,
+		s_fs_label,
+		s_fs_uuid
+	} search_by = s_unknown;
+	
+	char const *var = NULL, *key = NULL, *pos[2] = { NULL, NULL };
+	int set_bare = 0, npos = 0, i;
+	
+	if(kl_streq(argv[0], "search.file")) {
+		search_by = s_file;
+	}else if(kl_streq(argv[0], "search.fs_label")) {
+		search_by = s_fs_label;
+	}else if(kl_streq(argv[0], "search.fs_uuid")) {
+		search_by = s_fs_uuid;
+	}
+	
+	for(i = 1; i < argc; i++) {
+		char const *arg = argv[i];
+		
+		if(kl_streq(arg, "-f") || kl_streq(arg, "--file")) {
+			search_by = s_file;
+		}else if(kl_streq(arg, "-l") || kl_streq(arg, "--label")) {
+			search_by = s_fs_label;
+		}else if(kl_streq(arg, "-u") || kl_streq(arg, "--fs-uuid")) {
+			search_by = s_fs_uuid;
+		}else if(kl_streq(arg, "-s") || kl_streq(arg, "--set")) {
+			set_bare = 1;
+			var = "root";
+		}else if(strncmp(arg, "--set=", 6) == 0) {
+			var = arg + 6;
+		}else if(arg[0] == '-') {
+			continue;
+		}else if(npos < 2) {
+			pos[npos++] = arg;
+		}
+	}
+	
+	key = pos[0];
+	
+	if(search_by != s_unknown && argv[0][6] == '.' && npos > 1) {
+		/* search.fs_uuid UUID VARIABLE */
+		var = pos[1];
+	}else if(set_bare && npos > 1 && kl_streq(pos[0], "root")) {
+		/* search --set root UUID */
+		key = pos[1];
+	}
+	
+	if(!key) {
+		printD("%s:%d: search requires an argument", lex->fname, lex->cmd.lnum);
+		return 1;
+	}
+	
+	if(!var) {
+		return 0;
+	}
+	
+	char *root = NULL;
+	
+	switch(search_by) {
+		case s_unknown:
+			printD("%s:%d: Unknown search type", lex->fname, lex->cmd.lnum);
+			break;
+		
+		case s_file:
+			printD("%s:%d: search with --file unsupported", lex->fname, lex->cmd.lnum);
+			break;
+		
+		case s_fs_label:
+			root = kl_sprintf("LABEL=%s", key);
+			break;
+		
+		case s_fs_uuid:
+			root = kl_sprintf("UUID=%s", key);
+			break;
+		
+		default:
+			break;
+	}
+	
+	if(!root) {
+		return 1;
+	}
+	
+	grub2_setenv(st, var, root);
+	free(root);
+	
+	return 0;
+}
+
+static char const *grub2_bls_getenv(void *ctx, char const *name) {
+	return grub2_getenv(ctx, name);
+}
+
+/* Add a target loaded by blscfg as an entry in the current menu */
+static void grub2_bls_added(void *ctx, kl_target *target, char const *id) {
+	struct grub2_state *st = ctx;
+	
+	struct grub2_item *item = arena_alloc(&(st->arena), sizeof(struct grub2_item) + (st->depth + 1) * sizeof(struct grub2_pathent));
+	
+	item->target = target;
+	item->depth = st->depth + 1;
+	
+	memcpy(item->path, st->path, st->depth * sizeof(struct grub2_pathent));
+	
+	item->path[st->depth].index = st->nitems[st->depth]++;
+	item->path[st->depth].title = target->title;
+	item->path[st->depth].id = arena_strdup(&(st->arena), id);
+	
+	st->ttail = list_append(st->ttail, target);
+	st->itail = list_append(st->itail, item);
+}
+
+/* Load BLS entries from $root */
+static int grub2_blscfg(struct grub2_state *st) {
+	char const *root = grub2_getenv(st, "root");
+	
+	if(!root || !root[0]) {
+		return 1;
+	}
+	
+	char *device = grub2_conv_root(root), *dir = find_bls_dir(device);
+	int ret = 0;
+	
+	if(dir) {
+		load_bls(dir, &grub2_bls_getenv, &grub2_bls_added, st);
+	}else{
+		printD("No BLS entries found on %s", device);
+		ret = 1;
+	}
+	
+	free(device);
+	free(dir);
+	
+	return ret;
+}
+
+/* Run a simple command, returns the exit status */
+static int grub2_exec(struct grub2_state *st, struct grub2_lexer *lex, int argc, char **argv) {
+	char const *cmd = argv[0];
+	int i;
+	
+	if(kl_streq(cmd, "set")) {
+		for(i = 1; i < argc; i++) {
+			char *val = strchr(argv[i], '=');
+			
+			if(val) {
+				*(val++) = '\0';
+				grub2_setenv(st, argv[i], val);
+			}
+		}
+	}else if(kl_streq(cmd, "unset")) {
+		for(i = 1; i < argc; i++) {
+			grub2_setenv(st, argv[i], NULL);
+		}
+	}else if(kl_streq(cmd, "[")) {
+		if(!kl_streq(argv[argc-1], "]")) {
+			printD("%s:%d: Missing ']'", lex->fname, lex->cmd.lnum);
+			return 1;
+		}
+		
+		return grub2_test(st, argc - 2, argv + 1);
+	}else if(kl_streq(cmd, "test")) {
+		return grub2_test(st, argc - 1, argv + 1);
+	}else if(kl_streq(cmd, "false") || kl_streq(cmd, "keystatus")) {
+		return 1;
+	}else if(kl_streq(cmd, "load_env")) {
+		return grub2_load_env(st, lex, argc, argv);
+	}else if(kl_streq(cmd, "search") || kl_streq(cmd, "search.file") || kl_streq(cmd, "search.fs_label") || kl_streq(cmd, "search.fs_uuid")) {
+		return grub2_search(st, lex, argc, argv);
+	}else if(kl_streq(cmd, "blscfg")) {
+		return grub2_blscfg(st);
+	}else if(kl_streq(cmd, "source")) {
+		if(argc < 2) {
+			printD("%s:%d: source requires an argument", lex->fname, lex->cmd.lnum);
+			return 1;
+		}
+		
+		if(st->sources == GRUB2_MAX_SOURCE) {
+			printD("%s:%d: Too many nested source commands", lex->fname, lex->cmd.lnum);
+			return 1;
+		}
+		
+		char *path = grub2_file_path(st, argv[1]);
+		
+		st->sources++;
+		grub2_run(st, path);
+		st->sources--;
+		
+		free(path);
+	}else if(!st->target) {
+		/* Commands below only apply within a menuentry */
+	}else if(kl_streq(cmd, "linux") || kl_streq(cmd, "linux16") || kl_streq(cmd, "linuxefi")) {
+		if(argc < 2) {
+			printD("%s:%d: %s requires an argument", lex->fname, lex->cmd.lnum, cmd);
+			return 1;
+		}
+		
+		char *kernel = grub2_conv_path(argv[1]);
+		
+		/* Arguments are already NUL separated in the command buffer */
+		for(i = 2; i + 1 < argc; i++) {
+			argv[i][strlen(argv[i])] = ' ';
+		}
+		
+		st->target->kernel = strpool_intern(&conf_pool, kernel);
+		st->target->append = strpool_intern(&conf_pool, argc > 2 ? argv[2] : "");
+		
+		free(kernel);
+	}else if(kl_streq(cmd, "initrd") || kl_streq(cmd, "initrd16") || kl_streq(cmd, "initrdefi")) {
+		if(argc < 2) {
+			printD("%s:%d: %s requires an argument", lex->fname, lex->cmd.lnum, cmd);
+			return 1;
+		}
+		
+		/* initrd replaces any initrds from an earlier initrd command */
+		
+		st->target->initrds = NULL;
+		
+		for(i = 1; i < argc; i++) {
+			char *initrd = grub2_conv_path(argv[i]);
+			
+			add_initrd(st->target, &conf_pool, initrd, "");
+			free(initrd);
+		}
+	}else if(kl_streq(cmd, "chainloader") || kl_streq(cmd, "multiboot") || kl_streq(cmd, "multiboot2")) {
+		printd("%s at %s:%d, ignoring entry", cmd, lex->fname, lex->cmd.lnum);
+		st->tskip = 1;
+	}
+	
+	return 0;
+}
+
+static int grub2_active(struct grub2_state *st) {
+	return st->nframes ? st->frames[st->nframes-1].active : 1;
+}
+
+static struct grub2_frame *grub2_top(struct grub2_state *st, int type) {
+	if(st->nframes && st->frames[st->nframes-1].type == type) {
+		return &(st->frames[st->nframes-1]);
+	}
+	
+	return NULL;
+}
+
+static struct grub2_frame *grub2_push(struct grub2_state *st, struct grub2_lexer *lex, int type) {
+	int active = grub2_active(st);
+	
+	if(st->nframes == st->frames_alloc) {
+		st->frames_alloc = st->frames_alloc ? st->frames_alloc * 2 : 16;
+		st->frames = kl_realloc(st->frames, st->frames_alloc * sizeof(struct grub2_frame));
+	}
+	
+	struct grub2_frame *frame = &(st->frames[st->nframes++]);
+	memset(frame, 0, sizeof(*frame));
+	
+	frame->type = type;
+	frame->lnum = lex->cmd.lnum;
+	frame->parent_active = active;
+	frame->active = (type == F_FUNCTION || type == F_LOOP) ? 0 : active;
+	frame->undo_mark = st->nundo;
+	frame->item = -1;
+	
+	if(type == F_ENTRY || type == F_SUBMENU) {
+		st->scopes++;
+	}
+	
+	return frame;
+}
+
+/* Add the target of the menuentry being closed */
+static void grub2_add_target(struct grub2_state *st, struct grub2_lexer *lex, struct grub2_frame *frame) {
+	kl_target *target = st->target;
+	char const *root = grub2_getenv(st, "root");
+	
+	if(root && root[0]) {
+		char *dev = grub2_conv_root(root);
+		
+		target->root = strpool_intern(&conf_pool, dev);
+		free(dev);
+	}
+	
+	if(!target->root[0]) {
+		printD("%s:%d: No root device specified", lex->fname, frame->lnum);
+	}
+	
+	if(!target->kernel[0]) {
+		printD("%s:%d: No kernel specified", lex->fname, frame->lnum);
+	}
+	
+	if(!target->root[0] || !target->kernel[0]) {
+		return;
+	}
+	
+	st->ttail = list_append(st->ttail, target);
+	
+	struct grub2_item *item = arena_alloc(&(st->arena), sizeof(struct grub2_item) + (st->depth + 1) * sizeof(struct grub2_pathent));
+	
+	item->target = target;
+	item->depth = st->depth + 1;
+	
+	memcpy(item->path, st->path, st->depth * sizeof(struct grub2_pathent));
+	
+	item->path[st->depth].index = frame->item;
+	item->path[st->depth].title = frame->title;
+	item->path[st->depth].id = frame->id;
+	
+	st->itail = list_append(st->itail, item);
+}
+
+/* Close the innermost block, adding the target if it is a menuentry */
+static void grub2_pop(struct grub2_state *st, struct grub2_lexer *lex, int commit) {
+	struct grub2_frame *frame = &(st->frames[st->nframes-1]);
+	
+	if(frame->type == F_ENTRY && frame->item >= 0) {
+		if(commit && !st->tskip) {
+			grub2_add_target(st, lex, frame);
+		}
+		
+		st->target = NULL;
+		st->tskip = 0;
+	}
+	
+	if(frame->type == F_SUBMENU && frame->item >= 0) {
+		st->depth--;
+	}
+	
+	if(frame->type == F_ENTRY || frame->type == F_SUBMENU) {
+		grub2_restore(st, frame->undo_mark);
+		st->scopes--;
+	}
+	
+	st->nframes--;
+}
+
+/* Open a menuentry or submenu block */
+static void grub2_menuentry(struct grub2_state *st, struct grub2_lexer *lex, int argc, char **argv, int term) {
+	int submenu = kl_streq(argv[0], "submenu"), i;
+	char const *title = NULL, *id = NULL;
+	
+	struct grub2_frame *frame = grub2_push(st, lex, submenu ? F_SUBMENU : F_ENTRY);
+	
+	if(term != T_LBRACE) {
+		printD("%s:%d: Expected '{' after %s", lex->fname, lex->cmd.lnum, argv[0]);
+		
+		grub2_pop(st, lex, 0);
+		return;
+	}
+	
+	if(!frame->active) {
+		return;
+	}
+	
+	for(i = 1; i < argc; i++) {
+		if(kl_streq(argv[i], "--class") || kl_streq(argv[i], "--users") || kl_streq(argv[i], "--hotkey")) {
+			i++;
+		}else if(kl_streq(argv[i], "--id") && i + 1 < argc) {
+			id = argv[++i];
+		}else if(strncmp(argv[i], "--id=", 5) == 0) {
+			id = argv[i] + 5;
+		}else if(argv[i][0] == '-' && argv[i][1] == '-') {
+			continue;
+		}else if(!title) {
+			title = argv[i];
+		}
+	}
+	
+	if(!title) {
+		printD("%s:%d: %s requires a title", lex->fname, lex->cmd.lnum, argv[0]);
+		
+		frame->active = 0;
+		return;
+	}
+	
+	if(st->target) {
+		printD("%s:%d: Nested %s not supported", lex->fname, lex->cmd.lnum, argv[0]);
+		
+		frame->active = 0;
+		return;
+	}
+	
+	if(submenu && st->depth == GRUB2_MAX_DEPTH) {
+		printD("%s:%d: Submenus nested too deeply", lex->fname, lex->cmd.lnum);
+		
+		frame->active = 0;
+		return;
+	}
+	
+	frame->item = st->nitems[st->depth]++;
+	frame->title = arena_strdup(&(st->arena), title);
+	frame->id = id ? arena_strdup(&(st->arena), id) : NULL;
+	
+	if(submenu) {
+		st->path[st->depth].index = frame->item;
+		st->path[st->depth].title = frame->title;
+		st->path[st->depth].id = frame->id;
+		
+		st->nitems[++(st->depth)] = 0;
+		return;
+	}
+	
+	kl_target *target = arena_alloc(&(conf_pool.arena), sizeof(kl_target));
+	INIT_TARGET(target);
+	
+	if(st->depth) {
+		/* Prefix the title with those of the enclosing submenus */
+		
+		size_t len = strlen(title) + 1;
+		
+		for(i = 0; i < st->depth; i++) {
+			len += strlen(st->path[i].title) + 1;
+		}
+		
+		char *ftitle = kl_malloc(len);
+		
+		for(i = 0; i < st->depth; i++) {
+			strcat(ftitle, st->path[i].title);
+			strcat(ftitle, ">");
+		}
+		
+		strcat(ftitle, title);
+		
+		target->title = strpool_intern(&conf_pool, ftitle);
+		free(ftitle);
+	}else{
+		target->title = strpool_intern(&conf_pool, title);
+	}
+	
+	st->target = target;
+	st->tskip = 0;
+}
+
+/* Process a command and the token which terminated it */
+static void grub2_command(struct grub2_state *st, struct grub2_lexer *lex, int term) {
+	int argc = lex->cmd.argc;
+	char **argv = lex->cmd.argv;
+	struct grub2_frame *frame;
+	
+	if(term == T_RBRACE) {
+		while(st->nframes && (st->frames[st->nframes-1].type == F_IF || st->frames[st->nframes-1].type == F_LOOP)) {
+			frame = &(st->frames[st->nframes-1]);
+			
+			printD("%s:%d: Missing '%s'", lex->fname, frame->lnum, frame->type == F_IF ? "fi" : "done");
+			grub2_pop(st, lex, 0);
+		}
+		
+		if(!st->nframes) {
+			printD("%s:%d: Unexpected '}'", lex->fname, lex->cmd.lnum);
+			return;
+		}
+		
+		grub2_pop(st, lex, 1);
+		return;
+	}
+	
+	/* Keywords which may be followed by another command */
+	
+	while(argc && (kl_streq(argv[0], "then") || kl_streq(argv[0], "else") || kl_streq(argv[0], "do"))) {
+		if(kl_streq(argv[0], "do")) {
+			if(!grub2_top(st, F_LOOP)) {
+				printD("%s:%d: Unexpected 'do'", lex->fname, lex->cmd.lnum);
+			}
+		}else if(!(frame = grub2_top(st, F_IF))) {
+			printD("%s:%d: Unexpected '%s'", lex->fname, lex->cmd.lnum, argv[0]);
+		}else if(kl_streq(argv[0], "then")) {
+			frame->cond = 0;
+			frame->active = frame->parent_active && !frame->taken && st->status == 0;
+			frame->taken |= frame->active;
+		}else{
+			frame->cond = 0;
+			frame->active = frame->parent_active && !frame->taken;
+			frame->taken = 1;
+		}
+		
+		argc--;
+		argv++;
+	}
+	
+	if(!argc) {
+		if(term == T_LBRACE) {
+			printD("%s:%d: Unexpected '{'", lex->fname, lex->cmd.lnum);
+			grub2_push(st, lex, F_FUNCTION);
+		}
+		
+		return;
+	}
+	
+	if(kl_streq(argv[0], "menuentry") || kl_streq(argv[0], "submenu")) {
+		grub2_menuentry(st, lex, argc, argv, term);
+		return;
+	}
+	
+	if(term == T_LBRACE) {
+		if(!kl_streq(argv[0], "function")) {
+			printD("%s:%d: Unexpected '{'", lex->fname, lex->cmd.lnum);
+		}
+		
+		grub2_push(st, lex, F_FUNCTION);
+		return;
+	}
+	
+	if(kl_streq(argv[0], "if")) {
+		frame = grub2_push(st, lex, F_IF);
+		frame->cond = 1;
+	}else if(kl_streq(argv[0], "elif")) {
+		if(!(frame = grub2_top(st, F_IF))) {
+			printD("%s:%d: Unexpected 'elif'", lex->fname, lex->cmd.lnum);
+			return;
+		}
+		
+		frame->cond = 1;
+		frame->active = frame->parent_active && !frame->taken;
+	}else if(kl_streq(argv[0], "fi")) {
+		if(!grub2_top(st, F_IF)) {
+			printD("%s:%d: Unexpected 'fi'", lex->fname, lex->cmd.lnum);
+		}else{
+			grub2_pop(st, lex, 1);
+		}
+		
+		return;
+	}else if(kl_streq(argv[0], "for") || kl_streq(argv[0], "while") || kl_streq(argv[0], "until")) {
+		/* Loops are not evaluated */
+		
+		grub2_push(st, lex, F_LOOP);
+		return;
+	}else if(kl_streq(argv[0], "done")) {
+		if(!grub2_top(st, F_LOOP)) {
+			printD("%s:%d: Unexpected 'done'", lex->fname, lex->cmd.lnum);
+		}else{
+			grub2_pop(st, lex, 1);
+		}
+		
+		return;
+	}else{
+		if(grub2_active(st)) {
+			st->status = grub2_exec(st, lex, argc, argv);
+		}
+		
+		return;
+	}
+	
+	/* Condition following if/elif */
+	
+	if(argc > 1 && grub2_active(st)) {
+		st->status = grub2_exec(st, lex, argc - 1, argv + 1);
+	}
+}
+
+/* Read and evaluate a script */
+static void grub2_run(struct grub2_state *st, char const *path) {
+	FILE *fh = vfs_fopen(path, "r");
+	if(!fh) {
+		printD("Error opening %s: %s", path, kl_strerror(errno));
+		return;
+	}
+	
+	cache_add_source(path);
+	
+	struct grub2_lexer lex;
+	int nframes = st->nframes, term;
+	
+	memset(&lex, 0, sizeof(lex));
+	
+	lex.fh = fh;
+	lex.fname = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	lex.lnum = 1;
+	
+	while((term = lex_command(st, &lex)) != T_EOF) {
+		grub2_command(st, &lex, term);
+	}
+	
+	if(ferror(fh)) {
+		printD("Error reading %s: %s", path, kl_strerror(errno));
+	}
+	
+	while(st->nframes > nframes) {
+		printD("%s:%d: Unterminated block", lex.fname, st->frames[st->nframes-1].lnum);
+		grub2_pop(st, &lex, 0);
+	}
+	
+	free(lex.cmd.buf);
+	free(lex.cmd.offs);
+	free(lex.cmd.argv);
+	
+	fclose(fh);
+}
+
+static int grub2_match(struct grub2_pathent const *ent, char const *str) {
+	if(str[0] && str[strspn(str, "0123456789")] == '\0') {
+		return atoi(str) == ent->index;
+	}
+	
+	return kl_streq(str, ent->title) || (ent->id && kl_streq(str, ent->id));
+}
+
+/* Mark the target selected by $default
+ * Each level of a "submenu>entry" path may be an index, title or id. A path to
+ * a submenu selects the first entry within it.
+*/
+static void grub2_set_default(struct grub2_state *st, char const *def) {
+	char *buf = kl_strdup(def), *comp[GRUB2_MAX_DEPTH + 1], *s = buf;
+	int ncomp = 0, i;
+	
+	while(s && ncomp <= GRUB2_MAX_DEPTH) {
+		comp[ncomp++] = s;
+		
+		if((s = strchr(s, '>'))) {
+			*(s++) = '\0';
+		}
+	}
+	
+	struct grub2_item *item = st->items;
+	
+	for(; item; item = item->next) {
+		if(item->depth < ncomp) {
+			continue;
+		}
+		
+		for(i = 0; i < ncomp && grub2_match(&(item->path[i]), comp[i]); i++) {}
+		
+		if(i == ncomp) {
+			item->target->flags |= TARGET_DEFAULT;
+			break;
+		}
+	}
+	
+	if(!item) {
+		debug("Default GRUB entry '%s' not found", def);
+	}
+	
+	free(buf);
+}
+
+/* Load GRUB 2 grub.cfg */
+void load_grub2_cfg(char const *filename) {
+	struct grub2_state st;
+	int i;
+	
+	memset(&st, 0, sizeof(st));
+	
+	INIT_ARENA(&(st.arena));
+	st.ttail = list_tail(&targets);
+	st.itail = &(st.items);
+	
+	/* Variables which GRUB would have set before running grub.cfg */
+	
+	char *prefix = kl_strdup(filename), *root = get_diskid("", filename);
+	char *slash = strrchr(prefix, '/');
+	
+	if(slash) {
+		*slash = '\0';
+	}else{
+		free(prefix);
+		prefix = kl_strdup(".");
+	}
+	
+	grub2_setenv(&st, "prefix", prefix);
+	grub2_setenv(&st, "config_directory", prefix);
+	grub2_setenv(&st, "root", root);
+	grub2_setenv(&st, "grub_platform", access("/sys/firmware/efi", F_OK) == 0 ? "efi" : "pc");
+	grub2_setenv(&st, "feature_menuentry_id", "y");
+	grub2_setenv(&st, "feature_default_font_path", "y");
+	grub2_setenv(&st, "feature_all_video_module", "y");
+	grub2_setenv(&st, "feature_platform_search_hint", "y");
+	grub2_setenv(&st, "feature_timeout_style", "y");
+	
+	free(prefix);
+	free(root);
+	
+	grub2_run(&st, filename);
+	
+	char const *def = grub2_getenv(&st, "default");
+	if(def && def[0]) {
+		grub2_set_default(&st, def);
+	}
+	
+	char const *tmout = grub2_getenv(&st, "timeout");
+	if(tmout && tmout[0] && timeout == -1) {
+		timeout = atoi(tmout);
+	}
+	
+	for(i = 0; i < GRUB2_ENV_BUCKETS; i++) {
+		struct grub2_var *var = st.env[i], *next;
+		
+		for(; var; var = next) {
+			next = var->next;
+			
+			free(var->name);
+			free(var->value);
+			free(var);
+		}
+	}
+	
+	free(st.undo);
+	free(st.frames);
+	
+	arena_free(&(st.arena));
+}
@@ -0,0 +1,483 @@
+/* kexec-loader - Kernel loading
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Kernels are loaded in process with kexec_file_load() where possible, so the
+ * loader doesn't have to fork() a copy of itself and failures come back as
+ * error codes rather than an exit status.
+ *
+ * The statically linked kexec-tools is run in a child process for targets
+ * kexec_file_load() can't handle. It exits on errors and never frees its
+ * memory, so it can't be run in process.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/kexec.h>
+
+#include "misc.h"
+#include "vfs.h"
+#include "log.h"
+#include "cpio.h"
+#include "kexec.h"
+
+#define MAX_ARGV 256
+
+/* Combined initrd, if memfd_create() isn't supported */
+#define COMBINED_INITRD "/kexec-loader.initrd"
+
+#define KEXEC_FAIL(code, ...) \
+	res->error = code; \
+	res->sys_errno = errno; \
+	snprintf(res->detail, sizeof(res->detail), __VA_ARGS__);
+
+#define ARGV_CHECK() \
+	if(argc+1 == MAX_ARGV) { \
+		errno = E2BIG; \
+		KEXEC_FAIL(KL_KEXEC_EFORK, "kexec-tools arguments"); \
+		goto CLEANUP; \
+	}
+
+#define ARGV_COPY(s) \
+	ARGV_CHECK(); \
+	argv[argc++] = kl_strdup(s); \
+	argv[argc] = NULL;
+
+#define ARGV_PRINTF(...) \
+	ARGV_CHECK(); \
+	argv[argc++] = kl_sprintf(__VA_ARGS__); \
+	argv[argc] = NULL;
+
+int kexec_main(int argc, char **argv);
+
+static int build_initrd(kl_target *target, char **path, int *fd, kl_kexec_result *res);
+static int kexec_file(int kernel_fd, int initrd_fd, char const *cmdline);
+static int kexec_tools(kl_target *target, char const *kernel, char const *initrd, kl_kexec_result *res);
+static unsigned long elapsed_ms(struct timespec const *start);
+static void log_peak_rss(void);
+
+/* Get the mode to load kernels in from the kexec_mode command line option */
+int kl_kexec_mode(void) {
+	char const *mode = get_cmdline("kexec_mode");
+	
+	if(!mode || kl_streq(mode, "auto")) {
+		return KL_KEXEC_AUTO;
+	}
+	
+	if(kl_streq(mode, "native")) {
+		return KL_KEXEC_NATIVE;
+	}
+	
+	if(kl_streq(mode, "fork")) {
+		return KL_KEXEC_FORK;
+	}
+	
+	debug("Unknown kexec_mode '%s', using auto", mode);
+	return KL_KEXEC_AUTO;
+}
+
+/* Load the kernel of a target, ready for call_reboot(LINUX_REBOOT_CMD_KEXEC)
+ * The VFS root must be set to the root device of the target.
+ *
+ * Returns 1 on success, 0 on failure. The error, if any, and the time taken by
+ * each phase are stored in res.
+*/
+int kl_kexec_load(kl_target *target, int mode, kl_kexec_result *res) {
+	char *kernel = NULL, *initrd = NULL, *cmdline = NULL;
+	int kernel_fd = -1, initrd_fd = -1, memfd = -1;
+	struct timespec start;
+	
+	memset(res, 0, sizeof(*res));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	/* kexec_file_load() can't pass multiboot modules or reset the VGA
+	 * adaptor.
+	*/
+	
+	int native = mode != KL_KEXEC_FORK && !target->modules && !(target->flags & TARGET_RESET);
+	
+	if(mode == KL_KEXEC_NATIVE && !native) {
+		KEXEC_FAIL(KL_KEXEC_EUNSUPPORTED, "multiboot modules or reset-vga");
+		res->sys_errno = 0;
+		
+		goto END;
+	}
+	
+	if(!(kernel = vfs_translate_path(target->kernel))) {
+		KEXEC_FAIL(KL_KEXEC_EFILE, "%s", target->kernel);
+		goto END;
+	}
+	
+	if(!build_initrd(target, &initrd, &memfd, res)) {
+		goto END;
+	}
+	
+	if(native) {
+		if((kernel_fd = open(kernel, O_RDONLY)) == -1) {
+			KEXEC_FAIL(KL_KEXEC_EFILE, "%s", target->kernel);
+			goto END;
+		}
+		
+		if(initrd && (initrd_fd = open(initrd, O_RDONLY)) == -1) {
+			KEXEC_FAIL(KL_KEXEC_EINITRD, "%s", initrd);
+			goto END;
+		}
+		
+		cmdline = kl_sprintf("%s%s%s",
+			target->cmdline,
+			(target->cmdline[0] && target->append[0] ? " " : ""),
+			target->append);
+	}
+	
+	res->build_ms = elapsed_ms(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	if(native) {
+		res->method = "kexec_file_load";
+		
+		if(kexec_file(kernel_fd, initrd_fd, cmdline)) {
+			res->load_ms = elapsed_ms(&start);
+			goto END;
+		}
+		
+		switch(errno) {
+			case ENOSYS:
+			case ENOEXEC:
+			case EOPNOTSUPP:
+				KEXEC_FAIL(KL_KEXEC_EUNSUPPORTED, "kexec_file_load");
+				break;
+				
+			case EKEYREJECTED:
+			case EBADMSG:
+			case EPERM:
+				KEXEC_FAIL(KL_KEXEC_EREJECTED, "kexec_file_load");
+				break;
+				
+			default:
+				KEXEC_FAIL(KL_KEXEC_ELOAD, "kexec_file_load");
+				break;
+		}
+		
+		if(mode == KL_KEXEC_NATIVE) {
+			goto END;
+		}
+		
+		debug("kexec_file_load failed: %s, using kexec-tools", strerror(res->sys_errno));
+		
+		memset(res->detail, 0, sizeof(res->detail));
+		res->error = KL_KEXEC_OK;
+		res->sys_errno = 0;
+		
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+	
+	res->method = "kexec-tools";
+	
+	kexec_tools(target, kernel, initrd, res);
+	res->load_ms = elapsed_ms(&start);
+	
+	END:
+	if(res->method) {
+		log_peak_rss();
+	}
+	
+	if(initrd_fd != -1) {
+		close(initrd_fd);
+	}
+	
+	if(kernel_fd != -1) {
+		close(kernel_fd);
+	}
+	
+	if(memfd != -1) {
+		close(memfd);
+	}
+	
+	free(cmdline);
+	free(initrd);
+	free(kernel);
+	
+	return res->error == KL_KEXEC_OK;
+}
+
+/* Return a description of an error */
+char const *kl_kexec_strerror(int error) {
+	switch(error) {
+		case KL_KEXEC_OK:
+			return "Success";
+		case KL_KEXEC_EFILE:
+			return "Can't open kernel";
+		case KL_KEXEC_EINITRD:
+			return "Can't build initrd";
+		case KL_KEXEC_EUNSUPPORTED:
+			return "Can't load kernel in process";
+		case KL_KEXEC_EREJECTED:
+			return "Kernel rejected";
+		case KL_KEXEC_ELOAD:
+			return "Error loading kernel";
+		case KL_KEXEC_EFORK:
+			return "Can't run kexec-tools";
+		case KL_KEXEC_ETOOLS:
+			return "kexec-tools failed";
+		default:
+			return "Unknown error";
+	}
+}
+
+/* Load a kernel using kexec_file_load()
+ * The kernel reads the kernel and initrd from the files itself, so the initrd
+ * is never copied into our memory however large it is.
+ *
+ * Returns 1 on success
+ * Returns 0 and sets errno on failure
+*/
+static int kexec_file(int kernel_fd, int initrd_fd, char const *cmdline) {
+	#ifdef SYS_kexec_file_load
+	unsigned long flags = (initrd_fd == -1 ? KEXEC_FILE_NO_INITRAMFS : 0);
+	
+	return syscall(SYS_kexec_file_load, kernel_fd, initrd_fd, strlen(cmdline) + 1, cmdline, flags) == 0;
+	#else
+	errno = ENOSYS;
+	return 0;
+	#endif
+}
+
+/* Load a kernel by running kexec-tools in a child process
+ * Returns 1 on success, 0 and fills in res on failure
+*/
+static int kexec_tools(kl_target *target, char const *kernel, char const *initrd, kl_kexec_result *res) {
+	char *argv[MAX_ARGV], *tmp;
+	int argc = 0, status, ret = 0;
+	
+	argv[0] = NULL;
+	
+	ARGV_COPY("kexec");
+	ARGV_COPY("-l");
+	ARGV_COPY(kernel);
+	
+	if(initrd) {
+		ARGV_PRINTF("--initrd=%s", initrd);
+	}
+	if(target->cmdline[0]) {
+		ARGV_PRINTF("--command-line=%s", target->cmdline);
+	}
+	if(target->append[0]) {
+		ARGV_PRINTF("--append=%s", target->append);
+	}
+	if(target->flags & TARGET_RESET) {
+		ARGV_COPY("--reset-vga");
+	}
+	
+	kl_module *modptr = target->modules;
+	while(modptr) {
+		if(!(tmp = vfs_translate_path(modptr->name))) {
+			KEXEC_FAIL(KL_KEXEC_EFILE, "%s", modptr->name);
+			goto CLEANUP;
+		}
+		
+		if(modptr->args[0]) {
+			ARGV_PRINTF("--module=%s %s", tmp, modptr->args);
+		}else{
+			ARGV_PRINTF("--module=%s", tmp);
+		}
+		
+		free(tmp);
+		modptr = modptr->next;
+	}
+	
+	pid_t pid = fork();
+	if(pid == -1) {
+		KEXEC_FAIL(KL_KEXEC_EFORK, "fork");
+		goto CLEANUP;
+	}else if(pid == 0) {
+		exit(kexec_main(argc, argv));
+	}
+	
+	while(waitpid(pid, &status, 0) == -1) {
+		if(errno != EINTR) {
+			KEXEC_FAIL(KL_KEXEC_EFORK, "waitpid");
+			goto CLEANUP;
+		}
+	}
+	
+	res->status = status;
+	
+	if(!WIFEXITED(status)) {
+		errno = 0;
+		KEXEC_FAIL(KL_KEXEC_ETOOLS, "killed by signal %d", WTERMSIG(status));
+	}else if(WEXITSTATUS(status) != 0) {
+		errno = 0;
+		KEXEC_FAIL(KL_KEXEC_ETOOLS, "exit status %d", WEXITSTATUS(status));
+	}else{
+		ret = 1;
+	}
+	
+	CLEANUP:
+	while(argc) {
+		free(argv[--argc]);
+	}
+	
+	return ret;
+}
+
+/* Get the time since start in milliseconds */
+static unsigned long elapsed_ms(struct timespec const *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Log the peak memory use of kexec-loader and its largest child process,
+ * which is kexec-tools if it has been run.
+*/
+static void log_peak_rss(void) {
+	struct rusage self, children;
+	
+	if(getrusage(RUSAGE_SELF, &self) == -1 || getrusage(RUSAGE_CHILDREN, &children) == -1) {
+		debug("getrusage: %s", strerror(errno));
+		return;
+	}
+	
+	debug("Peak RSS: %ld KiB, largest child: %ld KiB", self.ru_maxrss, children.ru_maxrss);
+}
+
+/* Build the initrd to pass to the new kernel
+ *
+ * A lone initrd is used as it is. Otherwise the initrds, cpio archives of any
+ * files to be added and the debug log (if log-handoff is on) are concatenated
+ * into a memfd using sendfile(), so the data doesn't pass through our memory
+ * and nothing is left in the initramfs. The memfd is referred to by its
+ * /proc/self/fd path, which kexec-tools inherits.
+ *
+ * Returns 1 and sets path (NULL if there is no initrd) and fd (-1 if there is
+ * nothing to close once the kernel is loaded) on success.
+ * Returns 0 and fills in res on error.
+*/
+static int build_initrd(kl_target *target, char **path, int *fd, kl_kexec_result *res) {
+	kl_initrd *initrd = target->initrds;
+	char *rpath = NULL;
+	int out = -1, in = -1, archive = 0;
+	struct stat st;
+	
+	*path = NULL;
+	*fd = -1;
+	
+	if(!initrd && !log_handoff) {
+		return 1;
+	}
+	
+	if(initrd && !initrd->next && !initrd->dest[0] && !log_handoff) {
+		if(!(*path = vfs_translate_path(initrd->path))) {
+			KEXEC_FAIL(KL_KEXEC_EINITRD, "%s", initrd->path);
+			return 0;
+		}
+		
+		return 1;
+	}
+	
+	if((out = memfd_create("initrd", 0)) == -1) {
+		/* Kernels before 3.17 */
+		
+		debug("memfd_create: %s, using " COMBINED_INITRD, strerror(errno));
+		
+		if((out = open(COMBINED_INITRD, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+			KEXEC_FAIL(KL_KEXEC_EINITRD, COMBINED_INITRD);
+			return 0;
+		}
+		
+		unlink(COMBINED_INITRD);
+	}
+	
+	for(; initrd; initrd = initrd->next) {
+		if(!(rpath = vfs_translate_path(initrd->path)) || (in = open(rpath, O_RDONLY)) == -1) {
+			KEXEC_FAIL(KL_KEXEC_EINITRD, "%s", initrd->path);
+			goto FAIL;
+		}
+		
+		int ok;
+		
+		if(initrd->dest[0]) {
+			/* Consecutive files are packed into one archive */
+			
+			ok = (archive || cpio_pad(out, lseek(out, 0, SEEK_CUR)))
+				&& cpio_file(out, initrd->dest, in);
+			
+			archive = 1;
+		}else{
+			ok = (!archive || cpio_trailer(out))
+				&& cpio_pad(out, lseek(out, 0, SEEK_CUR))
+				&& fstat(in, &st) == 0
+				&& cpio_copy(out, in, st.st_size);
+			
+			archive = 0;
+		}
+		
+		if(!ok) {
+			KEXEC_FAIL(KL_KEXEC_EINITRD, "%s", initrd->path);
+			goto FAIL;
+		}
+		
+		close(in);
+		in = -1;
+		
+		free(rpath);
+		rpath = NULL;
+	}
+	
+	if(archive && !cpio_trailer(out)) {
+		KEXEC_FAIL(KL_KEXEC_EINITRD, "cpio archive");
+		goto FAIL;
+	}
+	
+	if(log_handoff) {
+		debug("Appending debug log to initrd");
+		
+		if(!cpio_pad(out, lseek(out, 0, SEEK_CUR)) || !log_write_cpio(out)) {
+			KEXEC_FAIL(KL_KEXEC_EINITRD, "debug log");
+			goto FAIL;
+		}
+	}
+	
+	debug("Built initrd of %lld bytes", (long long)(lseek(out, 0, SEEK_CUR)));
+	
+	*path = kl_sprintf("/proc/self/fd/%d", out);
+	*fd = out;
+	
+	return 1;
+	
+	FAIL:
+	if(in != -1) {
+		close(in);
+	}
+	
+	free(rpath);
+	close(out);
+	
+	return 0;
+}
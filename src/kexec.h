@@ -0,0 +1,54 @@
+/* kexec-loader - Kernel loading header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_KEXEC_H
+#define KL_KEXEC_H
+
+#include "misc.h"
+
+/* How kl_kexec_load() loads the kernel */
+#define KL_KEXEC_AUTO		0	/* In process, falling back to kexec-tools */
+#define KL_KEXEC_NATIVE		1	/* Only in process, using kexec_file_load() */
+#define KL_KEXEC_FORK		2	/* Only kexec-tools, in a child process */
+
+/* Errors */
+#define KL_KEXEC_OK		0
+#define KL_KEXEC_EFILE		1	/* Can't open the kernel or a module */
+#define KL_KEXEC_EINITRD	2	/* Can't build the initrd */
+#define KL_KEXEC_EUNSUPPORTED	3	/* Can't be loaded in process */
+#define KL_KEXEC_EREJECTED	4	/* Kernel refused by signature/lockdown policy */
+#define KL_KEXEC_ELOAD		5	/* kexec_file_load() failed */
+#define KL_KEXEC_EFORK		6	/* Can't run kexec-tools */
+#define KL_KEXEC_ETOOLS		7	/* kexec-tools failed */
+
+typedef struct kl_kexec_result {
+	int error;		/* KL_KEXEC_OK or an error */
+	int sys_errno;		/* errno of the call which failed, zero if none */
+	int status;		/* kexec-tools exit status, if it was run */
+	char detail[256];	/* File or call which failed */
+	
+	char const *method;	/* "kexec_file_load" or "kexec-tools" */
+	unsigned long build_ms;	/* Finding files and building the initrd */
+	unsigned long load_ms;	/* Loading the kernel */
+} kl_kexec_result;
+
+int kl_kexec_mode(void);
+int kl_kexec_load(kl_target *target, int mode, kl_kexec_result *res);
+char const *kl_kexec_strerror(int error);
+
+#endif /* !KL_KEXEC_H */
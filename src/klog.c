@@ -0,0 +1,336 @@
+/* kexec-loader - Kernel log forwarder
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* printk() to the console is disabled and a child process forwards kernel
+ * messages to KLOG_TTY instead, so a burst of messages while drivers load
+ * doesn't hold up our own output.
+ *
+ * The child reads every record available from /dev/kmsg (or /proc/kmsg on
+ * kernels without it) before writing those at or below the klog_level given on
+ * the kernel command line to the tty in a single non-blocking write. All
+ * messages are also kept in a ring shared with the main process, for the
+ * shell's dmesg command.
+ *
+ * Each line in the ring starts with a single digit giving its level.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/klog.h>
+#include <sys/mman.h>
+
+#include "misc.h"
+#include "console.h"
+#include "klog.h"
+
+struct klog_ring {
+	uint64_t head;		/* Bytes ever added, only written by the child */
+	char data[KLOG_RING_SIZE];
+};
+
+static struct klog_ring *ring = NULL;
+
+static int kmsg_fd = -1, tty_fd = -1;
+static int klog_level = 7;
+
+static char out_buf[KLOG_OUT_SIZE];
+static size_t out_len = 0;
+static unsigned int out_dropped = 0;
+
+static void ring_add(char const *data, size_t len) {
+	uint64_t head = ring->head;
+	
+	while(len) {
+		size_t off = head % KLOG_RING_SIZE;
+		size_t n = SMALLEST(len, KLOG_RING_SIZE - off);
+		
+		memcpy(ring->data + off, data, n);
+		
+		data += n;
+		len -= n;
+		head += n;
+	}
+	
+	__atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+}
+
+/* Add a message to the ring and, if its level is low enough, to the tty output
+ * buffer.
+*/
+static void klog_add(int level, char const *ts, size_t ts_len, char const *msg, size_t msg_len) {
+	char lc = '0' + level;
+	
+	ring_add(&lc, 1);
+	ring_add(ts, ts_len);
+	ring_add(msg, msg_len);
+	ring_add("\n", 1);
+	
+	if(level > klog_level) {
+		return;
+	}
+	
+	if(out_len + ts_len + msg_len + 1 > KLOG_OUT_SIZE) {
+		out_dropped++;
+		return;
+	}
+	
+	memcpy(out_buf + out_len, ts, ts_len);
+	memcpy(out_buf + out_len + ts_len, msg, msg_len);
+	out_buf[out_len + ts_len + msg_len] = '\n';
+	
+	out_len += ts_len + msg_len + 1;
+}
+
+/* Parse one line read from the kernel
+ *
+ * /dev/kmsg: "<prefix>,<seq>,<usecs>,<flags>;<message>" followed by dictionary
+ * lines which begin with a space.
+ *
+ * /proc/kmsg: "<<prefix>><message>"
+*/
+static void klog_line(char *line, size_t len) {
+	char ts[32];
+	int ts_len = 0, level = 4;
+	
+	if(len == 0 || line[0] == ' ') {
+		return;
+	}
+	
+	if(line[0] == '<') {
+		char *end = memchr(line, '>', len);
+		
+		if(end) {
+			level = atoi(line + 1) & 7;
+			
+			len -= (end + 1) - line;
+			line = end + 1;
+		}
+	}else{
+		char *end = memchr(line, ';', len);
+		unsigned long long usecs;
+		int prefix;
+		
+		if(end && sscanf(line, "%d,%*u,%llu", &prefix, &usecs) == 2) {
+			level = prefix & 7;
+			ts_len = snprintf(ts, sizeof(ts), "[%5llu.%06llu] ", usecs / 1000000, usecs % 1000000);
+			
+			len -= (end + 1) - line;
+			line = end + 1;
+		}
+	}
+	
+	klog_add(level, ts, ts_len, line, len);
+}
+
+/* Read everything the kernel has for us without blocking */
+static void klog_read(void) {
+	static char buf[8192];
+	static size_t buf_len = 0;
+	
+	while(1) {
+		ssize_t r = read(kmsg_fd, buf + buf_len, sizeof(buf) - buf_len - 1);
+		
+		if(r == -1 && errno == EPIPE) {
+			/* Records were overwritten before we read them */
+			
+			klog_add(4, "", 0, "[kexec-loader: kernel messages lost]", 36);
+			continue;
+		}else if(r == -1 && errno == EINTR) {
+			continue;
+		}else if(r <= 0) {
+			break;
+		}
+		
+		buf_len += r;
+		
+		char *line = buf, *nl;
+		
+		while((nl = memchr(line, '\n', buf_len - (line - buf)))) {
+			klog_line(line, nl - line);
+			line = nl + 1;
+		}
+		
+		buf_len -= line - buf;
+		memmove(buf, line, buf_len);
+		
+		if(buf_len == sizeof(buf) - 1) {
+			/* Line too long, pass on what we have */
+			
+			klog_line(buf, buf_len);
+			buf_len = 0;
+		}
+	}
+}
+
+static void klog_write(void) {
+	if(out_dropped && out_len + 64 <= KLOG_OUT_SIZE) {
+		out_len += snprintf(out_buf + out_len, 64, "[kexec-loader: %u messages dropped]\n", out_dropped);
+		out_dropped = 0;
+	}
+	
+	ssize_t w = write(tty_fd, out_buf, out_len);
+	
+	if(w > 0) {
+		memmove(out_buf, out_buf + w, out_len - w);
+		out_len -= w;
+	}
+}
+
+/* Disable kernel messages to the console and spawn a process that writes
+ * kernel messages to KLOG_TTY
+*/
+void klog_start(void) {
+	char const *level = get_cmdline("klog_level");
+	
+	if(level && isdigit(level[0])) {
+		klog_level = atoi(level);
+	}
+	
+	debug("Disabling printk() to console...");
+	klogctl(6, NULL, 0);
+	
+	ring = mmap(NULL, sizeof(struct klog_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(ring == MAP_FAILED) {
+		debug("Error allocating kernel log ring: %s", strerror(errno));
+		ring = NULL;
+		return;
+	}
+	
+	tty_fd = open(KLOG_TTY, O_WRONLY | O_APPEND | O_NOCTTY | O_NONBLOCK);
+	if(tty_fd == -1) {
+		debug("Error opening " KLOG_TTY ": %s", strerror(errno));
+	}
+	
+	kmsg_fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK);
+	if(kmsg_fd == -1) {
+		debug("Error opening /dev/kmsg: %s", strerror(errno));
+		kmsg_fd = open("/proc/kmsg", O_RDONLY | O_NONBLOCK);
+	}
+	
+	if(kmsg_fd == -1) {
+		debug("Error opening /proc/kmsg: %s", strerror(errno));
+		return;
+	}
+	
+	console_sync();
+	
+	pid_t pid = fork();
+	if(pid == -1) {
+		debug("fork: %s", strerror(errno));
+	}
+	
+	if(pid) {
+		close(kmsg_fd);
+		close(tty_fd);
+		
+		return;
+	}
+	
+	while(1) {
+		struct pollfd pollfds[2];
+		int n = 1;
+		
+		pollfds[0].fd = kmsg_fd;
+		pollfds[0].events = POLLIN;
+		
+		if(out_len && tty_fd != -1) {
+			pollfds[1].fd = tty_fd;
+			pollfds[1].events = POLLOUT;
+			n++;
+		}
+		
+		if(poll(pollfds, n, -1) == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			debug("Error polling kernel log: %s", strerror(errno));
+			break;
+		}
+		
+		if(pollfds[0].revents & POLLNVAL) {
+			debug("Error reading kernel log");
+			break;
+		}
+		
+		/* /dev/kmsg also sets POLLERR when records were overwritten
+		 * before we read them, read() then fails with EPIPE once and
+		 * klog_read() carries on from the oldest record.
+		*/
+		
+		if(pollfds[0].revents) {
+			klog_read();
+		}
+		
+		if(tty_fd == -1) {
+			out_len = 0;
+		}else if(out_len) {
+			klog_write();
+		}
+	}
+	
+	debug("The kernel log forwarder has exited!");
+	exit(0);
+}
+
+/* Write the kernel messages at or below a level from the ring to a stream */
+void klog_dump(FILE *fh, int level) {
+	if(!ring) {
+		fprintf(fh, "The kernel log is not available\n");
+		return;
+	}
+	
+	char *copy = kl_malloc(KLOG_RING_SIZE);
+	
+	uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	uint64_t start = head > KLOG_RING_SIZE ? head - KLOG_RING_SIZE : 0;
+	size_t len = head - start, off = start % KLOG_RING_SIZE, i;
+	
+	for(i = 0; i < len; i++) {
+		copy[i] = ring->data[(off + i) % KLOG_RING_SIZE];
+	}
+	
+	/* Skip anything the child overwrote while we were copying, and the
+	 * (probably partial) line after it.
+	*/
+	
+	uint64_t now = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	size_t skip = SMALLEST(now - head, len);
+	
+	if(start > 0 || skip > 0) {
+		char *nl = memchr(copy + skip, '\n', len - skip);
+		skip = nl ? (nl + 1) - copy : len;
+	}
+	
+	char *line = copy + skip, *end = copy + len, *nl;
+	
+	for(; line < end && (nl = memchr(line, '\n', end - line)); line = nl + 1) {
+		if(line[0] - '0' <= level) {
+			fwrite(line + 1, 1, nl - line, fh);
+		}
+	}
+	
+	free(copy);
+}
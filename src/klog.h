@@ -0,0 +1,32 @@
+/* kexec-loader - Kernel log forwarder header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_KLOG_H
+#define KL_KLOG_H
+
+#include <stdio.h>
+
+#define KLOG_TTY	"/dev/tty2"
+
+#define KLOG_RING_SIZE	(64 * 1024)
+#define KLOG_OUT_SIZE	(16 * 1024)
+
+void klog_start(void);
+void klog_dump(FILE *fh, int level);
+
+#endif /* !KL_KLOG_H */
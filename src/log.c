@@ -0,0 +1,246 @@
+/* kexec-loader - Debug log
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Debug messages are appended to an in-memory ring and written to the debug
+ * tty without blocking. Whatever the tty can't take straight away is written
+ * while the loader is waiting for input (see console_poll()), so a slow serial
+ * line never holds up booting.
+ *
+ * The ring always holds the most recent LOG_RING_SIZE bytes of messages, even
+ * if there is no debug tty, for the shell's log command and for passing to the
+ * next kernel.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "misc.h"
+#include "log.h"
+#include "cpio.h"
+
+#define DEBUG_TTY "/dev/tty3"
+
+#define RING_OFF(pos) ((size_t)((pos) % LOG_RING_SIZE))
+
+int log_handoff = 0;
+
+static char log_ring[LOG_RING_SIZE];
+static uint64_t log_head = 0;		/* Bytes ever logged */
+static uint64_t log_tail = 0;		/* Bytes written to the debug tty or dropped */
+static uint64_t log_dropped = 0;	/* Bytes overwritten before reaching the tty */
+
+static int debug_fd = -1;
+static char const *debug_path = NULL;
+
+static void log_append(char const *data, size_t len) {
+	if(len > LOG_RING_SIZE) {
+		data += len - LOG_RING_SIZE;
+		len = LOG_RING_SIZE;
+	}
+	
+	size_t off = RING_OFF(log_head);
+	size_t first = SMALLEST(len, LOG_RING_SIZE - off);
+	
+	memcpy(log_ring + off, data, first);
+	memcpy(log_ring, data + first, len - first);
+	
+	log_head += len;
+	
+	if(log_head - log_tail > LOG_RING_SIZE) {
+		log_dropped += (log_head - LOG_RING_SIZE) - log_tail;
+		log_tail = log_head - LOG_RING_SIZE;
+	}
+}
+
+/* Open the debug tty, only the first call tries */
+static int debug_open(void) {
+	static int tried = 0;
+	
+	if(!tried) {
+		tried = 1;
+		
+		char const *path = get_cmdline("debug_tty");
+		debug_path = path ? path : DEBUG_TTY;
+		
+		debug_fd = open(debug_path, O_WRONLY | O_APPEND | O_CREAT | O_NOCTTY | O_NONBLOCK, 0644);
+	}
+	
+	return debug_fd != -1;
+}
+
+/* Print a message to the debug log/tty */
+void debug(char const *fmt, ...) {
+	va_list argv;
+	char msgbuf[256], *msg = msgbuf;
+	
+	va_start(argv, fmt);
+	int len = vsnprintf(msgbuf, sizeof(msgbuf), fmt, argv);
+	va_end(argv);
+	
+	if(len < 0) {
+		return;
+	}
+	
+	if((size_t)(len) >= sizeof(msgbuf)) {
+		msg = kl_malloc(len+1);
+		
+		va_start(argv, fmt);
+		vsnprintf(msg, len+1, fmt, argv);
+		va_end(argv);
+	}
+	
+	msg[len] = '\n';
+	log_append(msg, len+1);
+	
+	if(msg != msgbuf) {
+		free(msg);
+	}
+	
+	debug_flush();
+}
+
+int get_debug_fd(void) {
+	return debug_open() ? debug_fd : -1;
+}
+
+/* Open the debug tty again for the output of a child process
+ * O_NONBLOCK is shared by every descriptor duplicated from ours, so programs
+ * writing to a copy of it would get EAGAIN from a slow tty. Call debug_sync()
+ * before forking so the child's output comes after the log.
+ *
+ * Returns a new blocking descriptor, -1 if there is no debug tty
+*/
+int debug_open_child(void) {
+	if(!debug_open()) {
+		return -1;
+	}
+	
+	return open(debug_path, O_WRONLY | O_APPEND | O_NOCTTY);
+}
+
+/* Returns the debug tty's descriptor if there are messages waiting to be
+ * written to it, -1 otherwise.
+*/
+int debug_pending(void) {
+	return (log_tail < log_head && debug_fd != -1) ? debug_fd : -1;
+}
+
+/* Write as much of the log to the debug tty as it will take without blocking */
+void debug_flush(void) {
+	if(log_tail == log_head || !debug_open()) {
+		return;
+	}
+	
+	if(log_dropped) {
+		char msg[64];
+		int len = snprintf(msg, sizeof(msg), "[%llu bytes of debug log dropped]\n", (unsigned long long)(log_dropped));
+		
+		if(write(debug_fd, msg, len) == -1 && errno == EAGAIN) {
+			return;
+		}
+		
+		log_dropped = 0;
+	}
+	
+	while(log_tail < log_head) {
+		size_t off = RING_OFF(log_tail);
+		size_t len = SMALLEST(log_head - log_tail, LOG_RING_SIZE - off);
+		
+		ssize_t w = write(debug_fd, log_ring + off, len);
+		
+		if(w == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			if(errno != EAGAIN) {
+				/* Don't keep trying a broken tty */
+				
+				close(debug_fd);
+				debug_fd = -1;
+			}
+			
+			break;
+		}
+		
+		log_tail += w;
+	}
+}
+
+/* Wait up to timeout milliseconds for the log to reach the debug tty */
+void debug_sync(int timeout) {
+	struct pollfd pollfds;
+	
+	debug_flush();
+	
+	while((pollfds.fd = debug_pending()) != -1) {
+		pollfds.events = POLLOUT;
+		
+		if(poll(&pollfds, 1, timeout) <= 0) {
+			break;
+		}
+		
+		debug_flush();
+	}
+}
+
+/* Get the parts of the ring holding the log, oldest first */
+static void log_segments(char const **p1, size_t *l1, char const **p2, size_t *l2) {
+	uint64_t start = log_head > LOG_RING_SIZE ? log_head - LOG_RING_SIZE : 0;
+	size_t off = RING_OFF(start), len = log_head - start;
+	
+	*p1 = log_ring + off;
+	*l1 = SMALLEST(len, LOG_RING_SIZE - off);
+	*p2 = log_ring;
+	*l2 = len - *l1;
+}
+
+/* Write the log to a stream */
+void log_dump(FILE *fh) {
+	char const *p1, *p2;
+	size_t l1, l2;
+	
+	log_segments(&p1, &l1, &p2, &l2);
+	
+	fwrite(p1, 1, l1, fh);
+	fwrite(p2, 1, l2, fh);
+}
+
+/* Write the log as a cpio archive containing LOG_HANDOFF_NAME, which the next
+ * kernel will unpack into its initramfs if it is appended to the initrd.
+ * Returns 1 on success, zero on error.
+*/
+int log_write_cpio(int fd) {
+	char const *p1, *p2;
+	size_t l1, l2;
+	
+	log_segments(&p1, &l1, &p2, &l2);
+	
+	return cpio_header(fd, LOG_HANDOFF_NAME, 0100644, l1 + l2)
+		&& cpio_write(fd, p1, l1)
+		&& cpio_write(fd, p2, l2)
+		&& cpio_pad(fd, l1 + l2)
+		&& cpio_trailer(fd);
+}
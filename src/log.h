@@ -0,0 +1,39 @@
+/* kexec-loader - Debug log header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_LOG_H
+#define KL_LOG_H
+
+#include <stdio.h>
+
+#define LOG_RING_SIZE	(64 * 1024)
+
+/* Name of the log in the next kernel's initramfs */
+#define LOG_HANDOFF_NAME	"kexec-loader.log"
+
+extern int log_handoff;
+
+int get_debug_fd(void);
+int debug_open_child(void);
+int debug_pending(void);
+void debug_flush(void);
+void debug_sync(int timeout);
+void log_dump(FILE *fh);
+int log_write_cpio(int fd);
+
+#endif /* !KL_LOG_H */
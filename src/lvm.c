@@ -0,0 +1,850 @@
+/* kexec-loader - Native LVM2 logical volume activation
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Logical volumes are referred to as LV=<vg>/<lv> and activated on demand.
+ *
+ * lvm_scan() looks for LVM2 labels on block devices it hasn't checked before
+ * and parses the text metadata of each physical volume, keeping the copy with
+ * the highest seqno for each volume group. lvm_activate() then builds a
+ * device-mapper table for the requested LV from its segments and creates it
+ * through the ioctls on /dev/mapper/control, giving a dm-N block device.
+ *
+ * Only linear and striped segments are supported, which covers LVs created
+ * without --type.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/dm-ioctl.h>
+
+#include "lvm.h"
+#include "md.h"
+#include "misc.h"
+#include "log.h"
+#include "arena.h"
+
+#define LVM_LABEL_SCAN_SECTORS	4
+#define LVM_LABEL_ID		"LABELONE"
+#define LVM_LABEL_TYPE		"LVM2 001"
+#define LVM_MDA_MAGIC		" LVM2 x[5A%r0N*>"
+#define LVM_MDA_HEADER_SIZE	512
+#define LVM_INITIAL_CRC		0xf597a6cf
+
+/* Largest metadata text we're prepared to read */
+#define LVM_MAX_METADATA	(4 * 1024 * 1024)
+
+#define DM_CONTROL		"/dev/mapper/control"
+#define DM_CONTROL_MINOR	236
+
+#define LVM_SECTION	0
+#define LVM_ARRAY	1
+#define LVM_STRING	2
+#define LVM_NUMBER	3
+
+typedef struct lvm_node {
+	struct lvm_node *next;
+	
+	char const *key;	/* NULL for array elements */
+	int type;
+	
+	char const *str;
+	int64_t num;
+	
+	struct lvm_node *child;
+} lvm_node;
+
+typedef struct lvm_dev {
+	struct lvm_dev *next;
+	
+	char name[32];
+	int major;
+	int minor;
+	
+	char uuid[33];		/* Empty if not a PV */
+} lvm_dev;
+
+typedef struct lvm_vg {
+	struct lvm_vg *next;
+	
+	char const *name;
+	int64_t seqno;
+	
+	kl_arena arena;
+	lvm_node *root;
+} lvm_vg;
+
+typedef struct lvm_lv {
+	struct lvm_lv *next;
+	
+	char id[256];
+	char devname[32];
+} lvm_lv;
+
+static lvm_dev *devices = NULL;
+static lvm_vg *vgs = NULL;
+static lvm_lv *active_lvs = NULL;
+
+/* The CRC used by LVM is CRC-32 without the final inversion */
+static uint32_t lvm_crc(uint32_t crc, void const *data, size_t size) {
+	return ~crc32(~crc & 0xFFFFFFFF, data, size) & 0xFFFFFFFF;
+}
+
+static void lvm_skip(char const **p) {
+	while(**p) {
+		if(isspace(**p)) {
+			(*p)++;
+		}else if(**p == '#') {
+			*p += strcspn(*p, "\n");
+		}else{
+			break;
+		}
+	}
+}
+
+static int lvm_parse_list(kl_arena *arena, char const **p, char end, lvm_node **list);
+
+/* Parse a string, number or array into node
+ * Returns 0 on syntax error
+*/
+static int lvm_parse_value(kl_arena *arena, char const **p, lvm_node *node) {
+	lvm_skip(p);
+	
+	if(**p == '"') {
+		/* Find the closing quote first so only the unescaped length of
+		 * the string is allocated, not the rest of the metadata.
+		*/
+		
+		char const *q = *p + 1;
+		size_t len = 0;
+		
+		for(; *q != '"'; q++, len++) {
+			if(*q == '\\' && q[1]) {
+				q++;
+			}
+			
+			if(!*q) {
+				return 0;
+			}
+		}
+		
+		char *str = arena_alloc(arena, len + 1), *s = str;
+		
+		for((*p)++; *p < q; (*p)++) {
+			if(**p == '\\') {
+				(*p)++;
+			}
+			
+			*(s++) = **p;
+		}
+		
+		(*p)++;
+		*s = '\0';
+		
+		node->type = LVM_STRING;
+		node->str = str;
+	}else if(**p == '[') {
+		lvm_node *tail = NULL;
+		
+		node->type = LVM_ARRAY;
+		
+		for((*p)++, lvm_skip(p); **p != ']'; lvm_skip(p)) {
+			lvm_node *elem = arena_alloc(arena, sizeof(lvm_node));
+			memset(elem, 0, sizeof(*elem));
+			
+			if(!lvm_parse_value(arena, p, elem)) {
+				return 0;
+			}
+			
+			if(tail) {
+				tail->next = elem;
+			}else{
+				node->child = elem;
+			}
+			
+			tail = elem;
+			
+			lvm_skip(p);
+			
+			if(**p == ',') {
+				(*p)++;
+			}else if(**p != ']') {
+				return 0;
+			}
+		}
+		
+		(*p)++;
+	}else if(**p == '-' || isdigit(**p)) {
+		char *end;
+		
+		node->type = LVM_NUMBER;
+		node->num = strtoll(*p, &end, 10);
+		
+		if(*end == '.') {
+			/* Floats only appear in settings we don't use */
+			strtod(*p, &end);
+		}
+		
+		*p = end;
+	}else{
+		return 0;
+	}
+	
+	return 1;
+}
+
+/* Parse "key = value" and "key { ... }" entries up to the end character
+ * Returns 0 on syntax error
+*/
+static int lvm_parse_list(kl_arena *arena, char const **p, char end, lvm_node **list) {
+	lvm_node *tail = NULL;
+	
+	*list = NULL;
+	
+	for(lvm_skip(p); **p != end; lvm_skip(p)) {
+		size_t len = strcspn(*p, " \t\r\n={}#");
+		
+		if(!len) {
+			return 0;
+		}
+		
+		lvm_node *node = arena_alloc(arena, sizeof(lvm_node));
+		memset(node, 0, sizeof(*node));
+		
+		char *key = arena_alloc(arena, len + 1);
+		memcpy(key, *p, len);
+		key[len] = '\0';
+		
+		node->key = key;
+		*p += len;
+		
+		lvm_skip(p);
+		
+		if(**p == '{') {
+			(*p)++;
+			
+			node->type = LVM_SECTION;
+			
+			if(!lvm_parse_list(arena, p, '}', &(node->child))) {
+				return 0;
+			}
+			
+			(*p)++;
+		}else if(**p == '=') {
+			(*p)++;
+			
+			if(!lvm_parse_value(arena, p, node)) {
+				return 0;
+			}
+		}else{
+			return 0;
+		}
+		
+		if(tail) {
+			tail->next = node;
+		}else{
+			*list = node;
+		}
+		
+		tail = node;
+	}
+	
+	return 1;
+}
+
+static lvm_node *lvm_find(lvm_node *list, char const *key, int type) {
+	for(; list; list = list->next) {
+		if(list->key && kl_streq(list->key, key) && list->type == type) {
+			return list;
+		}
+	}
+	
+	return NULL;
+}
+
+static char const *lvm_find_str(lvm_node *list, char const *key) {
+	lvm_node *node = lvm_find(list, key, LVM_STRING);
+	return node ? node->str : NULL;
+}
+
+static int lvm_find_num(lvm_node *list, char const *key, int64_t *num) {
+	lvm_node *node = lvm_find(list, key, LVM_NUMBER);
+	
+	if(node) {
+		*num = node->num;
+	}
+	
+	return node != NULL;
+}
+
+/* Copy a UUID with the dashes removed */
+static void lvm_strip_uuid(char *dest, size_t size, char const *uuid) {
+	size_t len = 0;
+	
+	for(; *uuid && len + 1 < size; uuid++) {
+		if(*uuid != '-') {
+			dest[len++] = *uuid;
+		}
+	}
+	
+	dest[len] = '\0';
+}
+
+/* Read and parse the current metadata from the metadata area at offset */
+static void lvm_read_mda(int fd, char const *path, uint64_t offset) {
+	uint8_t hdr[LVM_MDA_HEADER_SIZE];
+	char *text = NULL;
+	
+	if(pread(fd, hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+		debug("Error reading LVM metadata header on %s: %s", path, strerror(errno));
+		return;
+	}
+	
+	if(memcmp(hdr + 4, LVM_MDA_MAGIC, 16) || le32toh(*(uint32_t*)(hdr)) != lvm_crc(LVM_INITIAL_CRC, hdr + 4, sizeof(hdr) - 4)) {
+		debug("Invalid LVM metadata header on %s", path);
+		return;
+	}
+	
+	uint64_t mda_size = le64toh(*(uint64_t*)(hdr + 32));
+	uint64_t text_off = le64toh(*(uint64_t*)(hdr + 40));
+	uint64_t text_size = le64toh(*(uint64_t*)(hdr + 48));
+	uint32_t text_crc = le32toh(*(uint32_t*)(hdr + 56));
+	
+	if(!text_off || !text_size) {
+		return;
+	}
+	
+	if(text_size > LVM_MAX_METADATA || text_off >= mda_size || mda_size <= LVM_MDA_HEADER_SIZE) {
+		debug("Bad LVM metadata location on %s", path);
+		return;
+	}
+	
+	/* The metadata area is a circular buffer following the header */
+	
+	uint64_t first = text_size;
+	
+	if(text_off + text_size > mda_size) {
+		first = mda_size - text_off;
+	}
+	
+	text = kl_malloc(text_size + 1);
+	
+	if(pread(fd, text, first, offset + text_off) != first
+		|| (first < text_size && pread(fd, text + first, text_size - first, offset + LVM_MDA_HEADER_SIZE) != text_size - first))
+	{
+		debug("Error reading LVM metadata on %s: %s", path, strerror(errno));
+		goto END;
+	}
+	
+	if(lvm_crc(LVM_INITIAL_CRC, text, text_size) != text_crc) {
+		debug("Bad LVM metadata checksum on %s", path);
+		goto END;
+	}
+	
+	text[text_size] = '\0';
+	
+	kl_arena arena;
+	INIT_ARENA(&arena);
+	
+	char const *p = text;
+	lvm_node *list, *root;
+	
+	if(!lvm_parse_list(&arena, &p, '\0', &list)) {
+		debug("Error parsing LVM metadata on %s", path);
+		goto FAIL;
+	}
+	
+	for(root = list; root && root->type != LVM_SECTION; root = root->next) {}
+	
+	int64_t seqno;
+	
+	if(!root || !lvm_find_num(root->child, "seqno", &seqno)) {
+		debug("No volume group in LVM metadata on %s", path);
+		goto FAIL;
+	}
+	
+	lvm_vg *vg = vgs;
+	
+	while(vg && !kl_streq(vg->name, root->key)) {
+		vg = vg->next;
+	}
+	
+	if(vg && vg->seqno >= seqno) {
+		goto FAIL;
+	}
+	
+	if(!vg) {
+		vg = kl_malloc(sizeof(lvm_vg));
+		INIT_ARENA(&(vg->arena));
+		
+		list_add(&vgs, vg);
+	}else{
+		arena_free(&(vg->arena));
+	}
+	
+	debug("Read metadata for volume group %s (seqno %lld) from %s", root->key, (long long)(seqno), path);
+	
+	vg->name = root->key;
+	vg->seqno = seqno;
+	vg->arena = arena;
+	vg->root = root;
+	
+	goto END;
+	
+	FAIL:
+	arena_free(&arena);
+	
+	END:
+	free(text);
+}
+
+/* Check a block device for an LVM2 label and read its metadata */
+static void lvm_add_device(char const *name, int major, int minor) {
+	char path[256];
+	snprintf(path, sizeof(path), "/dev/%s", name);
+	
+	lvm_dev *dev = kl_malloc(sizeof(lvm_dev));
+	
+	strlcpy(dev->name, name, sizeof(dev->name));
+	dev->major = major;
+	dev->minor = minor;
+	dev->uuid[0] = '\0';
+	
+	list_add(&devices, dev);
+	
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		debug("Error opening %s: %s", path, strerror(errno));
+		return;
+	}
+	
+	uint8_t buf[LVM_LABEL_SCAN_SECTORS * 512], *label = NULL;
+	int sector;
+	
+	if(pread(fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+		goto END;
+	}
+	
+	for(sector = 0; sector < LVM_LABEL_SCAN_SECTORS && !label; sector++) {
+		uint8_t *l = buf + sector * 512;
+		
+		if(!memcmp(l, LVM_LABEL_ID, 8) && le64toh(*(uint64_t*)(l + 8)) == sector) {
+			label = l;
+		}
+	}
+	
+	if(!label || memcmp(label + 24, LVM_LABEL_TYPE, 8)) {
+		goto END;
+	}
+	
+	uint32_t pvh_off = le32toh(*(uint32_t*)(label + 20));
+	
+	if(le32toh(*(uint32_t*)(label + 16)) != lvm_crc(LVM_INITIAL_CRC, label + 20, 512 - 20) || pvh_off < 32 || pvh_off + 40 > 512) {
+		debug("Invalid LVM label on %s", path);
+		goto END;
+	}
+	
+	/* The PV header is the UUID, device size and then two lists of
+	 * (offset, size) pairs terminated by zeros: data areas and metadata
+	 * areas.
+	*/
+	
+	uint8_t *pvh = label + pvh_off, *end = label + 512;
+	char uuid[33];
+	
+	memcpy(uuid, pvh, 32);
+	uuid[32] = '\0';
+	
+	lvm_dev *d;
+	
+	for(d = devices; d; d = d->next) {
+		if(kl_streq(d->uuid, uuid)) {
+			break;
+		}
+	}
+	
+	if(d) {
+		if(!kl_strneq(name, "md", 2)) {
+			debug("Ignoring duplicate PV %s on %s (already seen on %s)", uuid, path, d->name);
+			goto END;
+		}
+		
+		/* Prefer the array over the (1.0 metadata) member device */
+		
+		d->uuid[0] = '\0';
+	}
+	
+	strlcpy(dev->uuid, uuid, sizeof(dev->uuid));
+	
+	uint8_t *locn = pvh + 40;
+	int list;
+	
+	for(list = 0; list < 2; list++) {
+		for(; locn + 16 <= end; locn += 16) {
+			uint64_t offset = le64toh(*(uint64_t*)(locn));
+			
+			if(!offset) {
+				locn += 16;
+				break;
+			}
+			
+			if(list == 1) {
+				lvm_read_mda(fd, path, offset);
+			}
+		}
+	}
+	
+	END:
+	close(fd);
+}
+
+/* Check any block devices which haven't been checked before for LVM2 labels */
+static void lvm_scan(void) {
+	FILE *fh = fopen("/proc/partitions", "r");
+	if(!fh) {
+		debug("Error opening /proc/partitions: %s", strerror(errno));
+		return;
+	}
+	
+	char line[256], name[32];
+	int major, minor;
+	
+	while(fgets(line, sizeof(line), fh)) {
+		if(sscanf(line, "%d %d %*u %31s", &major, &minor, name) != 3) {
+			continue;
+		}
+		
+		if(kl_strneq(name, "ram", 3) || kl_strneq(name, "loop", 4) || kl_strneq(name, "dm-", 3)) {
+			continue;
+		}
+		
+		if(md_is_member(major, minor)) {
+			continue;
+		}
+		
+		lvm_dev *dev = devices;
+		
+		while(dev && (dev->major != major || dev->minor != minor)) {
+			dev = dev->next;
+		}
+		
+		if(!dev) {
+			lvm_add_device(name, major, minor);
+		}
+	}
+	
+	fclose(fh);
+}
+
+/* Append a target to a device-mapper ioctl buffer */
+static void dm_add_target(struct dm_ioctl **io, uint64_t start, uint64_t length, char const *type, char const *params) {
+	size_t spec_size = (sizeof(struct dm_target_spec) + strlen(params) + 1 + 7) & ~(size_t)(7);
+	
+	*io = kl_realloc(*io, (*io)->data_size + spec_size);
+	
+	struct dm_target_spec *spec = (struct dm_target_spec*)((char*)(*io) + (*io)->data_size);
+	memset(spec, 0, spec_size);
+	
+	spec->sector_start = start;
+	spec->length = length;
+	spec->next = spec_size;
+	strlcpy(spec->target_type, type, sizeof(spec->target_type));
+	strcpy((char*)(spec + 1), params);
+	
+	(*io)->data_size += spec_size;
+	(*io)->target_count++;
+}
+
+static void dm_init(struct dm_ioctl *io, char const *name) {
+	memset(io, 0, sizeof(*io));
+	
+	io->version[0] = DM_VERSION_MAJOR;
+	io->version[1] = 0;
+	io->version[2] = 0;
+	io->data_size = sizeof(*io);
+	io->data_start = sizeof(*io);
+	
+	strlcpy(io->name, name, sizeof(io->name));
+}
+
+static int dm_open_control(void) {
+	mkdir("/dev/mapper", 0755);
+	
+	if(access(DM_CONTROL, F_OK) && mknod(DM_CONTROL, 0600 | S_IFCHR, makedev(10, DM_CONTROL_MINOR))) {
+		debug("Failed to create %s: %s", DM_CONTROL, strerror(errno));
+		return -1;
+	}
+	
+	int fd = open(DM_CONTROL, O_RDWR);
+	if(fd == -1) {
+		debug("Error opening %s: %s", DM_CONTROL, strerror(errno));
+	}
+	
+	return fd;
+}
+
+/* Append a string to a device-mapper name, doubling any dashes like LVM */
+static void dm_name_append(char *dest, size_t size, char const *src) {
+	size_t len = strlen(dest);
+	
+	for(; *src && len + 2 < size; src++) {
+		dest[len++] = *src;
+		
+		if(*src == '-') {
+			dest[len++] = '-';
+		}
+	}
+	
+	dest[len] = '\0';
+}
+
+/* Build the device-mapper table for a logical volume
+ * Returns an ioctl buffer with the targets appended, or NULL on error
+*/
+static struct dm_ioctl *lvm_build_table(lvm_vg *vg, lvm_node *lv, char const *dm_name) {
+	lvm_node *pvs = lvm_find(vg->root->child, "physical_volumes", LVM_SECTION);
+	lvm_node *seg;
+	int64_t extent_size;
+	
+	struct dm_ioctl *io = kl_malloc(sizeof(struct dm_ioctl));
+	dm_init(io, dm_name);
+	
+	if(!pvs || !lvm_find_num(vg->root->child, "extent_size", &extent_size)) {
+		debug("Incomplete metadata for volume group %s", vg->name);
+		goto FAIL;
+	}
+	
+	for(seg = lv->child; seg; seg = seg->next) {
+		if(seg->type != LVM_SECTION) {
+			continue;
+		}
+		
+		int64_t start, count, stripe_count = 1, stripe_size = 0;
+		char const *type = lvm_find_str(seg->child, "type");
+		lvm_node *stripes = lvm_find(seg->child, "stripes", LVM_ARRAY);
+		
+		if(!type || !kl_streq(type, "striped")) {
+			debug("Unsupported segment type %s in %s/%s", type ? type : "(none)", vg->name, lv->key);
+			goto FAIL;
+		}
+		
+		if(!stripes || !lvm_find_num(seg->child, "start_extent", &start) || !lvm_find_num(seg->child, "extent_count", &count)) {
+			debug("Incomplete segment %s in %s/%s", seg->key, vg->name, lv->key);
+			goto FAIL;
+		}
+		
+		lvm_find_num(seg->child, "stripe_count", &stripe_count);
+		lvm_find_num(seg->child, "stripe_size", &stripe_size);
+		
+		char *params = stripe_count > 1 ? kl_sprintf("%lld %lld", (long long)(stripe_count), (long long)(stripe_size)) : kl_strdup("");
+		lvm_node *s = stripes->child;
+		int i;
+		
+		for(i = 0; i < stripe_count; i++) {
+			if(!s || s->type != LVM_STRING || !s->next || s->next->type != LVM_NUMBER) {
+				debug("Bad stripe list in %s/%s", vg->name, lv->key);
+				
+				free(params);
+				goto FAIL;
+			}
+			
+			lvm_node *pv = lvm_find(pvs->child, s->str, LVM_SECTION);
+			char const *pv_id = pv ? lvm_find_str(pv->child, "id") : NULL;
+			int64_t pe_start;
+			char uuid[64];
+			lvm_dev *dev = devices;
+			
+			if(!pv_id || !lvm_find_num(pv->child, "pe_start", &pe_start)) {
+				debug("Incomplete metadata for %s in volume group %s", s->str, vg->name);
+				
+				free(params);
+				goto FAIL;
+			}
+			
+			lvm_strip_uuid(uuid, sizeof(uuid), pv_id);
+			
+			while(dev && !kl_streq(dev->uuid, uuid)) {
+				dev = dev->next;
+			}
+			
+			if(!dev) {
+				debug("Physical volume %s (%s) of %s is missing", s->str, pv_id, vg->name);
+				
+				free(params);
+				goto FAIL;
+			}
+			
+			char *new_params = kl_sprintf("%s%s%d:%d %lld", params, params[0] ? " " : "", dev->major, dev->minor, (long long)(pe_start + s->next->num * extent_size));
+			free(params);
+			params = new_params;
+			
+			s = s->next->next;
+		}
+		
+		dm_add_target(&io, start * extent_size, count * extent_size, stripe_count > 1 ? "striped" : "linear", params);
+		free(params);
+	}
+	
+	if(!io->target_count) {
+		debug("%s/%s has no segments", vg->name, lv->key);
+		goto FAIL;
+	}
+	
+	return io;
+	
+	FAIL:
+	free(io);
+	return NULL;
+}
+
+/* Activate a logical volume given as <vg>/<lv>
+ * Returns the name of its block device or NULL on error
+*/
+char const *lvm_activate(char const *id) {
+	lvm_lv *active = active_lvs;
+	struct dm_ioctl *io = NULL;
+	int fd = -1;
+	
+	while(active && !kl_streq(active->id, id)) {
+		active = active->next;
+	}
+	
+	if(active) {
+		return active->devname;
+	}
+	
+	size_t vg_len = strcspn(id, "/");
+	char const *lv_name = id + vg_len + (id[vg_len] ? 1 : 0);
+	
+	lvm_scan();
+	
+	lvm_vg *vg = vgs;
+	
+	while(vg && (strlen(vg->name) != vg_len || !kl_strneq(vg->name, id, vg_len))) {
+		vg = vg->next;
+	}
+	
+	if(!vg) {
+		return NULL;
+	}
+	
+	lvm_node *lvs = lvm_find(vg->root->child, "logical_volumes", LVM_SECTION);
+	lvm_node *lv = lvs ? lvm_find(lvs->child, lv_name, LVM_SECTION) : NULL;
+	
+	if(!lv) {
+		debug("No logical volume %s in %s", lv_name, vg->name);
+		return NULL;
+	}
+	
+	char dm_name[DM_NAME_LEN] = "";
+	
+	dm_name_append(dm_name, sizeof(dm_name), vg->name);
+	strlcat(dm_name, "-", sizeof(dm_name));
+	dm_name_append(dm_name, sizeof(dm_name), lv->key);
+	
+	if((fd = dm_open_control()) == -1) {
+		return NULL;
+	}
+	
+	struct dm_ioctl status;
+	dm_init(&status, dm_name);
+	
+	if(ioctl(fd, DM_DEV_STATUS, &status) == 0) {
+		debug("%s is already active", dm_name);
+		goto ACTIVE;
+	}
+	
+	if(!(io = lvm_build_table(vg, lv, dm_name))) {
+		goto END;
+	}
+	
+	char const *vg_id = lvm_find_str(vg->root->child, "id"), *lv_id = lvm_find_str(lv->child, "id");
+	char vg_uuid[33], lv_uuid[33];	/* 32 characters without the dashes */
+	
+	lvm_strip_uuid(vg_uuid, sizeof(vg_uuid), vg_id ? vg_id : "");
+	lvm_strip_uuid(lv_uuid, sizeof(lv_uuid), lv_id ? lv_id : "");
+	
+	dm_init(&status, dm_name);
+	snprintf(status.uuid, sizeof(status.uuid), "LVM-%s%s", vg_uuid, lv_uuid);
+	
+	if(ioctl(fd, DM_DEV_CREATE, &status) == -1) {
+		debug("Error creating %s: %s", dm_name, strerror(errno));
+		goto END;
+	}
+	
+	if(ioctl(fd, DM_TABLE_LOAD, io) == -1) {
+		debug("Error loading table for %s: %s", dm_name, strerror(errno));
+		goto REMOVE;
+	}
+	
+	/* Resuming the device makes the loaded table live */
+	
+	dm_init(&status, dm_name);
+	
+	if(ioctl(fd, DM_DEV_SUSPEND, &status) == -1) {
+		debug("Error resuming %s: %s", dm_name, strerror(errno));
+		goto REMOVE;
+	}
+	
+	debug("Activated %s with %u segments", dm_name, io->target_count);
+	
+	ACTIVE:
+	active = kl_malloc(sizeof(lvm_lv));
+	
+	strlcpy(active->id, id, sizeof(active->id));
+	snprintf(active->devname, sizeof(active->devname), "dm-%u", minor(status.dev));
+	
+	list_add(&active_lvs, active);
+	
+	goto END;
+	
+	REMOVE:
+	dm_init(&status, dm_name);
+	ioctl(fd, DM_DEV_REMOVE, &status);
+	
+	END:
+	free(io);
+	
+	if(fd != -1) {
+		close(fd);
+	}
+	
+	return active ? active->devname : NULL;
+}
+
+/* Return the block device of an active logical volume or NULL */
+char const *lvm_devname(char const *id) {
+	lvm_lv *active = active_lvs;
+	
+	while(active && !kl_streq(active->id, id)) {
+		active = active->next;
+	}
+	
+	return active ? active->devname : NULL;
+}
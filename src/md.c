@@ -0,0 +1,382 @@
+/* kexec-loader - Native md RAID1 assembly
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* RAID1 arrays with version 1.x metadata are assembled here without mdadm.
+ *
+ * md_add_device() reads the superblock of a block device and files it under
+ * the array with the same set UUID. md_assemble() then hands the members of
+ * each complete array to the kernel with the SET_ARRAY_INFO, ADD_NEW_DISK and
+ * RUN_ARRAY ioctls. The kernel reads the superblocks again itself and kicks out
+ * any members which are out of date.
+ *
+ * Anything else with an md superblock (other levels, 0.90 metadata) is left to
+ * mdadm, if it was built in.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <linux/kdev_t.h>
+#include <linux/major.h>
+#include <linux/raid/md_u.h>
+#include <linux/raid/md_p.h>
+
+#include "md.h"
+#include "misc.h"
+#include "log.h"
+
+/* A 1.x superblock is 256 bytes followed by up to 384 device roles */
+#define MD_SB1_SIZE	1024
+#define MD_SB1_MAX_DEV	((MD_SB1_SIZE - 256) / 2)
+
+typedef struct md_member {
+	struct md_member *next;
+	
+	char name[32];
+	int major;
+	int minor;
+	
+	int role;
+	uint64_t events;
+} md_member;
+
+typedef struct md_array {
+	struct md_array *next;
+	
+	uint8_t uuid[16];
+	char set_name[33];
+	int minor_version;
+	int raid_disks;
+	
+	int running;
+	md_member *members;
+} md_array;
+
+static md_array *arrays = NULL;
+
+/* Calculate the checksum of a 1.x superblock */
+static uint32_t md_sb1_csum(struct mdp_superblock_1 *sb) {
+	uint32_t disk_csum = sb->sb_csum;
+	uint64_t csum = 0;
+	
+	int size = 256 + le32toh(sb->max_dev) * 2;
+	uint32_t *isuper = (uint32_t*)(sb);
+	
+	sb->sb_csum = 0;
+	
+	for(; size >= 4; size -= 4) {
+		csum += le32toh(*(isuper++));
+	}
+	
+	if(size == 2) {
+		csum += le16toh(*(uint16_t*)(isuper));
+	}
+	
+	sb->sb_csum = disk_csum;
+	
+	return htole32((csum & 0xFFFFFFFF) + (csum >> 32));
+}
+
+/* Read the superblock at the given sector, if there is one
+ * Returns 1 if a valid 1.x superblock was found
+*/
+static int md_read_sb1(int fd, char const *path, uint64_t sector, struct mdp_superblock_1 *sb) {
+	if(pread(fd, sb, MD_SB1_SIZE, sector * 512) != MD_SB1_SIZE) {
+		return 0;
+	}
+	
+	if(le32toh(sb->magic) != MD_SB_MAGIC || le32toh(sb->major_version) != 1) {
+		return 0;
+	}
+	
+	if(le64toh(sb->super_offset) != sector) {
+		/* This is the superblock of a partition on this device */
+		return 0;
+	}
+	
+	if(le32toh(sb->max_dev) > MD_SB1_MAX_DEV || md_sb1_csum(sb) != sb->sb_csum) {
+		debug("Invalid md superblock on %s", path);
+		return 0;
+	}
+	
+	return 1;
+}
+
+/* Check a block device for an md superblock and remember it if it belongs to
+ * an array we can assemble.
+ *
+ * Returns MD_NATIVE if it belongs to a RAID1 array with 1.x metadata,
+ * MD_FOREIGN if it has any other kind of md superblock and MD_NONE otherwise.
+*/
+int md_add_device(char const *name, int major, int minor) {
+	char path[256];
+	snprintf(path, sizeof(path), "/dev/%s", name);
+	
+	uint8_t sb_buf[MD_SB1_SIZE];
+	struct mdp_superblock_1 *sb = (struct mdp_superblock_1*)(sb_buf);
+	
+	int ret = MD_NONE, minor_version;
+	
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		debug("Error opening %s: %s", path, strerror(errno));
+		return MD_NONE;
+	}
+	
+	uint64_t size;
+	if(ioctl(fd, BLKGETSIZE64, &size) == -1) {
+		debug("BLKGETSIZE64 on %s failed: %s", path, strerror(errno));
+		goto END;
+	}
+	
+	uint64_t sectors = size / 512;
+	
+	/* 1.1 is at the start of the device, 1.2 4KiB in and 1.0 at least 8KiB
+	 * from the end, aligned to 4KiB.
+	*/
+	
+	if(md_read_sb1(fd, path, 0, sb)) {
+		minor_version = 1;
+	}else if(sectors > 8 && md_read_sb1(fd, path, 8, sb)) {
+		minor_version = 2;
+	}else if(sectors > 16 && md_read_sb1(fd, path, (sectors - 16) & ~(uint64_t)(7), sb)) {
+		minor_version = 0;
+	}else{
+		uint32_t magic;
+		
+		if(sectors >= MD_RESERVED_SECTORS * 2
+			&& pread(fd, &magic, sizeof(magic), MD_NEW_SIZE_SECTORS(sectors) * 512) == sizeof(magic)
+			&& magic == MD_SB_MAGIC)
+		{
+			debug("%s has a 0.90 md superblock", path);
+			ret = MD_FOREIGN;
+		}
+		
+		goto END;
+	}
+	
+	if((int32_t)(le32toh(sb->level)) != 1) {
+		debug("%s is a member of a RAID%d array", path, (int32_t)(le32toh(sb->level)));
+		
+		ret = MD_FOREIGN;
+		goto END;
+	}
+	
+	ret = MD_NATIVE;
+	
+	md_array *array = arrays;
+	
+	while(array && memcmp(array->uuid, sb->set_uuid, 16)) {
+		array = array->next;
+	}
+	
+	if(!array) {
+		array = kl_malloc(sizeof(md_array));
+		
+		memcpy(array->uuid, sb->set_uuid, 16);
+		memcpy(array->set_name, sb->set_name, 32);
+		array->set_name[32] = '\0';
+		array->minor_version = minor_version;
+		array->raid_disks = le32toh(sb->raid_disks);
+		array->running = 0;
+		array->members = NULL;
+		
+		list_add(&arrays, array);
+	}
+	
+	md_member *member = array->members;
+	
+	while(member && (member->major != major || member->minor != minor)) {
+		member = member->next;
+	}
+	
+	if(member) {
+		goto END;
+	}
+	
+	if(array->running) {
+		debug("RAID1 array %s is already running without %s", array->set_name, path);
+		goto END;
+	}
+	
+	member = kl_malloc(sizeof(md_member));
+	
+	strlcpy(member->name, name, sizeof(member->name));
+	member->major = major;
+	member->minor = minor;
+	
+	uint32_t dev_number = le32toh(sb->dev_number);
+	member->role = dev_number < le32toh(sb->max_dev) ? le16toh(sb->dev_roles[dev_number]) : MD_DISK_ROLE_SPARE;
+	member->events = le64toh(sb->events);
+	
+	list_add(&array->members, member);
+	
+	debug("%s is member %d of RAID1 array %s", path, member->role, array->set_name);
+	
+	END:
+	close(fd);
+	
+	return ret;
+}
+
+/* Returns 1 if a device is a member of any array we've found */
+int md_is_member(int major, int minor) {
+	md_array *array;
+	md_member *member;
+	
+	for(array = arrays; array; array = array->next) {
+		for(member = array->members; member; member = member->next) {
+			if(member->major == major && member->minor == minor) {
+				return 1;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+/* Find an unused md device, starting at md127 like mdadm does
+ * Returns an open file descriptor, or -1 on error
+*/
+static int md_open_free(char *path, size_t pathsize) {
+	int num;
+	
+	for(num = 127; num >= 0; num--) {
+		snprintf(path, pathsize, "/dev/md%d", num);
+		
+		if(access(path, F_OK) && mknod(path, 0600 | S_IFBLK, MKDEV(MD_MAJOR, num))) {
+			debug("Failed to create %s device node: %s", path, strerror(errno));
+			return -1;
+		}
+		
+		int fd = open(path, O_RDWR);
+		if(fd == -1) {
+			debug("Error opening %s: %s", path, strerror(errno));
+			return -1;
+		}
+		
+		mdu_array_info_t info;
+		
+		if(ioctl(fd, GET_ARRAY_INFO, &info) == -1 && errno == ENODEV) {
+			return fd;
+		}
+		
+		close(fd);
+	}
+	
+	debug("No free md devices");
+	return -1;
+}
+
+/* Hand the members of an array to the kernel and start it */
+static void md_run(md_array *array) {
+	char path[32];
+	md_member *member;
+	
+	int fd = md_open_free(path, sizeof(path));
+	if(fd == -1) {
+		return;
+	}
+	
+	mdu_array_info_t info;
+	memset(&info, 0, sizeof(info));
+	
+	/* Setting only the version tells the kernel to load the superblocks */
+	
+	info.major_version = 1;
+	info.minor_version = array->minor_version;
+	
+	if(ioctl(fd, SET_ARRAY_INFO, &info) == -1) {
+		debug("SET_ARRAY_INFO on %s failed: %s", path, strerror(errno));
+		goto END;
+	}
+	
+	for(member = array->members; member; member = member->next) {
+		mdu_disk_info_t disk;
+		memset(&disk, 0, sizeof(disk));
+		
+		disk.major = member->major;
+		disk.minor = member->minor;
+		
+		if(ioctl(fd, ADD_NEW_DISK, &disk) == -1) {
+			debug("Error adding %s to %s: %s", member->name, path, strerror(errno));
+		}
+	}
+	
+	if(ioctl(fd, RUN_ARRAY, NULL) == -1) {
+		debug("Error starting %s: %s", path, strerror(errno));
+		
+		ioctl(fd, STOP_ARRAY, NULL);
+		goto END;
+	}
+	
+	debug("Started RAID1 array %s as %s", array->set_name, path);
+	array->running = 1;
+	
+	END:
+	close(fd);
+}
+
+/* Start any arrays which have all their members, or at least one member if
+ * degraded is nonzero.
+*/
+void md_assemble(int degraded) {
+	md_array *array;
+	
+	for(array = arrays; array; array = array->next) {
+		if(array->running || !array->members) {
+			continue;
+		}
+		
+		/* Count the in-sync roles which are filled by up to date members */
+		
+		uint64_t events = 0;
+		md_member *member;
+		
+		for(member = array->members; member; member = member->next) {
+			if(member->events > events) {
+				events = member->events;
+			}
+		}
+		
+		int role, found = 0;
+		
+		for(role = 0; role < array->raid_disks; role++) {
+			for(member = array->members; member; member = member->next) {
+				if(member->role == role && member->events == events) {
+					found++;
+					break;
+				}
+			}
+		}
+		
+		if(found == array->raid_disks || (degraded && found)) {
+			debug("Assembling RAID1 array %s from %d of %d devices", array->set_name, found, array->raid_disks);
+			md_run(array);
+		}
+	}
+}
@@ -0,0 +1,30 @@
+/* kexec-loader - Native md RAID1 assembly header
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KL_MD_H
+#define KL_MD_H
+
+#define MD_NONE		0
+#define MD_NATIVE	1
+#define MD_FOREIGN	2
+
+int md_add_device(char const *name, int major, int minor);
+void md_assemble(int degraded);
+int md_is_member(int major, int minor);
+
+#endif /* !KL_MD_H */
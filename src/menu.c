@@ -20,7 +20,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/utsname.h>
-#include <poll.h>
 #include <ctype.h>
 
 #include "console.h"
@@ -28,12 +27,9 @@
 
 static void draw_static(void);
 static void draw_menu(kl_target *start, int selected);
+static void leave_menu(void);
 
 void menu_main(void) {
-	struct pollfd inpoll;
-	inpoll.fd = fileno(stdin);
-	inpoll.events = POLLIN;
-	
 	kl_target *start = targets;
 	kl_target *target = targets;
 	kl_target *tptr = target;
@@ -59,22 +55,27 @@ void menu_main(void) {
 	}
 	
 	FOOBAR:
+	console_clear();
+	screen_reset();
+	
 	draw_static();
 	draw_menu(start, row);
 	
 	if(timeout >= 0) {
-		console_setpos(1, 3);
-		puts("Press any key to abort");
+		screen_line(1, 3, CONS_RESET, "Press any key to abort");
 		
 		while(timeout) {
-			console_setpos(1, 2);
-			console_erase(ERASE_LINE);
-			printf(
+			char msg[256];
+			
+			snprintf(msg, sizeof(msg),
 				"Booting '%s' in %d %s...", target->title, timeout,
 				timeout > 1 ? "seconds" : "second"
 			);
 			
-			if(poll(&inpoll, 1, 1000)) {
+			screen_line(1, 2, CONS_RESET, msg);
+			screen_update();
+			
+			if(console_poll(1000)) {
 				timeout = -1;
 				break;
 			}
@@ -83,8 +84,7 @@ void menu_main(void) {
 		}
 		
 		if(timeout == 0) {
-			console_setpos(0,2);
-			console_erase(ERASE_DOWN);
+			leave_menu();
 			boot_target(target);
 			
 			timeout = -1;
@@ -93,15 +93,11 @@ void menu_main(void) {
 		}
 	}
 	
-	console_setpos(1, 2);
-	console_erase(ERASE_LINE);
-	puts("Scroll through the list using the up/down arrow keys and press ENTER to select");
-	
-	console_setpos(1, 3);
-	console_erase(ERASE_LINE);
-	puts("a target, D to display disks or C to open the console.");
+	screen_line(1, 2, CONS_RESET, "Scroll through the list using the up/down arrow keys and press ENTER to select");
+	screen_line(1, 3, CONS_RESET, "a target, D to display disks or C to open the console.");
 	
 	while(1) {
+		screen_update();
 		int c = console_getchar();
 		
 		if(c == KEY_UP && row > 6) {
@@ -128,8 +124,7 @@ void menu_main(void) {
 			draw_menu(start, row);
 		}
 		if(c == '\n') {
-			console_setpos(0,2);
-			console_erase(ERASE_DOWN);
+			leave_menu();
 			boot_target(target);
 			
 			goto FOOBAR;
@@ -141,8 +136,7 @@ void menu_main(void) {
 		}
 		
 		if(toupper(c) == 'D') {
-			console_setpos(0,2);
-			console_erase(ERASE_DOWN);
+			leave_menu();
 			
 			alert = 1;
 			list_disks();
@@ -166,65 +160,54 @@ static void draw_static(void) {
 	char version[64];
 	snprintf(version, 64, "kexec-loader " VERSION ", Linux %s", kinfo.release);
 	
-	// char *copyright = "Copyright (C) 2007-2011 Daniel Collins";
-	// int clen = strlen(copyright);
 	int i;
 	
-	console_clear();
-	
-	console_setpos(0,0);
-	console_attrib(CONS_INVERT);
-	for(i = 0; i < console_cols; i++) {
-		putchar(' ');
-	}
-	
-	console_setpos(1,0);
-	fputs(version, stdout);
-	
-	// console_setpos(console_cols-clen-1, 0);
-	// fputs(copyright, stdout);
+	screen_fill(0, 0, console_cols * console_rows, ' ', CONS_RESET);
 	
-	console_attrib(0);
+	screen_fill(0, 0, console_cols, ' ', CONS_INVERT);
+	screen_puts(1, 0, CONS_INVERT, version);
 	
-	console_setpos(0, 5);
-	for(i = 0; i < console_cols; i++) {
-		putchar(i == 0 || i == console_cols-1 ? '+' : '-');
-	}
+	screen_fill(0, 5, console_cols, '-', CONS_RESET);
+	screen_puts(0, 5, CONS_RESET, "+");
+	screen_puts(console_cols-1, 5, CONS_RESET, "+");
 	
 	for(i = 6; i < console_rows-1; i++) {
-		console_setpos(0, i);
-		putchar('|');
-		
-		console_setpos(console_cols-1, i);
-		putchar('|');
+		screen_puts(0, i, CONS_RESET, "|");
+		screen_puts(console_cols-1, i, CONS_RESET, "|");
 	}
 	
-	console_setpos(0, console_rows-1);
-	for(i = 0; i < console_cols; i++) {
-		putchar(i == 0 || i == console_cols-1 ? '+' : '-');
-	}
+	screen_fill(0, console_rows-1, console_cols, '-', CONS_RESET);
+	screen_puts(0, console_rows-1, CONS_RESET, "+");
+	screen_puts(console_cols-1, console_rows-1, CONS_RESET, "+");
 }
 
 /* Draw the menu entries */
 static void draw_menu(kl_target *start, int selected) {
 	int erow = console_rows-2, row = 6;
+	char title[256];
 	
-	while(start && row <= erow) {
-		console_setpos(console_cols-2, row);
-		console_erase(ERASE_SOL);
+	for(; row <= erow; row++) {
+		screen_fill(1, row, console_cols-2, ' ', CONS_RESET);
 		
-		console_setpos(0, row);
-		fputs("| ", stdout);
-		
-		if(row == selected) {
-			console_attrib(CONS_INVERT);
-			fputs(start->title, stdout);
-			console_attrib(0);
-		}else{
-			fputs(start->title, stdout);
+		if(!start) {
+			continue;
 		}
 		
+		/* Keep the title clear of the right hand border */
+		snprintf(title, sizeof(title), "%.*s", console_cols-3 > 0 ? console_cols-3 : 0, start->title);
+		
+		screen_puts(2, row, row == selected ? CONS_INVERT : CONS_RESET, title);
+		
 		start = start->next;
-		row++;
 	}
 }
+
+/* Clear everything below the title bar and leave the cursor at the top of the
+ * cleared area for other output.
+*/
+static void leave_menu(void) {
+	screen_fill(0, 2, console_cols * (console_rows-2), ' ', CONS_RESET);
+	screen_update();
+	
+	console_setpos(0, 2);
+}
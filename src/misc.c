@@ -23,7 +23,6 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <unistd.h>
-#include <sys/klog.h>
 #include <ctype.h>
 #include <sys/syscall.h>
 #include <linux/reboot.h>
@@ -35,9 +34,13 @@
 #include "menu.h"
 #include "grub.h"
 #include "vfs.h"
+#include "arena.h"
+#include "cache.h"
+#include "log.h"
+#include "klog.h"
+#include "deadline.h"
 
-#define KLOG_TTY "/dev/tty2"
-#define DEBUG_TTY "/dev/tty3"
+#define CACHE_FILE "/kexec-loader.cache"
 
 const kl_disk *boot_disk = NULL;
 int timeout = -1;
@@ -45,9 +48,10 @@ char *grub_path = NULL;
 kl_target *targets = NULL;
 kl_module *kmods = NULL;
 int grub_autodetect = 1;	/* 0 if disabled, 1 if unset, 2 if enabled */
+int menu_cache = 0;
+kl_strpool conf_pool = { { NULL }, NULL, 0, 0 };
 
-static void redirect_klog(void);
-static void load_conf(char const *filename);
+static void load_conf(char const *filename, int settings);
 static void sighandler(int sig);
 
 int main(int argc, char **argv) {
@@ -55,15 +59,17 @@ int main(int argc, char **argv) {
 		die("Error mounting /proc: %s", strerror(errno));
 	}
 	
-	#ifdef ENABLE_MDADM
+	/* sysfs is needed for the BIOS disk information (EDD) used to build the
+	 * GRUB device map, for detecting EFI and by mdadm.
+	*/
+	
 	if(mount("none", "/sys", "sysfs", 0, NULL)) {
 		die("Error mounting /sys: %s", strerror(errno));
 	}
-	#endif
 	
 	enable_trace();
 	
-	redirect_klog();
+	klog_start();
 	
 	console_init();
 	console_clear();
@@ -71,14 +77,18 @@ int main(int argc, char **argv) {
 	
 	signal(SIGINT, &sighandler);
 	
+	deadline_init();
+	
 	syscall(
 		__NR_reboot,
 		LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
 		LINUX_REBOOT_CMD_CAD_OFF, NULL
 	);
 	
+	deadline_phase("modules");
 	printd("Loading modules from initramfs...");
 	load_kmod(NULL);
+	reclaim_modules();
 	
 	if(check_file("/noboot")) {
 		debug("Found /noboot on initramfs, not searching for boot disk");
@@ -86,6 +96,8 @@ int main(int argc, char **argv) {
 	}else{
 		char const *kdevice = get_cmdline("root");
 		char const *device = kdevice ? kdevice : "LABEL=kexecloader";
+		
+		deadline_phase("boot-disk");
 		boot_disk = mount_by_id(device, -1);
 		
 		vfs_set_root(device);
@@ -97,23 +109,59 @@ int main(int argc, char **argv) {
 		}
 	}
 	
+	char *cache_path = NULL;
+	
+	deadline_phase("config");
+	
 	if(boot_disk || check_file("/noboot")) {
+		char const *conf_file = NULL;
+		
+		if(boot_disk) {
+			cache_path = vfs_absolute_path(CACHE_FILE);
+		}
+		
 		if(vfs_exists("/kexec-loader.conf")) {
-			load_conf("/kexec-loader.conf");
+			conf_file = "/kexec-loader.conf";
 		}else if(vfs_exists("/kxloader.cfg")) {
-			load_conf("/kxloader.cfg");
-		}else{
-			printd("Warning: No configuration file present");
+			conf_file = "/kxloader.cfg";
+		}
+		
+		/* Settings aren't stored in the menu cache, so they are always
+		 * read from the configuration file. They must be applied before
+		 * the cache is checked, which may mount other disks.
+		*/
+		
+		if(conf_file) {
+			load_conf(conf_file, 1);
 		}
 		
 		if(boot_disk) {
 			if(vfs_exists("/modules/")) {
 				printd("Extracting modules from boot disk...");
+				mount_module_images();
 				extract_module_tars();
 			}
 			
 			printd("Loading remaining modules...");
 			load_kmod(NULL);
+			reclaim_modules();
+		}
+		
+		/* The menu is loaded once the boot disk's modules are, as its
+		 * sources may be on disks which need them.
+		*/
+		
+		if(cache_path && cache_load(cache_path)) {
+			printd("Loaded menu from cache");
+		}else{
+			cache_add_source("/kexec-loader.conf");
+			cache_add_source("/kxloader.cfg");
+			
+			if(conf_file) {
+				load_conf(conf_file, 0);
+			}else{
+				printd("Warning: No configuration file present");
+			}
 		}
 		
 		if(vfs_exists("/keymap.txt")) {
@@ -123,16 +171,29 @@ int main(int argc, char **argv) {
 	
 	vfs_set_jail(NULL);
 	
-	if(grub_path) {
+	if(menu_cached) {
+		debug("Menu loaded from cache, skipping GRUB configuration");
+	}else if(grub_path) {
 		grub_load(grub_path);
 		
 		if(grub_autodetect == 2) {
 			printd("grub-path is set, ignoring grub-autodetect");
 		}
 	}else if(grub_autodetect == 2 || (!targets && grub_autodetect)) {
-		grub_detect();
+		deadline_phase("grub-detect");
+		
+		if(!grub_detect()) {
+			menu_cache = 0;
+		}
+	}
+	
+	if(menu_cache && !menu_cached && cache_path && targets) {
+		printd("Writing menu cache...");
+		cache_save(cache_path);
 	}
 	
+	free(cache_path);
+	
 	/* Attempt to boot target if boot_index or boot_target was passed on the
 	 * kernel command line (boot_index takes priority over boot_target).
 	*/
@@ -148,6 +209,8 @@ int main(int argc, char **argv) {
 	}
 	
 	if(boot_index >= 0 || boot_arg) {
+		deadline_phase("boot");
+		
 		if(boot_index >= 0) {
 			printd("boot_index supplied, trying to boot %d", boot_index);
 		}else{
@@ -173,8 +236,11 @@ int main(int argc, char **argv) {
 	
 	while(1) {
 		if(targets) {
+			deadline_phase("menu");
 			menu_main();
 		}else{
+			deadline_phase("shell");
+			
 			printd("There are no targets defined, dropping to shell");
 			printd("Configure one or more targets to enable the menu");
 			putchar('\n');
@@ -186,148 +252,200 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-static FILE *debug_fh = NULL;
-
-/* Print a message to the debug log/tty */
-void debug(char const *fmt, ...) {
+/* Log error and idle (Exiting will cause panic in older kernels)
+ *
+ * HACK: Behaviour changes if PID is not 1, this is because kexec-tools also has
+ * a die() function and they conflict at link time.
+*/
+void die(char const *fmt, ...) {
 	va_list argv;
 	char msgbuf[256];
 	
-	if(!debug_fh) {
-		char const *path = get_cmdline("debug_tty");
-		debug_fh = fopen(path ? path : DEBUG_TTY, "a");
-		
-		if(!debug_fh) {
-			return;
-		}
-	}
-	
 	va_start(argv, fmt);
 	vsnprintf(msgbuf, 256, fmt, argv);
 	va_end(argv);
 	
-	fprintf(debug_fh, "%s\n", msgbuf);
-	fflush(debug_fh);
+	if(getpid() == 1) {
+		debug("FATAL: %s", msgbuf);
+		printf("\nFATAL: %s", msgbuf);
+		console_sync();
+		
+		while(1) {
+			sleep(9999);
+		}
+	}else{
+		msgbuf[strcspn(msgbuf, "\n")] = '\0';
+		printd("%s", msgbuf);
+		
+		exit(1);
+	}
 }
 
-FILE *get_debug_fh(void)
-{
-	return debug_fh;
-}
+/* The kernel command line is read once and split into a hash table of options
+ * the first time get_cmdline() is called. Like the kernel, double quotes may be
+ * used around an option or its value to include spaces.
+*/
+
+struct cmdline_opt {
+	char const *name;
+	char const *value;
+	unsigned int hash;
+};
 
-/* Disable kernel messages to the console and spawn a process that writes all
- * kernel messages to KLOG_TTY
+static char *cmdline_buf = NULL;
+static struct cmdline_opt *cmdline_opts = NULL;
+static size_t cmdline_size = 0;		/* Slots in cmdline_opts, a power of two */
+static int cmdline_loaded = 0;		/* cmdline_load() has been called */
+
+/* Split the next option from the command line, NUL terminating its name and
+ * value and removing any quotes. Returns a pointer to the following option.
 */
-static void redirect_klog(void) {
-	debug("Disabling printk() to console...");
-	klogctl(6, NULL, 0);
+static char *cmdline_next(char *args, char **name, char **value) {
+	int quoted = 0;
+	size_t i, equals = 0;
 	
-	FILE *klog_fh = fopen(KLOG_TTY, "a");
-	if(!klog_fh) {
-		debug("Error opening " KLOG_TTY ": %s", strerror(errno));
-		return;
+	if(*args == '"') {
+		args++;
+		quoted = 1;
 	}
 	
-	FILE *kmsg_fh = fopen("/proc/kmsg", "r");
-	if(!kmsg_fh) {
-		debug("Error opening /proc/kmsg: %s", strerror(errno));
-		return;
+	for(i = 0; args[i]; i++) {
+		if(isspace(args[i]) && !quoted) {
+			break;
+		}
+		
+		if(equals == 0 && args[i] == '=') {
+			equals = i;
+		}
+		
+		if(args[i] == '"') {
+			quoted = !quoted;
+		}
 	}
 	
-	if(fork()) {
-		return;
+	*name = args;
+	*value = NULL;
+	
+	if(equals) {
+		args[equals] = '\0';
+		*value = args + equals + 1;
+		
+		if(**value == '"') {
+			(*value)++;
+		}
 	}
 	
-	char buf[256];
-	while(fgets(buf, 256, kmsg_fh)) {
-		fputs(buf, klog_fh);
+	if(i > 0 && args[i-1] == '"') {
+		args[i-1] = '\0';
 	}
 	
-	if(ferror(kmsg_fh)) {
-		debug("Error reading /proc/kmsg: %s", strerror(errno));
+	if(args[i]) {
+		args[i++] = '\0';
 	}
 	
-	debug("The /proc/kmsg read loop has exited!");
-	exit(0);
+	return args + i + strspn(args + i, " \t\n");
 }
 
-/* Log error and idle (Exiting will cause panic in older kernels)
+/* Read the command line from a file (/proc/cmdline) into the option table
+ * Returns 1 on success, zero on error.
  *
- * HACK: Behaviour changes if PID is not 1, this is because kexec-tools also has
- * a die() function and they conflict at link time.
+ * debug() calls get_cmdline() when it opens the debug terminal, so the table
+ * must be complete before anything is logged. Calls made while it is still
+ * being loaded find no options.
 */
-void die(char const *fmt, ...) {
-	va_list argv;
-	char msgbuf[256];
+static int cmdline_load(char const *path) {
+	FILE *fh = fopen(path, "r");
+	if(!fh) {
+		debug("Error opening %s: %s", path, strerror(errno));
+		return 0;
+	}
 	
-	va_start(argv, fmt);
-	vsnprintf(msgbuf, 256, fmt, argv);
-	va_end(argv);
+	size_t len = 0, size = 1024, count = 0, i;
+	char *buf = kl_malloc(size);
 	
-	if(getpid() == 1) {
-		debug("FATAL: %s", msgbuf);
-		printf("\nFATAL: %s", msgbuf);
+	while((i = fread(buf + len, 1, size - len - 1, fh)) > 0) {
+		len += i;
 		
-		while(1) {
-			sleep(9999);
+		if(len == size - 1) {
+			buf = kl_realloc(buf, size *= 2);
 		}
-	}else{
-		msgbuf[strcspn(msgbuf, "\n")] = '\0';
-		printd("%s", msgbuf);
+	}
+	
+	if(ferror(fh)) {
+		debug("Error reading %s: %s", path, strerror(errno));
 		
-		exit(1);
+		fclose(fh);
+		free(buf);
+		
+		return 0;
 	}
+	
+	fclose(fh);
+	buf[len] = '\0';
+	
+	/* Each option is at least one character plus a seperator */
+	
+	for(cmdline_size = 16; cmdline_size < len; cmdline_size *= 2) {}
+	
+	cmdline_opts = kl_malloc(cmdline_size * sizeof(struct cmdline_opt));
+	memset(cmdline_opts, 0, cmdline_size * sizeof(struct cmdline_opt));
+	
+	char *args = buf + strspn(buf, " \t\n"), *name, *value;
+	
+	while(*args) {
+		args = cmdline_next(args, &name, &value);
+		
+		unsigned int hash = strpool_hash(name, strlen(name));
+		
+		for(i = hash & (cmdline_size - 1); cmdline_opts[i].name; i = (i + 1) & (cmdline_size - 1)) {
+			if(cmdline_opts[i].hash == hash && kl_streq(cmdline_opts[i].name, name)) {
+				break;
+			}
+		}
+		
+		/* The first occurrence of an option takes precedence */
+		
+		if(!cmdline_opts[i].name) {
+			cmdline_opts[i].name = name;
+			cmdline_opts[i].value = value ? value : "";
+			cmdline_opts[i].hash = hash;
+			
+			count++;
+		}
+	}
+	
+	cmdline_buf = buf;
+	
+	debug("Read %u options from the kernel command line", (unsigned int)(count));
+	
+	return 1;
 }
 
 /* Search the kernel command line for an option
  *
  * Returns the value if the argument was found (may be empty) or NULL otherwise.
- * The value is stored in a static buffer, copy it elsewhere before calling
- * get_cmdline() again if you don't want it to be overwritten!
+ * The value remains valid for the life of the program and must not be modified.
 */
 char const *get_cmdline(char const *name) {
-	FILE *fh = fopen("/proc/cmdline", "r");
-	if(!fh) {
-		debug("Error opening /proc/cmdline: %s", strerror(errno));
-		return NULL;
+	if(!cmdline_loaded) {
+		cmdline_loaded = 1;
+		cmdline_load("/proc/cmdline");
 	}
 	
-	int len = strlen(name);
-	char *r = NULL, buf[1024];
-	static char val[256];
-	
-	if(fgets(buf, 1024, fh)) {
-		r = buf;
-		
-		while((r = strstr(r, name))) {
-			if(r == buf || r[-1] == ' ') {
-				if(r[len] == '=') {
-					r += len+1;
-					break;
-				}else if(strchr("\n ", r[len]) || r[len] == '\0') {
-					r += len;
-					break;
-				}
-			}
-			
-			r++;
-		}
-		
-		if(r) {
-			strlcpy(val, r, sizeof(val));
-			val[strcspn(val, " \n")] = '\0';
-			
-			r = val;
-		}
+	if(!cmdline_buf) {
+		return NULL;
 	}
 	
-	if(ferror(fh)) {
-		debug("Error reading /proc/cmdline: %s", strerror(errno));
-	}
+	unsigned int hash = strpool_hash(name, strlen(name));
+	size_t i;
 	
-	fclose(fh);
+	for(i = hash & (cmdline_size - 1); cmdline_opts[i].name; i = (i + 1) & (cmdline_size - 1)) {
+		if(cmdline_opts[i].hash == hash && kl_streq(cmdline_opts[i].name, name)) {
+			return cmdline_opts[i].value;
+		}
+	}
 	
-	return r;
+	return NULL;
 }
 
 /* Return next value in a string */
@@ -374,10 +492,29 @@ void list_disks(void) {
 	LD_PDIV();
 }
 
+/* Add an initrd to the end of a target's list, the strings are interned in
+ * pool. If dest isn't empty the file is packed into a cpio archive as dest.
+*/
+void add_initrd(kl_target *target, kl_strpool *pool, char const *path, char const *dest) {
+	kl_initrd *initrd = arena_alloc(&(pool->arena), sizeof(kl_initrd));
+	INIT_INITRD(initrd);
+	
+	initrd->path = strpool_intern(pool, path);
+	initrd->dest = strpool_intern(pool, dest);
+	
+	list_add(&(target->initrds), initrd);
+}
+
 /* Prepare the system for reboot and call reboot
  * Returns on error
 */
 void call_reboot(int cmd) {
+	if(cmd == LINUX_REBOOT_CMD_KEXEC) {
+		deadline_stop();
+	}
+	
+	console_sync();
+	debug_sync(1000);
 	unmount_all();
 	sync();
 	
@@ -584,6 +721,32 @@ void list_add(void *rptr, void *node_p) {
 	node->next = NULL;
 }
 
+/* Return the address of the next pointer terminating a list
+ * Nodes may then be added in constant time using list_append().
+*/
+void *list_tail(void *rptr) {
+	struct list **tail = rptr;
+	
+	while(*tail) {
+		tail = &((*tail)->next);
+	}
+	
+	return tail;
+}
+
+/* Add an entry at a tail pointer returned by list_tail()
+ * Returns the new tail pointer
+*/
+void *list_append(void *tail_p, void *node_p) {
+	struct list **tail = tail_p;
+	struct list *node = node_p;
+	
+	node->next = NULL;
+	*tail = node;
+	
+	return &(node->next);
+}
+
 /* Copy a node and add the copy to a list */
 void list_add_copy(void *rptr, void *node, int size) {
 	void *nptr = kl_malloc(size);
@@ -608,6 +771,8 @@ void list_del(void *rptr, void *node) {
 				
 				break;
 			}
+			
+			ptr = ptr->next;
 		}
 	}
 }
@@ -641,219 +806,374 @@ void list_nuke(void *root) {
 	}
 }
 
-#define CFG_CHECK_ARGS(n) { \
-	char *s = val; \
-	int ac = 0; \
-	\
-	while(ac < n && s[0]) { \
-		s += strcspn(s, "\t "); \
-		s += strspn(s, "\t "); \
-		ac++; \
-	} \
-	if(ac < n) { \
-		if(n == 1) { \
-			printD("%s:%u: '%s' requires an argument", fname, lnum, name); \
-		}else{ \
-			printD("%s:%u: '%s' requires %d arguments", fname, lnum, name, n); \
-		} \
-		continue; \
-	} \
+struct conf_state {
+	char const *fname;
+	int lnum;
+	
+	kl_target *target;	/* Target being parsed, NULL outside of a block */
+	int topen;		/* Line number of the current title directive */
+	kl_target *spare;	/* Rejected target, reused by the next title */
+	
+	void *ttail;		/* Tail of the targets list */
+	void *ktail;		/* Tail of the kmods list */
+	void *mtail;		/* Tail of the current target's modules list */
+};
+
+struct conf_directive {
+	char const *name;
+	int len;
+	
+	int args;	/* Minimum number of arguments */
+	int flags;
+	
+	void (*func)(struct conf_state*, char*);
+};
+
+#define CFG_TARGET	(int)(1<<0)	/* Only valid within a target block */
+#define CFG_SETTING	(int)(1<<1)	/* Not stored in the menu cache */
+
+#define CFG_DIRECTIVE(name, args, flags, func) \
+	{name, sizeof(name)-1, args, flags, func}
+
+static void conf_timeout(struct conf_state *cs, char *val);
+static void conf_grub_path(struct conf_state *cs, char *val);
+static void conf_grub_map(struct conf_state *cs, char *val);
+static void conf_grub_autodetect(struct conf_state *cs, char *val);
+static void conf_mount_options(struct conf_state *cs, char *val);
+static void conf_menu_cache(struct conf_state *cs, char *val);
+static void conf_log_handoff(struct conf_state *cs, char *val);
+static void conf_kmod(struct conf_state *cs, char *val);
+static void conf_title(struct conf_state *cs, char *val);
+static void conf_root(struct conf_state *cs, char *val);
+static void conf_image(struct conf_state *cs, char *val);
+static void conf_kernel(struct conf_state *cs, char *val);
+static void conf_initrd(struct conf_state *cs, char *val);
+static void conf_initrd_file(struct conf_state *cs, char *val);
+static void conf_cmdline(struct conf_state *cs, char *val);
+static void conf_append(struct conf_state *cs, char *val);
+static void conf_default(struct conf_state *cs, char *val);
+static void conf_fallback(struct conf_state *cs, char *val);
+static void conf_reset_vga(struct conf_state *cs, char *val);
+static void conf_module(struct conf_state *cs, char *val);
+
+static const struct conf_directive conf_directives[] = {
+	CFG_DIRECTIVE("timeout",         1, 0,           &conf_timeout),
+	CFG_DIRECTIVE("grub-path",       1, CFG_SETTING, &conf_grub_path),
+	CFG_DIRECTIVE("grub-map",        2, CFG_SETTING, &conf_grub_map),
+	CFG_DIRECTIVE("grub-autodetect", 1, CFG_SETTING, &conf_grub_autodetect),
+	CFG_DIRECTIVE("mount-options",   2, CFG_SETTING, &conf_mount_options),
+	CFG_DIRECTIVE("menu-cache",      1, CFG_SETTING, &conf_menu_cache),
+	CFG_DIRECTIVE("log-handoff",     1, CFG_SETTING, &conf_log_handoff),
+	CFG_DIRECTIVE("title",           1, 0,           &conf_title),
+	CFG_DIRECTIVE("root",            1, CFG_TARGET,  &conf_root),
+	CFG_DIRECTIVE("image",           1, CFG_TARGET,  &conf_image),
+	CFG_DIRECTIVE("kernel",          1, CFG_TARGET,  &conf_kernel),
+	CFG_DIRECTIVE("initrd",          1, CFG_TARGET,  &conf_initrd),
+	CFG_DIRECTIVE("initrd-file",     2, CFG_TARGET,  &conf_initrd_file),
+	CFG_DIRECTIVE("cmdline",         1, CFG_TARGET,  &conf_cmdline),
+	CFG_DIRECTIVE("append",          1, CFG_TARGET,  &conf_append),
+	CFG_DIRECTIVE("default",         0, CFG_TARGET,  &conf_default),
+	CFG_DIRECTIVE("fallback",        0, CFG_TARGET,  &conf_fallback),
+	CFG_DIRECTIVE("reset-vga",       0, CFG_TARGET,  &conf_reset_vga),
+	CFG_DIRECTIVE("module",          1, CFG_TARGET,  &conf_module),
+	CFG_DIRECTIVE("kmod",            1, CFG_TARGET,  &conf_kmod),
+	{NULL, 0, 0, 0, NULL}
+};
+
+/* Find a directive in the table
+ *
+ * This is a linear scan rather than a perfect hash or switch. With around 20
+ * directives, comparing the length and first character first rejects almost
+ * every entry without a string comparison, and the table stays the only place
+ * a directive has to be added.
+*/
+static const struct conf_directive *conf_lookup(char const *name) {
+	const struct conf_directive *d;
+	int len = strlen(name);
+	
+	for(d = conf_directives; d->name; d++) {
+		if(d->len == len && d->name[0] == name[0] && memcmp(d->name, name, len) == 0) {
+			return d;
+		}
+	}
+	
+	return NULL;
 }
 
-#define CFG_CHECK_TOPEN() \
-	if(!topen) { \
-		printD("%s:%u: '%s' must be within a target block", fname, lnum, name); \
-		continue; \
+/* Count the space/tab seperated words in a string */
+static int conf_count_args(char const *val) {
+	int ac = 0;
+	
+	while(val[0]) {
+		val += strcspn(val, "\t ");
+		val += strspn(val, "\t ");
+		ac++;
 	}
+	
+	return ac;
+}
 
-#define CFG_ADD_TARGET() \
-	if(!target.root[0]) { \
-		printD("%s:%d: No root device specified", fname, topen); \
-	} \
-	if(!target.kernel[0]) { \
-		printD("%s:%d: No kernel specified", fname, topen); \
-	} \
-	if(!target.root[0] || !target.kernel[0]) { \
-		list_nuke(target.modules); \
-	}else{ \
-		list_add_copy(&targets, &target, sizeof(target)); \
+/* Append the target being parsed to the targets list if it is valid */
+static void conf_add_target(struct conf_state *cs) {
+	kl_target *target = cs->target;
+	
+	if(!target) {
+		return;
+	}
+	
+	if(!target->root[0]) {
+		printD("%s:%d: No root device specified", cs->fname, cs->topen);
 	}
+	if(!target->kernel[0]) {
+		printD("%s:%d: No kernel specified", cs->fname, cs->topen);
+	}
+	
+	if(!target->root[0] || !target->kernel[0]) {
+		cs->spare = target;
+	}else{
+		cs->ttail = list_append(cs->ttail, target);
+	}
+	
+	cs->target = NULL;
+}
 
-/* Load kexec-loader.conf */
-static void load_conf(char const *fname) {
+/* Load kexec-loader.conf
+ *
+ * The file is read in two passes. The first (settings nonzero) applies the
+ * CFG_SETTING directives, the second applies everything which goes into the
+ * menu cache and is skipped when the menu is loaded from it.
+*/
+static void load_conf(char const *fname, int settings) {
 	FILE *fh = vfs_fopen(fname, "r");
 	if(!fh) {
 		printD("Error opening %s: %s", fname, kl_strerror(errno));
 		return;
 	}
 	
-	printd("Loading %s...", fname);
+	if(settings) {
+		printd("Loading %s...", fname);
+	}
 	
-	char line[1024], *name, *val, *val2;
-	int lnum = 0, topen = 0;
-	kl_target target;
-	kl_module mod;
-	kl_gdev gdev;
+	struct conf_state cs;
+	const struct conf_directive *d;
+	char *line = NULL, *name, *val;
+	size_t lsize = 0;
+	int ac;
 	
-	while(fgets(line, 1024, fh)) {
+	memset(&cs, 0, sizeof(cs));
+	cs.fname = fname;
+	cs.ttail = list_tail(&targets);
+	cs.ktail = list_tail(&kmods);
+	
+	while(getline(&line, &lsize, fh) != -1) {
 		line[strcspn(line, "\r\n")] = '\0';
-		lnum++;
+		cs.lnum++;
 		
 		name = line+strspn(line, "\r\n\t ");
-		val = next_value(name);
 		
 		if(name[0] == '#' || name[0] == '\0') {
 			continue;
 		}
 		
-		if(kl_streq(name, "timeout")) {
-			CFG_CHECK_ARGS(1);
-			
-			if(kl_streq(val, "off")) {
-				timeout = -2;
-			}else{
-				timeout = atoi(val);
+		val = next_value(name);
+		
+		if(!(d = conf_lookup(name))) {
+			if(!settings) {
+				printD("%s:%d: Unknown directive '%s'", fname, cs.lnum, name);
 			}
 			
 			continue;
 		}
-		if(kl_streq(name, "grub-path")) {
-			CFG_CHECK_ARGS(1);
-			
-			if(*val != '(') {
-				printD("%s:%d: No device specified", fname, lnum);
-				continue;
-			}
-			
-			free(grub_path);
-			grub_path = kl_strdup(val);
-			
+		
+		if(!settings != !(d->flags & CFG_SETTING)) {
 			continue;
 		}
-		if(kl_streq(name, "grub-map")) {
-			val2 = next_value(val);
-			CFG_CHECK_ARGS(2);
-			
-			if(!parse_gdev(&gdev, val)) {
-				printD("%s:%d: Invalid GRUB device '%s'", fname, lnum, val);
-				continue;
-			}
-			
-			strlcpy(gdev.device, val2, sizeof(gdev.device));
-			list_add_copy(&grub_devmap, &gdev, sizeof(gdev));
-			
+		
+		if((d->flags & CFG_TARGET) && !cs.target) {
+			printD("%s:%u: '%s' must be within a target block", fname, cs.lnum, name);
 			continue;
 		}
-		if(kl_streq(name, "grub-autodetect")) {
-			CFG_CHECK_ARGS(1);
-			
-			if(kl_strceq(val, "on")) {
-				grub_autodetect = 2;
-			}else if(kl_strceq(val, "off")) {
-				grub_autodetect = 0;
+		
+		if((ac = conf_count_args(val)) < d->args) {
+			if(d->args == 1) {
+				printD("%s:%u: '%s' requires an argument", fname, cs.lnum, name);
 			}else{
-				printD("%s:%d: Expected 'on' or 'off' after grub-autodetect", fname, lnum);
+				printD("%s:%u: '%s' requires %d arguments", fname, cs.lnum, name, d->args);
 			}
 			
 			continue;
 		}
 		
-		if(kl_streq(name, "title")) {
-			CFG_CHECK_ARGS(1);
-			
-			if(topen) {
-				CFG_ADD_TARGET();
-			}
-			
-			INIT_TARGET(&target);
-			strlcpy(target.title, val, sizeof(target.title));
-			topen = lnum;
-			
-			continue;
-		}
-		if(kl_streq(name, "root")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			strlcpy(target.root, val, sizeof(target.root));
-			continue;
-		}
-		if(kl_streq(name, "kernel")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			strlcpy(target.kernel, val, sizeof(target.kernel));
-			continue;
-		}
-		if(kl_streq(name, "initrd")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			strlcpy(target.initrd, val, sizeof(target.initrd));
-			continue;
-		}
-		if(kl_streq(name, "cmdline")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			strlcpy(target.cmdline, val, sizeof(target.cmdline));
-			continue;
-		}
-		if(kl_streq(name, "append")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			strlcpy(target.append, val, sizeof(target.append));
-			continue;
-		}
-		if(kl_streq(name, "default")) {
-			CFG_CHECK_TOPEN();
-			
-			target.flags |= TARGET_DEFAULT;
-			continue;
-		}
-		if(kl_streq(name, "reset-vga")) {
-			CFG_CHECK_TOPEN();
-			
-			target.flags |= TARGET_RESET;
-			continue;
-		}
-		if(kl_streq(name, "module")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			INIT_MODULE(&mod);
-			strlcpy(mod.args, next_value(val), sizeof(mod.args));
-			strlcpy(mod.name, val, sizeof(mod.name));
-			list_add_copy(&target.modules, &mod, sizeof(mod));
-			
-			continue;
-		}
-		if(kl_streq(name, "kmod")) {
-			CFG_CHECK_TOPEN();
-			CFG_CHECK_ARGS(1);
-			
-			INIT_MODULE(&mod);
-			strlcpy(mod.args, next_value(val), sizeof(mod.args));
-			strlcpy(mod.name, val, sizeof(mod.name));
-			list_add_copy(&kmods, &mod, sizeof(mod));
-			
-			continue;
-		}
-		
-		printD("%s:%d: Unknown directive '%s'", fname, lnum, name);
+		d->func(&cs, val);
 	}
 	if(ferror(fh)) {
 		printD("Error reading %s: %s", fname, strerror(errno));
 	}
 	
-	if(topen) {
-		CFG_ADD_TARGET();
-	}
+	conf_add_target(&cs);
 	
+	free(line);
 	fclose(fh);
 }
 
+static void conf_timeout(struct conf_state *cs, char *val) {
+	if(kl_streq(val, "off")) {
+		timeout = -2;
+	}else{
+		timeout = atoi(val);
+	}
+}
+
+static void conf_grub_path(struct conf_state *cs, char *val) {
+	if(*val != '(') {
+		printD("%s:%d: No device specified", cs->fname, cs->lnum);
+		return;
+	}
+	
+	free(grub_path);
+	grub_path = kl_strdup(val);
+}
+
+static void conf_grub_map(struct conf_state *cs, char *val) {
+	char *val2 = next_value(val);
+	kl_gdev gdev;
+	
+	if(!parse_gdev(&gdev, val)) {
+		printD("%s:%d: Invalid GRUB device '%s'", cs->fname, cs->lnum, val);
+		return;
+	}
+	
+	strlcpy(gdev.device, val2, sizeof(gdev.device));
+	add_gdev(&gdev);
+}
+
+static void conf_grub_autodetect(struct conf_state *cs, char *val) {
+	if(kl_strceq(val, "on")) {
+		grub_autodetect = 2;
+	}else if(kl_strceq(val, "off")) {
+		grub_autodetect = 0;
+	}else{
+		printD("%s:%d: Expected 'on' or 'off' after grub-autodetect", cs->fname, cs->lnum);
+	}
+}
+
+static void conf_mount_options(struct conf_state *cs, char *val) {
+	char *options = next_value(val);
+	
+	add_mount_options(val, options);
+}
+
+/* Allocate a module from a "<name> [args]" directive value */
+static kl_module *conf_new_module(char *val) {
+	kl_module *mod = arena_alloc(&(conf_pool.arena), sizeof(kl_module));
+	
+	INIT_MODULE(mod);
+	mod->args = strpool_intern(&conf_pool, next_value(val));
+	mod->name = strpool_intern(&conf_pool, val);
+	
+	return mod;
+}
+
+static void conf_menu_cache(struct conf_state *cs, char *val) {
+	if(kl_strceq(val, "on")) {
+		menu_cache = 1;
+	}else if(kl_strceq(val, "off")) {
+		menu_cache = 0;
+	}else{
+		printD("%s:%d: Expected 'on' or 'off' after menu-cache", cs->fname, cs->lnum);
+	}
+}
+
+static void conf_log_handoff(struct conf_state *cs, char *val) {
+	if(kl_strceq(val, "on")) {
+		log_handoff = 1;
+	}else if(kl_strceq(val, "off")) {
+		log_handoff = 0;
+	}else{
+		printD("%s:%d: Expected 'on' or 'off' after log-handoff", cs->fname, cs->lnum);
+	}
+}
+
+static void conf_kmod(struct conf_state *cs, char *val) {
+	cs->ktail = list_append(cs->ktail, conf_new_module(val));
+}
+
+static void conf_title(struct conf_state *cs, char *val) {
+	conf_add_target(cs);
+	
+	if(cs->spare) {
+		cs->target = cs->spare;
+		cs->spare = NULL;
+	}else{
+		cs->target = arena_alloc(&(conf_pool.arena), sizeof(kl_target));
+	}
+	
+	INIT_TARGET(cs->target);
+	cs->target->title = strpool_intern(&conf_pool, val);
+	cs->topen = cs->lnum;
+	cs->mtail = &(cs->target->modules);
+}
+
+static void conf_root(struct conf_state *cs, char *val) {
+	cs->target->root = strpool_intern(&conf_pool, val);
+}
+
+/* Use a disk image as the root device, the image path is qualified now so it
+ * doesn't depend on the root device and jail when the target is booted.
+*/
+static void conf_image(struct conf_state *cs, char *val) {
+	char *path = vfs_absolute_path(val);
+	if(!path) {
+		printD("%s:%d: Invalid image path: %s", cs->fname, cs->lnum, kl_strerror(errno));
+		return;
+	}
+	
+	char *root = kl_sprintf("nojail,IMAGE=%s", path);
+	
+	cs->target->root = strpool_intern(&conf_pool, root);
+	
+	free(root);
+	free(path);
+}
+
+static void conf_kernel(struct conf_state *cs, char *val) {
+	cs->target->kernel = strpool_intern(&conf_pool, val);
+}
+
+static void conf_initrd(struct conf_state *cs, char *val) {
+	add_initrd(cs->target, &conf_pool, val, "");
+}
+
+static void conf_initrd_file(struct conf_state *cs, char *val) {
+	char *dest = next_value(val);
+	
+	add_initrd(cs->target, &conf_pool, val, dest);
+}
+
+static void conf_cmdline(struct conf_state *cs, char *val) {
+	cs->target->cmdline = strpool_intern(&conf_pool, val);
+}
+
+static void conf_append(struct conf_state *cs, char *val) {
+	cs->target->append = strpool_intern(&conf_pool, val);
+}
+
+static void conf_default(struct conf_state *cs, char *val) {
+	cs->target->flags |= TARGET_DEFAULT;
+}
+
+static void conf_fallback(struct conf_state *cs, char *val) {
+	cs->target->flags |= TARGET_FALLBACK;
+}
+
+static void conf_reset_vga(struct conf_state *cs, char *val) {
+	cs->target->flags |= TARGET_RESET;
+}
+
+static void conf_module(struct conf_state *cs, char *val) {
+	cs->mtail = list_append(cs->mtail, conf_new_module(val));
+}
+
 /* Handle signals */
 static void sighandler(int sig) {
 	signal(sig, SIG_IGN);
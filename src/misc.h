@@ -20,6 +20,7 @@
 #define KL_MISC_H
 
 #include "disk.h"
+#include "arena.h"
 
 #define EINFILE	256	/* Invalid filename */
 #define EBADFS	257	/* Unknown filesystem format */
@@ -27,41 +28,62 @@
 
 #define TARGET_DEFAULT	(int)(1<<0)
 #define TARGET_RESET	(int)(1<<1)
+#define TARGET_FALLBACK	(int)(1<<2)
+
+/* The strings in kl_module, kl_initrd and kl_target are never NULL, unset strings point to
+ * an empty string. Targets loaded from configuration files store their strings
+ * in conf_pool.
+*/
 
 #define INIT_MODULE(ptr) \
 	(ptr)->next = NULL; \
-	(ptr)->name[0] = '\0'; \
-	(ptr)->args[0] = '\0';
+	(ptr)->name = ""; \
+	(ptr)->args = "";
 
 typedef struct kl_module {
 	struct kl_module *next;
 	
-	char name[1024];
-	char args[1024];
+	char const *name;
+	char const *args;
 } kl_module;
 
+#define INIT_INITRD(ptr) \
+	(ptr)->next = NULL; \
+	(ptr)->path = ""; \
+	(ptr)->dest = "";
+
+/* An initrd, or a file to be packed into a generated cpio archive at dest if
+ * dest is set. The initrds of a target are concatenated in order.
+*/
+typedef struct kl_initrd {
+	struct kl_initrd *next;
+	
+	char const *path;
+	char const *dest;
+} kl_initrd;
+
 #define INIT_TARGET(ptr) \
 	(ptr)->next = NULL; \
-	(ptr)->title[0] = '\0'; \
+	(ptr)->title = ""; \
 	(ptr)->flags = 0; \
-	(ptr)->root[0] = '\0'; \
-	(ptr)->kernel[0] = '\0'; \
-	(ptr)->initrd[0] = '\0'; \
-	(ptr)->cmdline[0] = '\0'; \
-	(ptr)->append[0] = '\0'; \
+	(ptr)->root = ""; \
+	(ptr)->kernel = ""; \
+	(ptr)->initrds = NULL; \
+	(ptr)->cmdline = ""; \
+	(ptr)->append = ""; \
 	(ptr)->modules = NULL;
 
 typedef struct kl_target {
 	struct kl_target *next;
 	
-	char title[256];
+	char const *title;
 	int flags;
 	
-	char root[256];
-	char kernel[1024];
-	char initrd[1024];
-	char cmdline[1024];
-	char append[1024];
+	char const *root;
+	char const *kernel;
+	kl_initrd *initrds;
+	char const *cmdline;
+	char const *append;
 	kl_module *modules;
 } kl_target;
 
@@ -73,13 +95,15 @@ extern char *grub_path;
 extern kl_target *targets;
 extern kl_module *kmods;
 extern int grub_autodetect;
+extern int menu_cache;
+extern kl_strpool conf_pool;
 
 void debug(char const *fmt, ...);
-FILE *get_debug_fh(void);
 void die(char const *fmt, ...);
 char const *get_cmdline(char const *name);
 char *next_value(char *ptr);
 void list_disks(void);
+void add_initrd(kl_target *target, kl_strpool *pool, char const *path, char const *dest);
 void call_reboot(int cmd);
 
 void *kl_malloc(size_t size);
@@ -97,6 +121,8 @@ int kl_streq_end(char const *str, char const *match);
 int kl_str_match_len(const char *s1, const char *s2);
 
 void list_add(void *rptr, void *node_p);
+void *list_tail(void *rptr);
+void *list_append(void *tail_p, void *node_p);
 void list_add_copy(void *rptr, void *node, int size);
 void list_del(void *rptr, void *node);
 void *list_prev(void *root, void *node);
@@ -106,7 +132,9 @@ int check_file(char const *file);
 
 int load_kmod(char const *module);
 void extract_module_tars(void);
+void mount_module_images(void);
 int modprobe_dir(char const *dir, char const *modname);
+void reclaim_modules(void);
 void boot_target(kl_target *target);
 void shell_main(void);
 void load_keymap(char const *file);
@@ -29,11 +29,43 @@
 #include <endian.h>
 #include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 
 #include "console.h"
 #include "misc.h"
 #include "globcmp.h"
 #include "vfs.h"
+#include "disk.h"
+
+/* Modules in the initramfs and extracted from tarballs */
+#define MODULE_DIR "/modules"
+
+/* Partially extracted file left by extract_tar() */
+#define TAR_STAGING_FILE "/tarfile.tmp"
+
+/* Module images on the boot disk are loop-mounted in this directory, under
+ * their names without the extension.
+*/
+#define MODULE_IMAGE_DIR "/modules"
+
+typedef struct module_image {
+	struct module_image *next;
+	
+	char path[256];	/* vpath of the mounted image */
+} module_image;
+
+static module_image *module_images = NULL;
+
+typedef struct loaded_module {
+	struct loaded_module *next;
+	
+	char name[64];
+} loaded_module;
+
+/* Modules which are in the kernel, their files may have been deleted */
+static loaded_module *loaded_modules = NULL;
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define ELF_ORDER ELFDATA2LSB
@@ -49,6 +81,8 @@ static char *elf64_getsection(char const *elf, char const *name, size_t *size);
 static void elf2host_(void *dest, void const *src, int size, char eidata);
 static int modprobe(char const *name, char const *buf, size_t size);
 static const char *moderror(int err);
+static void module_loaded(char const *name);
+static int is_module_loaded(char const *name);
 
 /* Load a section from an ELF binary
  * Calls elf32_getsection() or elf64_getsection() depending on ELF format
@@ -171,7 +205,7 @@ static void elf2host_(void *dest, void const *src, int size, char eidata) {
 
 /* Load a module */
 static int modprobe(char const *name, char const *buf, size_t size) {
-	char *args = "";
+	char const *args = "";
 	char dep[256];
 	
 	kl_module *optptr = kmods;
@@ -214,18 +248,46 @@ static int modprobe(char const *name, char const *buf, size_t size) {
 	
 	if(syscall(SYS_init_module, buf, size, args)) {
 		if(errno == EEXIST) {
+			module_loaded(name);
 			return 1;
 		}
 		
 		printD("Error loading '%s': %s", name, moderror(errno));
 	}else{
 		debug("Loaded module '%s' (%s)", name, args);
+		
+		module_loaded(name);
 		return 1;
 	}
 	
 	return 0;
 }
 
+/* Remember that a module is in the kernel */
+static void module_loaded(char const *name) {
+	if(is_module_loaded(name)) {
+		return;
+	}
+	
+	loaded_module module;
+	strlcpy(module.name, name, sizeof(module.name));
+	
+	list_add_copy(&loaded_modules, &module, sizeof(module));
+}
+
+/* Returns 1 if a module has been loaded into the kernel */
+static int is_module_loaded(char const *name) {
+	loaded_module *module = loaded_modules;
+	
+	for(; module; module = module->next) {
+		if(kl_streq(module->name, name)) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
 /* Return a module error string */
 static const char *moderror(int err) {
 	switch (err) {
@@ -242,20 +304,165 @@ static const char *moderror(int err) {
 	}
 }
 
-/* Find and load a module
- * Returns 1 if the module was loaded, 0 otherwise
+/* Find and load a module, or every module if module is NULL
+ * Returns 1 if the module (or any module) was loaded, 0 otherwise
+ *
+ * A named module stops the search at the first directory it is loaded from,
+ * without one every directory and module image is searched.
  *
  * NOTE: Only call during init (when VFS root is set to boot disk)
 */
 int load_kmod(char const *module) {
-	if(modprobe_dir("(nojail,rootfs)/modules/", module)) {
+	int loaded = 0;
+	
+	if(module && is_module_loaded(module)) {
 		return 1;
 	}
-	if(boot_disk && vfs_exists("/modules/") && modprobe_dir("/modules/", module)) {
-		return 1;
+	
+	loaded |= modprobe_dir("(nojail,rootfs)/modules/", module);
+	
+	if(boot_disk && (!loaded || !module) && vfs_exists("/modules/")) {
+		loaded |= modprobe_dir("/modules/", module);
 	}
 	
-	return 0;
+	module_image *image;
+	
+	for(image = module_images; image && (!loaded || !module); image = image->next) {
+		loaded |= modprobe_dir(image->path, module);
+	}
+	
+	return loaded;
+}
+
+/* Mount SquashFS/EROFS module images from the boot floppy modules directory
+ * Modules in them are read (and decompressed) only as they are loaded, rather
+ * than being extracted to the initramfs like tarballs.
+*/
+void mount_module_images(void) {
+	if(!boot_disk) {
+		return;
+	}
+	
+	DIR *dh = vfs_opendir("/modules/");
+	if(!dh) {
+		printD("Error opening modules directory: %s", kl_strerror(errno));
+		return;
+	}
+	
+	struct dirent *node;
+	while((node = readdir(dh))) {
+		char const *fstype = NULL;
+		int extlen = 0;
+		
+		if(kl_streq_end(node->d_name, ".squashfs")) {
+			fstype = "squashfs";
+			extlen = 9;
+		}else if(kl_streq_end(node->d_name, ".erofs")) {
+			fstype = "erofs";
+			extlen = 6;
+		}else{
+			continue;
+		}
+		
+		char *iname = kl_sprintf("/modules/%s", node->d_name);
+		char *rpath = vfs_translate_path(iname);
+		char *mpoint = kl_sprintf(MODULE_IMAGE_DIR "/%.*s", (int)(strlen(node->d_name) - extlen), node->d_name);
+		
+		if(!rpath) {
+			debug("vfs_translate_path(%s): %s", iname, kl_strerror(errno));
+		}else if(!mount_image(rpath, mpoint, fstype)) {
+			printD("Error mounting %s: %s", iname, strerror(errno));
+		}else{
+			module_image image;
+			snprintf(image.path, sizeof(image.path), "(nojail,rootfs)%s/", mpoint);
+			
+			list_add_copy(&module_images, &image, sizeof(image));
+		}
+		
+		free(mpoint);
+		free(rpath);
+		free(iname);
+	}
+	
+	closedir(dh);
+}
+
+/* Get the number of KiB used on the initramfs
+ * Returns -1 if the filesystem doesn't keep count (ramfs)
+*/
+static long long rootfs_used(void) {
+	struct statfs fs;
+	
+	if(statfs("/", &fs) == -1 || fs.f_blocks == 0) {
+		return -1;
+	}
+	
+	return (long long)(fs.f_blocks - fs.f_bfree) * fs.f_bsize / 1024;
+}
+
+/* Delete a file from the initramfs, adding the space it used to freed */
+static int reclaim_file(char const *path, long long *freed) {
+	struct stat st;
+	
+	if(lstat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+	
+	if(unlink(path) == -1) {
+		debug("Error deleting %s: %s", path, strerror(errno));
+		return 0;
+	}
+	
+	*freed += (long long)(st.st_blocks) * 512 / 1024;
+	return 1;
+}
+
+/* Delete module files from the initramfs once they are loaded into the kernel,
+ * along with anything left behind by extracting module tarballs.
+ *
+ * The initramfs is held in RAM, so this gives back the memory used by the
+ * files before a kernel and initrd are loaded.
+*/
+void reclaim_modules(void) {
+	long long used = rootfs_used(), freed = 0;
+	int files = 0;
+	
+	DIR *dh = opendir(MODULE_DIR);
+	
+	if(dh) {
+		struct dirent *node;
+		
+		while((node = readdir(dh))) {
+			if(!kl_streq_end(node->d_name, ".ko")) {
+				continue;
+			}
+			
+			char *name = kl_strndup(node->d_name, strlen(node->d_name)-3);
+			
+			if(is_module_loaded(name)) {
+				char *path = kl_sprintf(MODULE_DIR "/%s", node->d_name);
+				files += reclaim_file(path, &freed);
+				free(path);
+			}
+			
+			free(name);
+		}
+		
+		closedir(dh);
+	}
+	
+	files += reclaim_file(TAR_STAGING_FILE, &freed);
+	
+	if(!files) {
+		return;
+	}
+	
+	if(used >= 0) {
+		debug("Deleted %d loaded module files (%lld KiB), initramfs usage %lld KiB -> %lld KiB",
+			files, freed, used, rootfs_used());
+	}else{
+		debug("Deleted %d loaded module files (%lld KiB)", files, freed);
+	}
 }
 
 /* Extract tarballs from the boot floppy modules directory */
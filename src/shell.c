@@ -17,6 +17,7 @@
 */
 
 #include <stdlib.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -35,6 +36,8 @@
 #include "disk.h"
 #include "globcmp.h"
 #include "vfs.h"
+#include "log.h"
+#include "klog.h"
 
 #define CMDBUF_SIZE 1024
 #define HISTORY_SIZE 32
@@ -78,14 +81,17 @@ static void cmd_ls(char *cmd, char *args);
 static void cmd_find(char *cmd, char *args);
 static void find_files(char *path, char const *name);
 static void cmd_cat(char *cmd, char *args);
+static void cmd_log(char *cmd, char *args);
+static void cmd_dmesg(char *cmd, char *args);
 
 static kl_target target;
+static kl_strpool shell_pool;
 static int srow, scol;
 
 static struct shell_command commands[] = {
 	{"root", "root <device>\t\tSet root device", ac_dev, NULL},
 	{"kernel", "kernel <file>\t\tSelect a kernel", ac_file, NULL},
-	{"initrd", "initrd <file>\t\tSelect an initrd", ac_file, NULL},
+	{"initrd", "initrd [<file>]\t\tAdd an initrd, or remove them all", ac_file, NULL},
 	{"cmdline", "cmdline <text>\t\tSet the kernel command line", ac_none, NULL},
 	{"append", "append <text>\t\tLike cmdline, but less portable", ac_none, NULL},
 	{"boot", "boot\t\t\tBoot the system", ac_none, NULL},
@@ -95,20 +101,22 @@ static struct shell_command commands[] = {
 	{"find", "find <name> <path>\tSearch for files named <name>", ac_dir, &cmd_find},
 	{"cat", "cat <file>\t\tDisplay the contents of a file", ac_file, &cmd_cat},
 	{"disks", "disks\t\t\tDisplay disks which have been detected", ac_none, NULL},
+	{"log", "log\t\t\tDisplay the debug log", ac_none, &cmd_log},
+	{"dmesg", "dmesg [<level>]\t\tDisplay kernel messages", ac_none, &cmd_dmesg},
 	{"exit", "exit\t\t\tReturn to the menu", ac_none, NULL},
 	{NULL, NULL}
 };
 
 #define TEXT_COMMAND(name, dest) \
 	if(kl_streq(cmd, name)) { \
-		strlcpy(dest, args, sizeof(dest)); \
+		dest = strpool_intern(&shell_pool, args); \
 		continue; \
 	}
 
 #define PATH_COMMAND(name, dest) \
 	if(kl_streq(cmd, name)) { \
 		if(!args[0] || vfs_exists(args)) { \
-			strlcpy(dest, args, sizeof(dest)); \
+			dest = strpool_intern(&shell_pool, args); \
 		}else{ \
 			printf("Error: %s\n", kl_strerror(errno)); \
 		} \
@@ -125,6 +133,7 @@ void shell_main(void) {
 	}
 	
 	INIT_TARGET(&target);
+	INIT_STRPOOL(&shell_pool);
 	
 	vfs_set_root(NULL);
 	
@@ -163,13 +172,25 @@ void shell_main(void) {
 		}
 		
 		PATH_COMMAND("kernel", target.kernel);
-		PATH_COMMAND("initrd", target.initrd);
+		
+		if(kl_streq(cmd, "initrd")) {
+			if(!args[0]) {
+				target.initrds = NULL;
+			}else if(vfs_exists(args)) {
+				add_initrd(&target, &shell_pool, args, "");
+			}else{
+				printf("Error: %s\n", kl_strerror(errno));
+			}
+			
+			continue;
+		}
+		
 		TEXT_COMMAND("cmdline", target.cmdline);
 		TEXT_COMMAND("append", target.append);
 		
 		if(kl_streq(cmd, "root")) {
 			vfs_set_root(args[0] ? args : NULL);
-			strlcpy(target.root, args, sizeof(target.root));
+			target.root = strpool_intern(&shell_pool, args);
 			
 			continue;
 		}
@@ -209,7 +230,7 @@ void shell_main(void) {
 	}
 	
 	free(cmd);
-	list_nuke(target.modules);
+	strpool_free(&shell_pool);
 	
 	for(i = 0; i < HISTORY_SIZE; i++) {
 		free(history[i]);
@@ -616,13 +637,13 @@ static void cmd_module(char *cmd, char *args) {
 		return;
 	}
 	
-	kl_module mod;
-	INIT_MODULE(&mod);
+	kl_module *mod = arena_alloc(&(shell_pool.arena), sizeof(kl_module));
+	INIT_MODULE(mod);
 	
-	strlcpy(mod.args, next_value(args), sizeof(mod.args));
-	strlcpy(mod.name, args, sizeof(mod.args));
+	mod->args = strpool_intern(&shell_pool, next_value(args));
+	mod->name = strpool_intern(&shell_pool, args);
 	
-	list_add_copy(&(target.modules), &mod, sizeof(mod));
+	list_add(&(target.modules), mod);
 }
 
 /* List directory contents */
@@ -746,3 +767,16 @@ static void cmd_cat(char *cmd, char *args) {
 	
 	fclose(fh);
 }
+
+static void cmd_log(char *cmd, char *args) {
+	log_dump(stdout);
+}
+
+static void cmd_dmesg(char *cmd, char *args) {
+	if(*args && !isdigit(*args)) {
+		printf("Usage: dmesg [<level>]\n");
+		return;
+	}
+	
+	klog_dump(stdout, *args ? atoi(args) : 7);
+}
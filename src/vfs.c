@@ -93,7 +93,7 @@ static void append_path(char *path, const char *path_in) {
 */
 char *vfs_translate_path(char const *path_in) {
 	char const *disk = vfs_root;
-	char disk_buf[32];
+	char *disk_buf = NULL;
 	int jail_len = vfs_jail ? strlen(vfs_jail) : 0;
 	
 	if(path_in[0] == '(') {
@@ -102,14 +102,13 @@ char *vfs_translate_path(char const *path_in) {
 			return NULL;
 		}
 		
-		strncpy(disk_buf, path_in+1, sizeof(disk_buf));
-		disk_buf[strcspn(disk_buf, ")")] = '\0';
-		disk = disk_buf;
-		
+		disk = disk_buf = kl_strndup(path_in+1, strcspn(path_in+1, ")"));
 		path_in = strchr(path_in, ')')+1;
 	}
 	
 	if(!disk || *disk == '\0') {
+		free(disk_buf);
+		
 		errno = ENDISK;
 		return NULL;
 	}
@@ -120,10 +119,13 @@ char *vfs_translate_path(char const *path_in) {
 	}
 	
 	if(kl_streq(disk, "debug")) {
+		free(disk_buf);
 		return kl_strdup(path_in);
 	}
 	
 	char *disk_r = disk_root(disk);
+	free(disk_buf);
+	
 	if(!disk_r) {
 		return NULL;
 	}
@@ -142,6 +144,53 @@ char *vfs_translate_path(char const *path_in) {
 	return path;
 }
 
+/* Qualify a VFS path with its device and jail
+ *
+ * Returns a path in an allocated buffer which refers to the same file as
+ * path_in regardless of the VFS root device and jail in effect when it is
+ * used. Returns NULL and sets errno if no device is specified or set.
+*/
+char *vfs_absolute_path(char const *path_in) {
+	char const *disk = vfs_root, *jail = vfs_jail;
+	int disk_len = disk ? strlen(disk) : 0;
+	
+	if(path_in[0] == '(') {
+		if(!strchr(path_in, ')')) {
+			errno = EINFILE;
+			return NULL;
+		}
+		
+		disk = path_in+1;
+		disk_len = strcspn(disk, ")");
+		
+		path_in = strchr(path_in, ')')+1;
+	}
+	
+	if(!disk || disk_len == 0) {
+		errno = ENDISK;
+		return NULL;
+	}
+	
+	if(kl_strneq(disk, "nojail,", 7)) {
+		disk += 7;
+		disk_len -= 7;
+		jail = NULL;
+	}
+	
+	char *path = kl_malloc(strlen(path_in) + (jail ? strlen(jail) : 0) + 3);
+	
+	if(jail) {
+		append_path(path, jail);
+	}
+	
+	append_path(path, path_in);
+	
+	char *ret = kl_sprintf("(nojail,%.*s)%s", disk_len, disk, path[0] ? path : "/");
+	free(path);
+	
+	return ret;
+}
+
 /* Sets the VFS root device
  *
  * The string is copied so it may be changed or deallocated once this function
@@ -25,6 +25,7 @@
 #include <dirent.h>
 
 char *vfs_translate_path(char const *path_in);
+char *vfs_absolute_path(char const *path_in);
 void vfs_set_root(char const *root);
 void vfs_set_jail(const char *jail);
 int vfs_open(char const *filename, int flags, ...);
@@ -19,8 +19,18 @@
 use strict;
 use warnings;
 
+# Packages are LZMA compressed tarballs by default, --squashfs or --erofs
+# creates filesystem images instead, which kexec-loader mounts rather than
+# extracting.
+#
+my $format = "tlz";
+
+if(@ARGV == 2 && ($ARGV[0] eq "--squashfs" || $ARGV[0] eq "--erofs")) {
+	$format = substr(shift(@ARGV), 2);
+}
+
 if(@ARGV != 1) {
-	print STDERR "Usage: tarmods.pl <output directory>\n";
+	print STDERR "Usage: tarmods.pl [--squashfs|--erofs] <output directory>\n";
 	exit 1;
 }
 
@@ -134,9 +144,17 @@ foreach my $module(@modules) {
 foreach my $path(keys(%output_dirs)) {
 	$path =~ s/\/$//;
 	
-	system("tar -cf $path.tar -C $path ./") == 0 or die;
-	system("rm -r $path") == 0 or die;
-	
-	system("lzma -9c $path.tar > $path.tlz") == 0 or die;
-	system("rm $path.tar") == 0 or die;
+	if($format eq "squashfs") {
+		system("mksquashfs \"$path\" \"$path.squashfs\" -noappend -all-root -comp xz -quiet") == 0 or die;
+		system("rm -r \"$path\"") == 0 or die;
+	}elsif($format eq "erofs") {
+		system("mkfs.erofs -zlz4hc --all-root \"$path.erofs\" \"$path\"") == 0 or die;
+		system("rm -r \"$path\"") == 0 or die;
+	}else{
+		system("tar -cf $path.tar -C $path ./") == 0 or die;
+		system("rm -r $path") == 0 or die;
+		
+		system("lzma -9c $path.tar > $path.tlz") == 0 or die;
+		system("rm $path.tar") == 0 or die;
+	}
 }
@@ -0,0 +1,474 @@
+/* kexec-loader - Benchmarks
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Times the loader's hot paths on generated input. Each benchmark is run
+ * repeatedly for at least BENCH_NSEC and the mean time per run is reported.
+ *
+ * grub.c is included rather than linked so the device.map and menu.lst parsers
+ * can be called directly and the device map emptied between runs.
+ *
+ * Usage: tests/bench [name ...]
+*/
+
+#include "kltest.h"
+#include "../src/grub.c"
+
+#include <time.h>
+
+#define BENCH_NSEC	500000000ULL
+
+static char *bench_dir;
+
+/* Returns the monotonic time in nanoseconds */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Run func until BENCH_NSEC has passed, returns nanoseconds per run */
+static double bench_run(void (*func)(void)) {
+	uint64_t start = bench_now(), elapsed;
+	unsigned long runs = 0;
+	
+	do {
+		func();
+		runs++;
+	} while((elapsed = bench_now() - start) < BENCH_NSEC);
+	
+	return (double)(elapsed) / runs;
+}
+
+/* Forget the menu built by the last run */
+static void bench_reset_menu(void) {
+	targets = NULL;
+	kmods = NULL;
+	timeout = -1;
+	
+	strpool_free(&conf_pool);
+}
+
+/* kexec-loader.conf with 5000 targets, parsed by load_conf() */
+
+#define CONF_TARGETS 5000
+
+static char *conf_path;
+
+static void conf_setup(void) {
+	FILE *fh;
+	int i;
+	
+	conf_path = kl_sprintf("%s/kexec-loader.conf", bench_dir);
+	
+	if(!(fh = fopen(conf_path, "w"))) {
+		fprintf(stderr, "Error creating %s: %s\n", conf_path, strerror(errno));
+		exit(1);
+	}
+	
+	fprintf(fh, "# Generated by tests/bench\r\ntimeout 5\r\n\r\n");
+	
+	for(i = 0; i < CONF_TARGETS; i++) {
+		fprintf(fh, "title Linux %d.%d.0-generic\r\n", 6, i);
+		fprintf(fh, "\troot UUID=75ac0d6c-5dc0-402f-9f0f-9ab31381%04d\r\n", i);
+		fprintf(fh, "\tkernel /boot/vmlinuz-6.%d.0-generic\r\n", i);
+		fprintf(fh, "\tinitrd /boot/initrd.img-6.%d.0-generic\r\n", i);
+		fprintf(fh, "\tcmdline root=/dev/sda1 ro quiet splash\r\n");
+		fprintf(fh, "\tappend console=ttyS0,115200\r\n");
+		
+		if(i == 0) {
+			fprintf(fh, "\tdefault\r\n");
+			fprintf(fh, "\tkmod usb-storage delay_use=1\r\n");
+		}
+		
+		fprintf(fh, "\r\n");
+	}
+	
+	fclose(fh);
+}
+
+static void conf_bench(void) {
+	bench_reset_menu();
+	load_conf(conf_path, 0);
+}
+
+static int conf_check(void) {
+	kl_target *target;
+	int n = 0;
+	
+	for(target = targets; target; target = target->next) {
+		n++;
+	}
+	
+	return n == CONF_TARGETS && timeout == 5 && kmods;
+}
+
+/* grub.cfg as generated by update-grub on Debian with 1500 kernels installed,
+ * evaluated by load_grub2_cfg(). The newest kernel gets a top level entry and
+ * each kernel gets a normal and a recovery entry in the submenu.
+*/
+
+#define GRUB_KERNELS 1500
+#define GRUB_UUID "0a4e2f3c-6e1b-4a43-8d2a-6a1f0d3b9c77"
+
+static char *grub_cfg_path;
+
+static void grub_entry(FILE *fh, char const *indent, char const *title, int kver, char const *args) {
+	fprintf(fh, "%smenuentry '%s' --class debian --class gnu-linux --class gnu --class os $menuentry_id_option 'gnulinux-6.%d.0-amd64-%s' {\n", indent, title, kver, GRUB_UUID);
+	fprintf(fh, "%s\tload_video\n", indent);
+	fprintf(fh, "%s\tinsmod gzio\n", indent);
+	fprintf(fh, "%s\tif [ x$grub_platform = xxen ]; then insmod xzio; insmod lzopio; fi\n", indent);
+	fprintf(fh, "%s\tinsmod part_gpt\n", indent);
+	fprintf(fh, "%s\tinsmod ext2\n", indent);
+	fprintf(fh, "%s\tsearch --no-floppy --fs-uuid --set=root %s\n", indent, GRUB_UUID);
+	fprintf(fh, "%s\techo\t'Loading Linux 6.%d.0-amd64 ...'\n", indent, kver);
+	fprintf(fh, "%s\tlinux\t/boot/vmlinuz-6.%d.0-amd64 root=UUID=%s ro %s\n", indent, kver, GRUB_UUID, args);
+	fprintf(fh, "%s\techo\t'Loading initial ramdisk ...'\n", indent);
+	fprintf(fh, "%s\tinitrd\t/boot/initrd.img-6.%d.0-amd64\n", indent, kver);
+	fprintf(fh, "%s}\n", indent);
+}
+
+static void grub_setup(void) {
+	FILE *fh;
+	int i;
+	
+	grub_cfg_path = kl_sprintf("%s/grub.cfg", bench_dir);
+	
+	if(!(fh = fopen(grub_cfg_path, "w"))) {
+		fprintf(stderr, "Error creating %s: %s\n", grub_cfg_path, strerror(errno));
+		exit(1);
+	}
+	
+	fprintf(fh,
+		"### BEGIN /etc/grub.d/00_header ###\n"
+		"if [ -s $prefix/grubenv ]; then\n"
+		"  set have_grubenv=true\n"
+		"  load_env\n"
+		"fi\n"
+		"if [ \"${next_entry}\" ] ; then\n"
+		"   set default=\"${next_entry}\"\n"
+		"   set next_entry=\n"
+		"   save_env next_entry\n"
+		"   set boot_once=true\n"
+		"else\n"
+		"   set default=\"1>Debian GNU/Linux, with Linux 6.%d.0-amd64\"\n"
+		"fi\n"
+		"\n"
+		"if [ x\"${feature_menuentry_id}\" = xy ]; then\n"
+		"  menuentry_id_option=\"--id\"\n"
+		"else\n"
+		"  menuentry_id_option=\"\"\n"
+		"fi\n"
+		"\n"
+		"export menuentry_id_option\n"
+		"\n"
+		"function load_video {\n"
+		"  if [ x$feature_all_video_module = xy ]; then\n"
+		"    insmod all_video\n"
+		"  else\n"
+		"    insmod efi_gop\n"
+		"    insmod vbe\n"
+		"  fi\n"
+		"}\n"
+		"\n"
+		"if [ x$feature_timeout_style = xy ] ; then\n"
+		"  set timeout_style=menu\n"
+		"  set timeout=5\n"
+		"else\n"
+		"  set timeout=5\n"
+		"fi\n"
+		"### END /etc/grub.d/00_header ###\n"
+		"\n"
+		"### BEGIN /etc/grub.d/10_linux ###\n",
+		GRUB_KERNELS / 2);
+	
+	grub_entry(fh, "", "Debian GNU/Linux", GRUB_KERNELS - 1, "quiet");
+	
+	fprintf(fh, "submenu 'Advanced options for Debian GNU/Linux' $menuentry_id_option 'gnulinux-advanced-%s' {\n", GRUB_UUID);
+	
+	for(i = GRUB_KERNELS - 1; i >= 0; i--) {
+		char title[128];
+		
+		snprintf(title, sizeof(title), "Debian GNU/Linux, with Linux 6.%d.0-amd64", i);
+		grub_entry(fh, "\t", title, i, "quiet");
+		
+		snprintf(title, sizeof(title), "Debian GNU/Linux, with Linux 6.%d.0-amd64 (recovery mode)", i);
+		grub_entry(fh, "\t", title, i, "single");
+	}
+	
+	fprintf(fh, "}\n### END /etc/grub.d/10_linux ###\n");
+	
+	fclose(fh);
+}
+
+static void grub_bench(void) {
+	bench_reset_menu();
+	load_grub2_cfg(grub_cfg_path);
+}
+
+static int grub_check(void) {
+	kl_target *target, *def = NULL;
+	int n = 0;
+	
+	for(target = targets; target; target = target->next) {
+		if(target->flags & TARGET_DEFAULT) {
+			def = target;
+		}
+		
+		n++;
+	}
+	
+	return n == 1 + 2 * GRUB_KERNELS && timeout == 5 && def
+		&& kl_streq(def->kernel, "/boot/vmlinuz-6.750.0-amd64")
+		&& kl_streq(def->root, "UUID=" GRUB_UUID);
+}
+
+/* device.map with 2000 disks, each with a partition mapped on its own as for a
+ * RAID member, parsed by load_devmap().
+*/
+
+#define DEVMAP_DISKS 2000
+
+static char *devmap_path;
+
+static void devmap_setup(void) {
+	FILE *fh;
+	int i;
+	
+	devmap_path = kl_sprintf("%s/device.map", bench_dir);
+	
+	if(!(fh = fopen(devmap_path, "w"))) {
+		fprintf(stderr, "Error creating %s: %s\n", devmap_path, strerror(errno));
+		exit(1);
+	}
+	
+	fprintf(fh, "# Generated by tests/bench\n(fd0)\tfd0\n");
+	
+	for(i = 0; i < DEVMAP_DISKS; i++) {
+		fprintf(fh, "(hd%d)\tsd%c%c%c\n", i, 'a' + i / 676, 'a' + (i / 26) % 26, 'a' + i % 26);
+		fprintf(fh, "(hd%d,0)\tmd%d\n", i, i);
+	}
+	
+	fclose(fh);
+}
+
+/* Forget the device map built by the last run */
+static void devmap_reset(void) {
+	struct gdev_ent *ent, *next;
+	size_t i;
+	
+	for(i = 0; i < gdev_nbuckets; i++) {
+		for(ent = gdev_buckets[i]; ent; ent = next) {
+			next = ent->next;
+			
+			free(ent->key);
+			free(ent->device);
+			free(ent);
+		}
+	}
+	
+	free(gdev_buckets);
+	gdev_buckets = NULL;
+	gdev_nbuckets = 0;
+	gdev_count = 0;
+}
+
+static void devmap_bench(void) {
+	devmap_reset();
+	load_devmap(devmap_path);
+}
+
+static int devmap_check(void) {
+	char *md = lookup_gdev("(hd1999,0)"), *sd = lookup_gdev("(hd1999,1)");
+	int ok = md && kl_streq(md, "md1999") && sd && kl_streq(sd, "sdcyx2");
+	
+	free(md);
+	free(sd);
+	
+	/* A match and a whole disk key for each disk, and a match key for each partition */
+	return ok && gdev_count == 2 + 3 * DEVMAP_DISKS;
+}
+
+/* menu.lst with 2000 targets on the disks in the device map above, parsed by
+ * load_menu().
+*/
+
+#define MENU_TARGETS 2000
+
+static char *menu_path;
+
+static void menu_setup(void) {
+	FILE *fh;
+	int i;
+	
+	menu_path = kl_sprintf("%s/menu.lst", bench_dir);
+	
+	if(!(fh = fopen(menu_path, "w"))) {
+		fprintf(stderr, "Error creating %s: %s\n", menu_path, strerror(errno));
+		exit(1);
+	}
+	
+	fprintf(fh, "# Generated by tests/bench\ndefault %d\ntimeout 5\n\n", MENU_TARGETS / 2);
+	
+	for(i = 0; i < MENU_TARGETS; i++) {
+		fprintf(fh, "title Linux 6.%d.0-generic\n", i);
+		fprintf(fh, "\troot (hd%d,1)\n", i % DEVMAP_DISKS);
+		fprintf(fh, "\tkernel /boot/vmlinuz-6.%d.0-generic root=/dev/sda2 ro quiet splash\n", i);
+		fprintf(fh, "\tinitrd (hd%d,1)/boot/initrd.img-6.%d.0-generic\n", i % DEVMAP_DISKS, i);
+		fprintf(fh, "\n");
+	}
+	
+	fclose(fh);
+	
+	if(!devmap_path) {
+		devmap_setup();
+	}
+	
+	devmap_bench();
+}
+
+static void menu_bench(void) {
+	bench_reset_menu();
+	load_menu(menu_path);
+}
+
+static int menu_check(void) {
+	kl_target *target, *def = NULL;
+	int n = 0;
+	
+	for(target = targets; target; target = target->next) {
+		if(target->flags & TARGET_DEFAULT) {
+			def = target;
+		}
+		
+		n++;
+	}
+	
+	return n == MENU_TARGETS && timeout == 5 && def
+		&& kl_streq(def->kernel, "/boot/vmlinuz-6.1000.0-generic")
+		&& kl_streq(def->root, "sdbmm2")
+		&& def->initrds && kl_streq(def->initrds->path, "(sdbmm2)/boot/initrd.img-6.1000.0-generic");
+}
+
+/* debug() messages of a typical length, written to /dev/null as the debug tty
+ * and then to a pipe which is full, as a tty stalled by flow control would be.
+ * The stalled case must come after the others, as the debug tty isn't restored.
+*/
+
+#define LOG_MESSAGES 1000
+#define LOG_FORMAT "Mounting /dev/sd%c%d on /mnt/%d (ext4, options 'ro,noatime')"
+#define LOG_ARGS(i) 'a' + (i) % 26, (i) % 16, (i)
+
+static void log_bench(void) {
+	int i;
+	
+	for(i = 0; i < LOG_MESSAGES; i++) {
+		debug(LOG_FORMAT, LOG_ARGS(i));
+	}
+}
+
+static int log_check(void) {
+	char *buf = NULL;
+	size_t size = 0;
+	
+	FILE *fh = open_memstream(&buf, &size);
+	log_dump(fh);
+	fclose(fh);
+	
+	char *last = kl_sprintf(LOG_FORMAT "\n", LOG_ARGS(LOG_MESSAGES - 1));
+	int ok = size >= strlen(last) && kl_streq(buf + size - strlen(last), last);
+	
+	free(last);
+	free(buf);
+	
+	return ok;
+}
+
+static void log_setup(void) {
+	get_debug_fd();
+}
+
+static void logstall_setup(void) {
+	int fd = get_debug_fd(), pfd[2];
+	
+	if(fd == -1 || pipe2(pfd, O_NONBLOCK) == -1) {
+		fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+	
+	char buf[4096];
+	memset(buf, 'x', sizeof(buf));
+	
+	while(write(pfd[1], buf, sizeof(buf)) > 0) {}
+	
+	dup2(pfd[1], fd);
+	close(pfd[1]);
+}
+
+struct bench {
+	char const *name;
+	char const *desc;
+	
+	void (*setup)(void);
+	void (*func)(void);
+	int (*check)(void);	/* Checks the result of a run */
+};
+
+static const struct bench benches[] = {
+	{ "conf", "kexec-loader.conf, 5000 targets", &conf_setup, &conf_bench, &conf_check },
+	{ "grub", "grub.cfg, 3001 entries in a submenu", &grub_setup, &grub_bench, &grub_check },
+	{ "devmap", "device.map, 2000 disks", &devmap_setup, &devmap_bench, &devmap_check },
+	{ "menu", "menu.lst, 2000 targets", &menu_setup, &menu_bench, &menu_check },
+	{ "log", "1000 debug() messages", &log_setup, &log_bench, &log_check },
+	{ "logstall", "1000 debug() messages, debug tty stalled", &logstall_setup, &log_bench, &log_check },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+int main(int argc, char **argv) {
+	const struct bench *b;
+	int i;
+	
+	bench_dir = test_mkdtemp();
+	vfs_set_root("debug");
+	
+	for(b = benches; b->name; b++) {
+		for(i = 1; i < argc && !kl_streq(argv[i], b->name); i++) {}
+		
+		if(argc > 1 && i == argc) {
+			continue;
+		}
+		
+		b->setup();
+		
+		b->func();
+		
+		if(!b->check()) {
+			fprintf(stderr, "%s: Unexpected result\n", b->name);
+			
+			test_rmdir(bench_dir);
+			return 1;
+		}
+		
+		double ns = bench_run(b->func);
+		printf("%-8s %-40s %12.1f us\n", b->name, b->desc, ns / 1000);
+	}
+	
+	test_rmdir(bench_dir);
+	
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* kexec-loader - md and LVM test driver
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Runs the loader's md assembly or LVM activation on the block devices named on
+ * the command line (relative to /dev), for tests/md.sh and tests/lvm.sh which
+ * build the volumes with mdadm and lvm2 on loop devices and check the result.
+ *
+ * md.c and lvm.c are included rather than linked so the test can see which
+ * arrays were started and can hand loop devices to lvm_add_device(), which
+ * lvm_scan() skips. Set KL_DEBUG_TTY=/dev/stderr to see the loader's messages.
+ *
+ * Usage: tests/blockdev md [--degraded] <device> ...
+ *        tests/blockdev lvm <vg>/<lv> <device> ...
+*/
+
+#include "kltest.h"
+#include "../src/md.c"
+#include "../src/lvm.c"
+
+#include <sys/sysmacros.h>
+
+/* Get the device number of /dev/<name> */
+static dev_t dev_number(char const *name) {
+	char path[256];
+	struct stat st;
+	
+	snprintf(path, sizeof(path), "/dev/%s", name);
+	
+	if(stat(path, &st) == -1 || !S_ISBLK(st.st_mode)) {
+		fprintf(stderr, "%s is not a block device\n", path);
+		exit(1);
+	}
+	
+	return st.st_rdev;
+}
+
+/* Hand the devices to md_add_device() as disk.c does, assemble and print the
+ * name of each array which was started.
+*/
+static int md_main(int argc, char **argv) {
+	int degraded = 0, i = 0;
+	md_array *array;
+	
+	if(argc && kl_streq(argv[0], "--degraded")) {
+		degraded = 1;
+		i++;
+	}
+	
+	for(; i < argc; i++) {
+		dev_t dev = dev_number(argv[i]);
+		
+		if(md_add_device(argv[i], major(dev), minor(dev)) != MD_NATIVE) {
+			fprintf(stderr, "%s is not a member of a RAID1 array\n", argv[i]);
+		}
+	}
+	
+	md_assemble(degraded);
+	
+	for(array = arrays; array; array = array->next) {
+		if(array->running) {
+			printf("started %s\n", array->set_name);
+		}
+	}
+	
+	return 0;
+}
+
+/* Add the devices as physical volume candidates and activate a logical volume,
+ * printing the name of its block device.
+*/
+static int lvm_main(int argc, char **argv) {
+	int i;
+	
+	for(i = 1; i < argc; i++) {
+		dev_t dev = dev_number(argv[i]);
+		lvm_add_device(argv[i], major(dev), minor(dev));
+	}
+	
+	char const *devname = lvm_activate(argv[0]);
+	if(!devname) {
+		fprintf(stderr, "Error activating %s\n", argv[0]);
+		return 1;
+	}
+	
+	printf("%s\n", devname);
+	
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if(argc >= 2 && kl_streq(argv[1], "md")) {
+		return md_main(argc - 2, argv + 2);
+	}
+	
+	if(argc >= 3 && kl_streq(argv[1], "lvm")) {
+		return lvm_main(argc - 2, argv + 2);
+	}
+	
+	fprintf(stderr, "Usage: %s md [--degraded] <device> ...\n", argv[0]);
+	fprintf(stderr, "       %s lvm <vg>/<lv> <device> ...\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,131 @@
+/* kexec-loader - Kernel command line parser tests
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* cmdline_load() reads a command line written to a temporary file in place of
+ * /proc/cmdline, the options are then looked up with get_cmdline(). Calls from
+ * this file reach the real get_cmdline(), as misc.c is part of it.
+*/
+
+#include "kltest.h"
+
+static char *root;
+
+/* Load a command line as cmdline_load() would read it from /proc/cmdline */
+static void load(char const *cmdline) {
+	char *path = kl_sprintf("%s/cmdline", root);
+	
+	test_printf_file(path, "%s\n", cmdline);
+	
+	TEST_CHECK(cmdline_load(path));
+	cmdline_loaded = 1;
+	
+	free(path);
+}
+
+/* Copy of an option's value for TEST_STREQ, NULL if it isn't set */
+static char *opt(char const *name) {
+	char const *value = get_cmdline(name);
+	return value ? kl_strdup(value) : NULL;
+}
+
+/* Split one option with cmdline_next(), checking what follows it */
+static void check_next(char const *cmdline, char const *name, char const *value, char const *rest) {
+	char *buf = kl_strdup(cmdline), *n, *v;
+	char *next = cmdline_next(buf, &n, &v);
+	
+	TEST_STREQ(kl_strdup(n), name);
+	TEST_STREQ(v ? kl_strdup(v) : NULL, value);
+	TEST_STREQ(kl_strdup(next), rest);
+	
+	free(buf);
+}
+
+static void test_next(void) {
+	check_next("ro quiet", "ro", NULL, "quiet");
+	check_next("root=/dev/sda1  \tro", "root", "/dev/sda1", "ro");
+	check_next("a=b=c", "a", "b=c", "");
+	check_next("a=", "a", "", "");
+}
+
+/* Quotes around the whole option include spaces in its value */
+static void test_quoted_option(void) {
+	check_next("\"a=b c\" d", "a", "b c", "d");
+	
+	load("\"a=b c\" d");
+	
+	TEST_STREQ(opt("a"), "b c");
+	TEST_STREQ(opt("d"), "");
+	TEST_STREQ(opt("b"), NULL);
+	TEST_STREQ(opt("c"), NULL);
+}
+
+/* Quotes around the value only */
+static void test_quoted_value(void) {
+	check_next("a=\"b c\" d", "a", "b c", "d");
+	
+	load("x a=\"b c\" d=\"\"");
+	
+	TEST_STREQ(opt("a"), "b c");
+	TEST_STREQ(opt("d"), "");
+	TEST_STREQ(opt("x"), "");
+}
+
+/* The first occurrence of an option is used, as the kernel does */
+static void test_repeated(void) {
+	load("debug_tty=/dev/ttyS0 boot_index=1 debug_tty=/dev/tty3 boot_index boot_index=2");
+	
+	TEST_STREQ(opt("debug_tty"), "/dev/ttyS0");
+	TEST_STREQ(opt("boot_index"), "1");
+}
+
+/* An option longer than the initial read buffer, between two short ones */
+static void test_long(void) {
+	char value[4096], *cmdline;
+	
+	memset(value, 'x', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+	
+	cmdline = kl_sprintf("a=1 long=\"%s\" b=2", value);
+	load(cmdline);
+	
+	TEST_STREQ(opt("a"), "1");
+	TEST_STREQ(opt("long"), value);
+	TEST_STREQ(opt("b"), "2");
+	
+	free(cmdline);
+}
+
+/* Each case gets its own directory */
+static void run(char const *name, void (*func)(void)) {
+	root = test_mkdtemp();
+	
+	test_run(name, func);
+	
+	test_rmdir(root);
+	free(root);
+}
+
+int main(int argc, char **argv) {
+	run("Splitting options", &test_next);
+	run("Quoted option", &test_quoted_option);
+	run("Quoted value", &test_quoted_value);
+	run("Repeated option", &test_repeated);
+	run("Option longer than 1KiB", &test_long);
+	
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,206 @@
+/* kexec-loader - GRUB device map synthesis tests
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* synth_devmap() is pointed at a fake sysfs tree and a directory of disk
+ * images standing in for /dev, each image holding just an MBR signature.
+*/
+
+#include "kltest.h"
+#include "../src/grub.h"
+
+static char *root, *sysfs, *devdir;
+
+/* Add a block device to sysfs/block with an image in devdir, scsi_type is the
+ * SCSI peripheral type of the device behind it or -1 for a virtual device.
+*/
+static void add_blockdev(char const *name, uint32_t signature, unsigned long long sectors, int removable, int scsi_type) {
+	unsigned char mbr[512];
+	char path[512];
+	
+	memset(mbr, 0, sizeof(mbr));
+	
+	mbr[440] = signature & 0xFF;
+	mbr[441] = (signature >> 8) & 0xFF;
+	mbr[442] = (signature >> 16) & 0xFF;
+	mbr[443] = (signature >> 24) & 0xFF;
+	mbr[510] = 0x55;
+	mbr[511] = 0xAA;
+	
+	snprintf(path, sizeof(path), "%s/%s", devdir, name);
+	test_write_file(path, mbr, sizeof(mbr));
+	
+	snprintf(path, sizeof(path), "%s/block/%s/size", sysfs, name);
+	test_printf_file(path, "%llu\n", sectors);
+	
+	snprintf(path, sizeof(path), "%s/block/%s/removable", sysfs, name);
+	test_printf_file(path, "%d\n", removable);
+	
+	if(scsi_type >= 0) {
+		snprintf(path, sizeof(path), "%s/block/%s/device/type", sysfs, name);
+		test_printf_file(path, "%d\n", scsi_type);
+	}
+}
+
+/* Add a whole disk */
+static void add_disk(char const *name, uint32_t signature, unsigned long long sectors, int removable) {
+	add_blockdev(name, signature, sectors, removable, 0);
+}
+
+/* Add a device with no device link (md, dm, loop, ram) */
+static void add_virtual(char const *name, uint32_t signature, unsigned long long sectors) {
+	add_blockdev(name, signature, sectors, 0, -1);
+}
+
+/* Add a BIOS disk to sysfs/firmware/edd, formatted as the kernel does */
+static void add_edd(int bios, uint32_t signature, unsigned long long sectors) {
+	char path[512];
+	
+	snprintf(path, sizeof(path), "%s/firmware/edd/int13_dev%02x/mbr_signature", sysfs, bios);
+	test_printf_file(path, "0x%08x\n", signature);
+	
+	if(sectors) {
+		snprintf(path, sizeof(path), "%s/firmware/edd/int13_dev%02x/sectors", sysfs, bios);
+		test_printf_file(path, "%llu\n", sectors);
+	}
+}
+
+/* BIOS order differs from name order, signatures decide */
+static void test_edd_signature(void) {
+	add_disk("sda", 0x11111111, 2048, 0);
+	add_disk("sdb", 0x22222222, 4096, 0);
+	
+	/* An md array and dm device on top of the disks, with the same
+	 * signatures and sizes.
+	*/
+	add_virtual("md0", 0x11111111, 2048);
+	add_virtual("dm-0", 0x22222222, 4096);
+	
+	add_edd(0x80, 0x22222222, 4096);
+	add_edd(0x81, 0x11111111, 2048);
+	
+	synth_devmap(sysfs, devdir);
+	
+	TEST_STREQ(lookup_gdev("(hd0)"), "sdb");
+	TEST_STREQ(lookup_gdev("(hd0,0)"), "sdb1");
+	TEST_STREQ(lookup_gdev("(hd1,4)"), "sda5");
+	TEST_STREQ(lookup_gdev("(hd2)"), NULL);
+}
+
+/* Disks sharing a signature (cloned disks) are told apart by size */
+static void test_edd_size(void) {
+	add_disk("sda", 0x33333333, 2048, 0);
+	add_disk("sdb", 0x33333333, 8192, 0);
+	
+	add_edd(0x80, 0x33333333, 8192);
+	
+	synth_devmap(sysfs, devdir);
+	
+	TEST_STREQ(lookup_gdev("(hd0)"), "sdb");
+}
+
+/* A BIOS disk which could be more than one disk, or none, is left unmapped
+ * rather than guessed.
+*/
+static void test_edd_ambiguous(void) {
+	add_disk("sda", 0x44444444, 2048, 0);
+	add_disk("sdb", 0x44444444, 2048, 0);
+	add_disk("sdc", 0x00000000, 2048, 0);
+	
+	add_edd(0x80, 0x44444444, 2048);
+	add_edd(0x81, 0x00000000, 2048);
+	add_edd(0x82, 0x55555555, 2048);
+	
+	synth_devmap(sysfs, devdir);
+	
+	TEST_STREQ(lookup_gdev("(hd0)"), NULL);
+	TEST_STREQ(lookup_gdev("(hd1)"), NULL);
+	TEST_STREQ(lookup_gdev("(hd2)"), NULL);
+}
+
+/* Without EDD the fixed disks are numbered in kernel name order, skipping
+ * removable disks, optical drives and virtual devices.
+*/
+static void test_name_order(void) {
+	add_disk("sda", 0x66666666, 2048, 1);
+	add_disk("sdaa", 0x66666667, 2048, 0);
+	add_disk("sdz", 0x66666668, 2048, 0);
+	add_disk("sdb", 0x66666669, 2048, 0);
+	add_disk("nvme0n1", 0x6666666A, 2048, 0);
+	add_virtual("loop0", 0, 2048);
+	add_virtual("ram0", 0, 2048);
+	add_virtual("md0", 0x6666666B, 2048);
+	add_virtual("dm-0", 0x66666669, 2048);
+	add_blockdev("sr0", 0, 2048, 0, 5);
+	
+	synth_devmap(sysfs, devdir);
+	
+	TEST_STREQ(lookup_gdev("(hd0)"), "sdb");
+	TEST_STREQ(lookup_gdev("(hd1)"), "sdz");
+	TEST_STREQ(lookup_gdev("(hd2)"), "sdaa");
+	TEST_STREQ(lookup_gdev("(hd3)"), "nvme0n1");
+	TEST_STREQ(lookup_gdev("(hd3,1)"), "nvme0n1p2");
+	TEST_STREQ(lookup_gdev("(hd4)"), NULL);
+}
+
+/* Mappings from grub-map are kept */
+static void test_grub_map(void) {
+	kl_gdev gdev;
+	
+	add_disk("sda", 0x77777777, 2048, 0);
+	add_disk("sdb", 0x88888888, 2048, 0);
+	
+	add_edd(0x80, 0x77777777, 2048);
+	add_edd(0x81, 0x88888888, 2048);
+	
+	TEST_CHECK(parse_gdev(&gdev, "(hd0)"));
+	strlcpy(gdev.device, "sdx", sizeof(gdev.device));
+	add_gdev(&gdev);
+	
+	synth_devmap(sysfs, devdir);
+	
+	TEST_STREQ(lookup_gdev("(hd0,0)"), "sdx1");
+	TEST_STREQ(lookup_gdev("(hd1,0)"), "sdb1");
+}
+
+/* Each case gets a fresh fixture */
+static void run(char const *name, void (*func)(void)) {
+	root = test_mkdtemp();
+	sysfs = kl_sprintf("%s/sys", root);
+	devdir = kl_sprintf("%s/dev", root);
+	
+	mkdir(sysfs, 0755);
+	mkdir(devdir, 0755);
+	
+	test_run(name, func);
+	
+	test_rmdir(root);
+	
+	free(devdir);
+	free(sysfs);
+	free(root);
+}
+
+int main(int argc, char **argv) {
+	run("EDD signature match", &test_edd_signature);
+	run("EDD size match", &test_edd_size);
+	run("EDD ambiguous disks", &test_edd_ambiguous);
+	run("Name order without EDD", &test_name_order);
+	run("grub-map takes priority", &test_grub_map);
+	
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,246 @@
+/* kexec-loader - Combined initrd tests
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* build_initrd() is given a list of initrd images and files to add, created in
+ * a temporary directory, and the initrd it builds is walked the way the kernel
+ * unpacks it: images are copied as they are, each cpio archive must start on a
+ * 4 byte boundary and every newc header, name and file must be padded to one.
+ *
+ * kexec.c is included rather than linked to reach build_initrd().
+*/
+
+#include "kltest.h"
+#include "../src/kexec.c"
+
+static char *root;
+
+/* Create a file of size bytes in the test directory, returns its path */
+static char const *make_file(char const *name, size_t size) {
+	char *path = kl_sprintf("%s/%s", root, name), *data = kl_malloc(size + 1);
+	size_t i;
+	
+	for(i = 0; i < size; i++) {
+		data[i] = name[i % strlen(name)];
+	}
+	
+	test_write_file(path, data, size);
+	
+	char const *ret = strpool_intern(&conf_pool, path);
+	
+	free(data);
+	free(path);
+	
+	return ret;
+}
+
+/* Build the initrd of a target, returns its contents */
+static char *build(kl_target *target, size_t *size) {
+	kl_kexec_result res;
+	char *path, *buf = NULL;
+	int fd;
+	
+	memset(&res, 0, sizeof(res));
+	
+	TEST_CHECK(build_initrd(target, &path, &fd, &res));
+	TEST_CHECK(fd != -1 && path);
+	
+	if(fd != -1) {
+		*size = lseek(fd, 0, SEEK_END);
+		buf = kl_malloc(*size + 1);
+		
+		TEST_CHECK(pread(fd, buf, *size, 0) == (ssize_t)(*size));
+		
+		close(fd);
+	}
+	
+	free(path);
+	
+	return buf;
+}
+
+/* Check an image was copied to the initrd at off, returns the offset after it */
+static size_t check_image(char const *buf, size_t size, size_t off, char const *name, size_t len) {
+	char *path = kl_sprintf("%s/%s", root, name), *data = kl_malloc(len + 1);
+	FILE *fh = fopen(path, "r");
+	
+	TEST_CHECK(fh && fread(data, 1, len, fh) == len);
+	TEST_CHECK(off + len <= size && memcmp(buf + off, data, len) == 0);
+	
+	if(fh) {
+		fclose(fh);
+	}
+	
+	free(data);
+	free(path);
+	
+	return off + len;
+}
+
+/* Read an 8 digit hex field of a newc header */
+static unsigned int newc_field(char const *hdr, int field) {
+	char hex[9];
+	
+	memcpy(hex, hdr + 6 + field * 8, 8);
+	hex[8] = '\0';
+	
+	return strtoul(hex, NULL, 16);
+}
+
+/* Walk a cpio archive starting at off, up to and including its trailer.
+ * Each member is listed in entries as "name:mode:size", space seperated.
+ * Returns the offset after the trailer.
+*/
+static size_t check_archive(char const *buf, size_t size, size_t off, char **entries) {
+	char *list = kl_strdup(""), *s;
+	
+	for(;;) {
+		TEST_CHECK(off % 4 == 0);
+		
+		if(off + 110 > size || memcmp(buf + off, "070701", 6) != 0) {
+			fprintf(stderr, "No newc header at offset %zu\n", off);
+			test_failures++;
+			
+			break;
+		}
+		
+		unsigned int mode = newc_field(buf + off, 1);
+		unsigned int filesize = newc_field(buf + off, 6);
+		unsigned int namesize = newc_field(buf + off, 11);
+		
+		char const *name = buf + off + 110;
+		
+		TEST_CHECK(namesize > 0 && off + 110 + namesize <= size && name[namesize - 1] == '\0');
+		
+		/* Header and name, then the file data, each padded */
+		
+		off += (110 + namesize + 3) & ~3;
+		off += (filesize + 3) & ~3;
+		
+		TEST_CHECK(off <= size);
+		
+		if(kl_streq(name, "TRAILER!!!")) {
+			break;
+		}
+		
+		s = kl_sprintf("%s%s%s:%o:%u", list, (list[0] ? " " : ""), name, mode, filesize);
+		free(list);
+		list = s;
+	}
+	
+	*entries = list;
+	
+	return off;
+}
+
+/* A lone initrd is passed to the kernel as it is */
+static void test_single(void) {
+	kl_target target;
+	kl_kexec_result res;
+	char *path;
+	int fd;
+	
+	INIT_TARGET(&target);
+	add_initrd(&target, &conf_pool, make_file("initrd.img", 1001), "");
+	
+	TEST_CHECK(build_initrd(&target, &path, &fd, &res));
+	TEST_CHECK(fd == -1);
+	TEST_STREQ(path, target.initrds->path);
+}
+
+/* Images and files to add, mixed. Consecutive files share an archive. */
+static void test_mixed(void) {
+	kl_target target;
+	char *buf, *entries;
+	size_t size = 0, off;
+	
+	INIT_TARGET(&target);
+	add_initrd(&target, &conf_pool, make_file("early.img", 1001), "");
+	add_initrd(&target, &conf_pool, make_file("a.conf", 5), "/etc/a.conf");
+	add_initrd(&target, &conf_pool, make_file("b.bin", 3), "/lib/firmware/b.bin");
+	add_initrd(&target, &conf_pool, make_file("main.img", 10), "");
+	add_initrd(&target, &conf_pool, make_file("c", 0), "c");
+	
+	if(!(buf = build(&target, &size))) {
+		return;
+	}
+	
+	off = check_image(buf, size, 0, "early.img", 1001);
+	
+	off = check_archive(buf, size, (off + 3) & ~3, &entries);
+	TEST_STREQ(entries, "etc:40755:0 etc/a.conf:100644:5 lib:40755:0 lib/firmware:40755:0 lib/firmware/b.bin:100644:3");
+	
+	off = check_image(buf, size, off, "main.img", 10);
+	
+	off = check_archive(buf, size, (off + 3) & ~3, &entries);
+	TEST_STREQ(entries, "c:100644:0");
+	
+	TEST_CHECK(off == size);
+	
+	/* The file data follows its header */
+	
+	TEST_CHECK(memmem(buf, size, "etc/a.conf\0\0\0\0a.con", 19) != NULL);
+	
+	free(buf);
+}
+
+/* The debug log is appended as an archive of its own */
+static void test_log_handoff(void) {
+	kl_target target;
+	char *buf, *entries;
+	size_t size = 0, off;
+	
+	debug("Test message");
+	log_handoff = 1;
+	
+	INIT_TARGET(&target);
+	add_initrd(&target, &conf_pool, make_file("initrd.img", 1001), "");
+	
+	if(!(buf = build(&target, &size))) {
+		return;
+	}
+	
+	off = check_image(buf, size, 0, "initrd.img", 1001);
+	off = check_archive(buf, size, (off + 3) & ~3, &entries);
+	
+	TEST_CHECK(kl_strneq(entries, LOG_HANDOFF_NAME ":100644:", strlen(LOG_HANDOFF_NAME) + 8));
+	TEST_CHECK(off == size);
+	TEST_CHECK(memmem(buf, size, "Test message\n", 13) != NULL);
+	
+	free(entries);
+	free(buf);
+}
+
+/* Each case gets its own directory */
+static void run(char const *name, void (*func)(void)) {
+	root = test_mkdtemp();
+	
+	test_run(name, func);
+	
+	test_rmdir(root);
+	free(root);
+}
+
+int main(int argc, char **argv) {
+	vfs_set_root("debug");
+	
+	run("Single initrd", &test_single);
+	run("Images and files mixed", &test_mixed);
+	run("Debug log handoff", &test_log_handoff);
+	
+	return test_failures ? 1 : 0;
+}
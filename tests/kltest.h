@@ -0,0 +1,165 @@
+/* kexec-loader - Test program helpers
+ * Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Each test program is a single source file which includes this header and is
+ * linked with every object except misc.o. misc.c holds main() as well as the
+ * helpers everything else uses, so it is built into the test here with its
+ * main() renamed, which also lets tests call its static functions.
+ *
+ * get_cmdline() is wrapped (-Wl,--wrap=get_cmdline) so the host's kernel
+ * command line doesn't leak into the tests. Debug messages go to the file
+ * named by $KL_DEBUG_TTY, or nowhere.
+ *
+ * The helpers below aren't static as a test program is a single file and may
+ * not use all of them.
+*/
+
+#ifndef KL_TEST_H
+#define KL_TEST_H
+
+#define main kexec_loader_main
+#include "../src/misc.c"
+#undef main
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+int test_failures = 0;
+
+#define TEST_CHECK(cond) \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	}
+
+#define TEST_STREQ(got, want) \
+	test_streq(__FILE__, __LINE__, #got, got, want)
+
+char const *__wrap_get_cmdline(char const *name) {
+	if(kl_streq(name, "debug_tty")) {
+		char const *tty = getenv("KL_DEBUG_TTY");
+		return tty ? tty : "/dev/null";
+	}
+	
+	return NULL;
+}
+
+/* Compare a string returned by the code under test, NULL matches NULL
+ * got is freed.
+*/
+void test_streq(char const *file, int line, char const *expr, char *got, char const *want) {
+	if(got && want ? !kl_streq(got, want) : got != want) {
+		fprintf(stderr, "%s:%d: %s is \"%s\", expected \"%s\"\n", file, line, expr,
+			(got ? got : "(null)"), (want ? want : "(null)"));
+		test_failures++;
+	}
+	
+	free(got);
+}
+
+/* Write a file, creating any missing directories in its path */
+void test_write_file(char const *path, void const *data, size_t size) {
+	char *dir = kl_strdup(path), *p;
+	
+	for(p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+	
+	free(dir);
+	
+	FILE *fh = fopen(path, "w");
+	if(!fh || fwrite(data, 1, size, fh) != size || fclose(fh)) {
+		fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+}
+
+/* Write a formatted string to a file */
+void test_printf_file(char const *path, char const *fmt, ...) {
+	va_list argv;
+	
+	va_start(argv, fmt);
+	int len = vsnprintf(NULL, 0, fmt, argv);
+	va_end(argv);
+	
+	char *buf = kl_malloc(len + 1);
+	
+	va_start(argv, fmt);
+	vsnprintf(buf, len + 1, fmt, argv);
+	va_end(argv);
+	
+	test_write_file(path, buf, len);
+	free(buf);
+}
+
+/* Create a temporary directory, removed by test_rmdir() */
+char *test_mkdtemp(void) {
+	char *dir = kl_strdup("/tmp/kl-test.XXXXXX");
+	
+	if(!mkdtemp(dir)) {
+		fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+		exit(1);
+	}
+	
+	return dir;
+}
+
+void test_rmdir(char const *dir) {
+	char *cmd = kl_sprintf("rm -rf '%s'", dir);
+	
+	if(system(cmd) != 0) {
+		fprintf(stderr, "Error removing %s\n", dir);
+	}
+	
+	free(cmd);
+}
+
+/* Run a test case in a child process, so each one starts with the loader's
+ * global state (device map, targets, disks) empty.
+*/
+void test_run(char const *name, void (*func)(void)) {
+	fflush(stdout);
+	fflush(stderr);
+	
+	pid_t pid = fork();
+	if(pid == -1) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		exit(1);
+	}else if(pid == 0) {
+		/* Only count this case's failures */
+		test_failures = 0;
+		
+		func();
+		exit(test_failures ? 1 : 0);
+	}
+	
+	int status;
+	waitpid(pid, &status, 0);
+	
+	if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		printf("PASS: %s\n", name);
+	}else{
+		printf("FAIL: %s\n", name);
+		test_failures++;
+	}
+}
+
+#endif /* !KL_TEST_H */
@@ -0,0 +1,142 @@
+# Helpers for the scripts testing the loader against volumes built on loop devices
+# Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Sourced by a script after it defines teardown(), which must take down
+# anything built on the loop devices in $loops so they can be detached.
+
+tmp=""
+loops=""
+failures=0
+
+# Tear down the current case and detach its loop devices
+detach() {
+	teardown
+	
+	for loop in $loops
+	do
+		losetup -d "/dev/$loop"
+	done
+	
+	loops=""
+}
+
+cleanup() {
+	detach
+	
+	if [ -n "$tmp" ]
+	then
+		rm -rf "$tmp"
+	fi
+}
+
+fail() {
+	if [ $# -gt 0 ]
+	then
+		echo "$*" 1>&2
+	fi
+	
+	cleanup
+	exit 1
+}
+
+trap 'fail Interrupted' INT TERM
+
+# Check we can run, the programs given are needed as well as losetup
+require() {
+	if [ "`id -u`" -ne 0 ]
+	then
+		fail "$0 must be run as root"
+	fi
+	
+	for prog in losetup "$@"
+	do
+		if ! which $prog > /dev/null
+		then
+			fail "No $prog program found in \$PATH"
+		fi
+	done
+	
+	if [ ! -x tests/blockdev ]
+	then
+		fail "Run 'make tests/blockdev' first"
+	fi
+	
+	tmp=`mktemp -d /tmp/kl-test.XXXXXX` || fail
+}
+
+# Create a 64MiB image attached to a loop device, sets loop to the device name
+new_loop() {
+	truncate -s 64M "$tmp/$1.img" || return 1
+	
+	loop=`losetup --find --show "$tmp/$1.img"` || return 1
+	loop=`basename "$loop"`
+	
+	loops="$loops $loop"
+}
+
+# Set a and b to two new loop devices
+new_loops() {
+	new_loop a && a=$loop && new_loop b && b=$loop || fail "Error creating loop devices"
+}
+
+# Fill $tmp/data with 8MiB of random data and write it to a device
+write_data() {
+	dd if=/dev/urandom of="$tmp/data" bs=1M count=8 2> /dev/null \
+		&& dd if="$tmp/data" of="$1" bs=1M oflag=direct conv=fsync 2> /dev/null
+}
+
+# Check a device starts with the contents of $tmp/data
+check_data() {
+	if ! cmp -s -n `stat -c %s "$tmp/data"` "$tmp/data" "$1"
+	then
+		echo "    Data read from $1 differs from what was written" 1>&2
+		return 1
+	fi
+}
+
+check() {
+	if [ "$2" = "$3" ]
+	then
+		return 0
+	fi
+	
+	echo "    $1 is '$2', expected '$3'" 1>&2
+	return 1
+}
+
+# Report a case as passed if the first argument is zero
+result() {
+	if [ $1 -eq 0 ]
+	then
+		echo "PASS: $2"
+	else
+		echo "FAIL: $2"
+		failures=$((failures + 1))
+	fi
+}
+
+# Clean up and exit with the status of the tests
+finish() {
+	cleanup
+	
+	if [ $failures -ne 0 ]
+	then
+		exit 1
+	fi
+	
+	exit 0
+}
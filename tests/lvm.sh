@@ -0,0 +1,182 @@
+#!/bin/bash
+# Check the loader activates LVM logical volumes built by lvm2
+# Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# A volume group is created on two loop devices with lvm2, each logical volume
+# has some data written to it and its device-mapper table recorded before the
+# group is deactivated. tests/blockdev then activates each volume with the
+# loader's code and the table, UUID and data are compared.
+#
+# Must be run as root from the top of the source tree after building
+# tests/blockdev, needs lvm2, dmsetup, losetup and device-mapper.
+
+VG="kltest"
+
+# lvm2 options: ignore the devices file, which won't list the loop devices, and
+# don't wait for udev, which may not be running.
+LVM_CONFIG="devices { use_devicesfile=0 } activation { udev_sync=0 udev_rules=0 }"
+
+lvm_run() {
+	local cmd=$1
+	shift
+	
+	lvm $cmd --config "$LVM_CONFIG" "$@" > /dev/null 2>&1
+}
+
+# Remove the volume group and any devices activated from it
+teardown() {
+	for name in `dmsetup ls 2> /dev/null | awk '{ print $1 }' | grep "^$VG-"`
+	do
+		dmsetup remove "$name" > /dev/null 2>&1
+	done
+	
+	if [ -n "$loops" ]
+	then
+		lvm_run vgremove -f "$VG"
+		
+		for loop in $loops
+		do
+			lvm_run pvremove -ff -y "/dev/$loop"
+		done
+	fi
+}
+
+. tests/loop.sh
+
+require lvm dmsetup
+
+modprobe dm-mod > /dev/null 2>&1
+
+if lvm_run vgs "$VG"
+then
+	fail "A volume group named $VG already exists"
+fi
+
+# device-mapper name of a logical volume, with dashes doubled like lvm2
+dm_name() {
+	echo "$VG-`echo "$1" | sed -e 's/-/--/g'`"
+}
+
+# Save the table and UUID of a logical volume in $tmp
+save_table() {
+	local name=`dm_name $1`
+	
+	dmsetup table "$name" > "$tmp/$1.table" \
+		&& dmsetup info -c --noheadings -o uuid "$name" > "$tmp/$1.uuid"
+}
+
+# Write data to a logical volume and save its table, UUID and data in $tmp
+save_lv() {
+	save_table "$1" || return 1
+	
+	write_data "/dev/mapper/`dm_name $1`" || return 1
+	cp "$tmp/data" "$tmp/$1.data"
+}
+
+# Create a logical volume with the given lvcreate options and save it
+create_lv() {
+	local lv=$1
+	shift
+	
+	lvm_run lvcreate -y -n "$lv" "$@" "$VG" && save_lv "$lv"
+}
+
+# Activate a logical volume with tests/blockdev, compare it with what lvm2
+# created and remove it. The data is only compared if save_lv() wrote some.
+# The remaining arguments are the devices to give the loader.
+check_lv() {
+	local lv=$1 name=`dm_name $1` dev
+	shift
+	
+	dev=`./tests/blockdev lvm "$VG/$lv" "$@"`
+	if [ -z "$dev" ]
+	then
+		echo "    tests/blockdev didn't activate $VG/$lv" 1>&2
+		return 1
+	fi
+	
+	local ok=0
+	
+	check "name of $dev" "`cat /sys/block/$dev/dm/name`" "$name" || ok=1
+	check "table of $name" "`dmsetup table "$name"`" "`cat "$tmp/$lv.table"`" || ok=1
+	check "UUID of $name" "`dmsetup info -c --noheadings -o uuid "$name"`" "`cat "$tmp/$lv.uuid"`" || ok=1
+	
+	if [ -e "$tmp/$lv.data" ]
+	then
+		cp "$tmp/$lv.data" "$tmp/data"
+		check_data "/dev/$dev" || ok=1
+	fi
+	
+	dmsetup remove "$name" > /dev/null 2>&1
+	
+	return $ok
+}
+
+new_loops
+
+lvm_run pvcreate -y "/dev/$a" "/dev/$b" \
+	&& lvm_run vgcreate -s 512k "$VG" "/dev/$a" "/dev/$b" \
+	|| fail "Error creating volume group"
+
+# two-segments is extended after spacer has taken the extents following it, so
+# it has two segments and the data written to it crosses the boundary.
+
+create_lv linear -L 12M "/dev/$a" \
+	&& create_lv striped -L 16M -i 2 -I 64k \
+	&& lvm_run lvcreate -y -n two-segments -L 4M "$VG" "/dev/$b" \
+	&& lvm_run lvcreate -y -n spacer -L 4M "$VG" "/dev/$b" \
+	&& lvm_run lvextend -L +8M "$VG/two-segments" "/dev/$b" \
+	&& save_lv two-segments \
+	|| fail "Error creating logical volumes"
+
+# Enough volumes that the metadata is several times the size of an arena block
+
+MANY_LVS=100
+
+for i in `seq 1 $MANY_LVS`
+do
+	lvm_run lvcreate -y -n "many-$i" -l 1 "$VG" || fail "Error creating many-$i"
+done
+
+save_table "many-$MANY_LVS" \
+	&& lvm_run vgchange -a n "$VG" \
+	|| fail "Error deactivating $VG"
+
+if [ `wc -l < "$tmp/two-segments.table"` -ne 2 ]
+then
+	fail "two-segments doesn't have two segments"
+fi
+
+check_lv linear $a $b
+result $? "Linear volume"
+
+check_lv striped $a $b
+result $? "Striped volume"
+
+check_lv two-segments $a $b
+result $? "Volume with two segments, dash in the name"
+
+check_lv "many-$MANY_LVS" $a $b
+result $? "Last of $MANY_LVS volumes"
+
+# A volume with one of its physical volumes missing isn't activated
+
+check "tests/blockdev output with $b missing" "`./tests/blockdev lvm "$VG/striped" $a 2> /dev/null`" "" \
+	&& ! dmsetup info "`dm_name striped`" > /dev/null 2>&1
+result $? "Missing physical volume"
+
+finish
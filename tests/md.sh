@@ -0,0 +1,188 @@
+#!/bin/bash
+# Check the loader assembles md RAID1 arrays built by mdadm
+# Copyright (C) 2007-2024 Daniel Collins <solemnwarning@solemnwarning.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Each case creates an array on loop devices with mdadm, writes some data to
+# it and stops it, then has tests/blockdev assemble it with the loader's code
+# and checks the kernel ended up with the same array and data.
+#
+# Must be run as root from the top of the source tree after building
+# tests/blockdev, needs mdadm, losetup and the md RAID1 driver. udev rules which
+# assemble arrays as their members appear must not act on loop devices, or
+# they will race the loader for the arrays.
+
+# Stop any arrays on our loop devices
+teardown() {
+	for md in `ls /sys/block | grep '^md'`
+	do
+		for loop in $loops
+		do
+			if [ -e "/sys/block/$md/slaves/$loop" ]
+			then
+				mdadm --stop "/dev/$md" > /dev/null 2>&1
+				break
+			fi
+		done
+	done
+}
+
+. tests/loop.sh
+
+require mdadm
+
+modprobe raid1 > /dev/null 2>&1
+
+# Print the md device a loop device is a member of
+holder() {
+	ls "/sys/block/$1/holders" 2> /dev/null | grep '^md' | head -n 1
+}
+
+# Print a value from mdadm --detail --export
+detail() {
+	mdadm --detail --export "/dev/$1" | sed -n "s/^$2=//p"
+}
+
+# Create an array from the given loop devices, write $tmp/data to it and stop
+# it. Sets name and uuid from what mdadm reports.
+create_array() {
+	local metadata=$1
+	shift
+	
+	local devs="" dev
+	for dev in "$@"
+	do
+		devs="$devs /dev/$dev"
+	done
+	
+	mdadm --create --run "/dev/md/kltest" --metadata=$metadata --level=1 \
+		--raid-devices=$# --assume-clean --name=kltest --homehost=kexec-loader \
+		$devs > /dev/null 2>&1 || return 1
+	
+	local md=`holder $1`
+	if [ -z "$md" ]
+	then
+		return 1
+	fi
+	
+	name=`detail $md MD_NAME`
+	uuid=`detail $md MD_UUID`
+	
+	write_data "/dev/$md" || return 1
+	
+	mdadm --stop "/dev/$md" > /dev/null 2>&1
+}
+
+# Check the array holding the first loop device matches the one created
+check_array() {
+	local expect_degraded=$1 md=`holder $2` ok=0
+	
+	check "array holding $2" "${md:-none}" "`holder $3`" || ok=1
+	
+	if [ -z "$md" ]
+	then
+		return 1
+	fi
+	
+	check "MD_UUID" "`detail $md MD_UUID`" "$uuid" || ok=1
+	check "MD_LEVEL" "`detail $md MD_LEVEL`" "raid1" || ok=1
+	check "degraded" "`cat /sys/block/$md/md/degraded`" "$expect_degraded" || ok=1
+	
+	check_data "/dev/$md" || ok=1
+	
+	return $ok
+}
+
+for metadata in 1.0 1.1 1.2
+do
+	new_loops
+	
+	ok=1
+	
+	if create_array $metadata $a $b
+	then
+		out=`./tests/blockdev md $a $b`
+		
+		check "tests/blockdev output" "$out" "started $name" && check_array 0 $a $b
+		ok=$?
+	else
+		echo "    Error creating array" 1>&2
+	fi
+	
+	result $ok "Metadata $metadata, both members"
+	detach
+done
+
+# Only starts with one member when told it may be degraded
+
+new_loops
+
+ok=1
+
+if create_array 1.2 $a $b
+then
+	check "tests/blockdev output" "`./tests/blockdev md $a`" "" \
+		&& check "array holding $a" "`holder $a`" ""
+	ok=$?
+	
+	if [ $ok -eq 0 ]
+	then
+		out=`./tests/blockdev md --degraded $a`
+		
+		check "tests/blockdev output" "$out" "started $name" && check_array 1 $a $a
+		ok=$?
+	fi
+else
+	echo "    Error creating array" 1>&2
+fi
+
+result $ok "Missing member, degraded only"
+detach
+
+# A member which missed writes (lower event count) is left out in favour of the
+# up to date one, so the array comes up degraded with the newer data.
+
+new_loops
+
+ok=1
+
+if create_array 1.2 $a $b \
+	&& mdadm --assemble --run /dev/md/kltest /dev/$a > /dev/null 2>&1 \
+	&& md=`holder $a` && [ -n "$md" ] \
+	&& write_data "/dev/$md" \
+	&& mdadm --stop "/dev/$md" > /dev/null 2>&1
+then
+	check "tests/blockdev output" "`./tests/blockdev md $a $b`" "" \
+		&& check "array holding $a" "`holder $a`" ""
+	ok=$?
+	
+	if [ $ok -eq 0 ]
+	then
+		out=`./tests/blockdev md --degraded $a $b`
+		
+		check "tests/blockdev output" "$out" "started $name" \
+			&& check "array holding $b" "`holder $b`" "" \
+			&& check_array 1 $a $a
+		ok=$?
+	fi
+else
+	echo "    Error creating array" 1>&2
+fi
+
+result $ok "Stale member left out"
+detach
+
+finish